@@ -9,11 +9,28 @@
  * is XORed with an input byte to produce a translated output byte.
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include "KStream.h"
+#include "stats.h"
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 
+/**
+ * @brief Defined when the XOR kernels are chosen from cpuid at run time.
+ *
+ * GCC and Clang can compile each x86 kernel for its own instruction set
+ * with a target attribute, independent of the flags of the build.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KS_X86_DISPATCH
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 /**
  * @brief Internal types and helpers for the keystream implementation.
  */
@@ -23,59 +40,244 @@
  */
 typedef uint8_t byte;
 
+/**
+ * @brief Number of keystream bytes generated per block in ks_translate().
+ *
+ * The keystream for one block is produced into a stack buffer and then
+ * XORed with the data in a separate, vectorized pass.
+ */
+#define KS_BLOCK 512
+
+/**
+ * @brief Number of independent streams advanced together by
+ *        ks_translate_multi().
+ *
+ * Each RC4 step is a chain of dependent loads through S. Interleaving
+ * several unrelated streams gives the core independent work to overlap
+ * with those loads.
+ */
+#define KS_MULTI_WAYS 4
+
+/**
+ * @brief Marks S as starting on a cache-line boundary, where supported.
+ */
+#if defined(__GNUC__)
+#define KS_ALIGNED __attribute__((aligned(KS_STATE_ALIGN)))
+#else
+#define KS_ALIGNED
+#endif
+
 /**
  * @brief Opaque struct definition (visible only in this file).
+ *
+ * Only the keystream state is kept: the key itself is not needed once
+ * ks_create() has run the key schedule. S is cache-line aligned, so it
+ * occupies exactly four 64-byte lines; i and j follow it in a fifth line
+ * that the kernels read once on entry and write once on exit, keeping
+ * them in registers in between.
  */
 struct KStream
 {
-    byte key[8]; /**< 8-byte key, derived from uint64_t input. */
-    int keylen;  /**< Length of key in bytes (always 8 here). */
-    byte S[256]; /**< State array for the cipher. */
-    int i;       /**< First permutation index. */
-    int j;       /**< Second permutation index. */
+    byte S[256] KS_ALIGNED; /**< State array for the cipher. */
+    byte i;                 /**< First permutation index. */
+    byte j;                 /**< Second permutation index. */
 };
 
 /**
- * @brief Swap the values of two bytes.
+ * @brief Compile-time check that the public storage size is large enough.
+ */
+typedef char ks_state_size_check[sizeof(KStream) <= KS_STATE_SIZE ? 1 : -1];
+
+#ifdef KS_STATS
+/**
+ * @brief Process-wide counters reported by ks_get_stats().
+ */
+static KStreamStats ks_stats;
+#endif
+
+/**
+ * @brief Count one translate call of `n` bytes timed from `start`.
+ */
+#define KS_COUNT_TRANSLATE(n, start) \
+    (STAT_ADD(ks_stats.translate_calls, 1), \
+     STAT_ADD(ks_stats.translate_bytes, (n)), \
+     STAT_ELAPSED(ks_stats.translate_ns, (start)))
+
+/**
+ * @brief Allocate suitably aligned storage for one KStream.
+ *
+ * @return Uninitialized KStream storage; never NULL.
+ */
+static KStream *ks_alloc(void)
+{
+    void *mem = NULL;
+    int rc = posix_memalign(&mem, KS_STATE_ALIGN, sizeof(KStream));
+    assert(rc == 0 && mem != NULL);
+    (void)rc;
+    STAT_ADD(ks_stats.allocs, 1);
+    return mem;
+}
+
+/**
+ * @brief RC4 key schedule for a key of any length.
+ *
+ * @param S       State array to initialize.
+ * @param key     Key bytes.
+ * @param keylen  Key length, 1 to 256.
  *
- * @param a Pointer to first byte.
- * @param b Pointer to second byte.
+ * @return The final value of j.
  */
-static inline void swap_bytes(byte *a, byte *b)
+static inline byte ks_schedule(byte *S, const byte *key, size_t keylen)
 {
-    byte tmp = *a;
-    *a = *b;
-    *b = tmp;
+    for (unsigned n = 0; n < 256; n++)
+    {
+        S[n] = (byte)n;
+    }
+
+    unsigned j = 0;
+    size_t k = 0;
+    for (unsigned i = 0; i < 256; i++)
+    {
+        byte t = S[i];
+        j = (j + t + key[k]) & 0xFF;
+        S[i] = S[j];
+        S[j] = t;
+        k = k + 1 == keylen ? 0 : k + 1;
+    }
+    return (byte)j;
 }
 
 /**
- * @brief Generate the next byte of the keystream.
+ * @brief RC4 key schedule specialized for 8-byte keys.
+ *
+ * The key index is the inner loop counter, so there is no modulo or
+ * wrap-around test, and the constant trip count lets the compiler unroll
+ * it completely with the key held in registers.
  *
- * Implements the "next_byte" pseudocode from the assignment:
+ * @param S    State array to initialize.
+ * @param key  Eight key bytes.
+ *
+ * @return The final value of j.
+ */
+static inline byte ks_schedule8(byte *S, const byte key[8])
+{
+    for (unsigned n = 0; n < 256; n++)
+    {
+        S[n] = (byte)n;
+    }
+
+    unsigned j = 0;
+    for (unsigned i = 0; i < 256; i += 8)
+    {
+        for (unsigned k = 0; k < 8; k++)
+        {
+            byte t = S[i + k];
+            j = (j + t + key[k]) & 0xFF;
+            S[i + k] = S[j];
+            S[j] = t;
+        }
+    }
+    return (byte)j;
+}
+
+/**
+ * @brief Run the keystream generator `num` steps and drop the output.
+ *
+ * The "next_byte" step from the assignment,
  *
  *   i := (i + 1) mod 256
  *   j := (j + S[i]) mod 256
  *   swap S[i], S[j]
  *   B := S[(S[i] + S[j]) mod 256]
- *   return B
  *
- * @param ks  A valid KStream instance.
+ * without computing B, with i and j in locals, starting from i = 0.
+ *
+ * @param ks   Instance whose S array has just been scheduled.
+ * @param j    Value of j left by the key schedule.
+ * @param num  Number of steps.
+ */
+static inline void ks_discard(KStream *ks, byte j, unsigned num)
+{
+    byte *S = ks->S;
+    unsigned i = 0;
+    unsigned jj = j;
+
+    for (unsigned n = 0; n < num; n++)
+    {
+        i = (i + 1) & 0xFF;
+        byte t = S[i];
+        jj = (jj + t) & 0xFF;
+        S[i] = S[jj];
+        S[jj] = t;
+    }
+
+    ks->i = (byte)i;
+    ks->j = (byte)jj;
+}
+
+/**
+ * @brief Key schedule plus discard, shared by ks_init() and ks_init_ex().
+ *
+ * Inlined into ks_init() with constant arguments, which leaves only the
+ * 8-byte schedule and a fixed-count discard loop there.
  *
- * @return Next keystream byte.
+ * @param storage  KS_STATE_SIZE bytes aligned to KS_STATE_ALIGN.
+ * @param key      Key bytes.
+ * @param keylen   Key length, 1 to 256.
+ * @param discard  Number of initial keystream bytes to drop.
  *
- * @pre  ks is not NULL and has been initialized.
+ * @return `storage`, viewed as an initialized KStream.
  */
-static byte ks_next_byte(KStream *ks)
+static inline KStream *ks_setup(void *storage, const byte *key,
+                                size_t keylen, unsigned discard)
 {
-    assert(ks != NULL);
+    assert(storage != NULL);
+    assert((uintptr_t)storage % KS_STATE_ALIGN == 0);
+    assert(key != NULL && keylen >= 1 && keylen <= 256);
 
-    ks->i = (ks->i + 1) & 0xFF;
-    ks->j = (ks->j + ks->S[ks->i]) & 0xFF;
+    KStream *ks = storage;
+    STAT_TIMER(ksa_start);
 
-    swap_bytes(&ks->S[ks->i], &ks->S[ks->j]);
+    byte j = keylen == 8 ? ks_schedule8(ks->S, key)
+                         : ks_schedule(ks->S, key, keylen);
 
-    byte idx = (byte)((ks->S[ks->i] + ks->S[ks->j]) & 0xFF);
-    return ks->S[idx];
+    STAT_ELAPSED(ks_stats.ksa_ns, ksa_start);
+    STAT_TIMER(discard_start);
+
+    ks_discard(ks, j, discard);
+
+    STAT_ELAPSED(ks_stats.discard_ns, discard_start);
+    STAT_ADD(ks_stats.creates, 1);
+    return ks;
+}
+
+/**
+ * @brief Initialize caller-provided storage as a KStream from a key.
+ *
+ * @param storage   KS_STATE_SIZE bytes aligned to KS_STATE_ALIGN.
+ * @param keybytes  Eight-byte array containing the binary key data.
+ *
+ * @return `storage`, viewed as an initialized KStream.
+ */
+KStream *ks_init(void *storage, const uint8_t keybytes[8])
+{
+    return ks_setup(storage, keybytes, 8, KS_DEFAULT_DISCARD);
+}
+
+/**
+ * @brief Initialize caller-provided storage from a key of any length.
+ *
+ * @param storage  KS_STATE_SIZE bytes aligned to KS_STATE_ALIGN.
+ * @param key      Key bytes.
+ * @param keylen   Key length, 1 to 256.
+ * @param discard  Number of initial keystream bytes to drop.
+ *
+ * @return `storage`, viewed as an initialized KStream.
+ */
+KStream *ks_init_ex(void *storage, const uint8_t *key, size_t keylen,
+                    unsigned discard)
+{
+    return ks_setup(storage, key, keylen, discard);
 }
 
 /**
@@ -87,35 +289,122 @@ static byte ks_next_byte(KStream *ks)
  */
 KStream *ks_create(const uint8_t keybytes[8])
 {
-    KStream *ks = malloc(sizeof(KStream));
-    assert(ks != NULL);
+    return ks_init(ks_alloc(), keybytes);
+}
 
-    for (int i = 0; i < 8; i++)
-    {
-        ks->key[i] = keybytes[i];
-    }
-    ks->keylen = 8;
+/**
+ * @brief Create a KStream from a key of any length.
+ *
+ * @param key      Key bytes.
+ * @param keylen   Key length, 1 to 256.
+ * @param discard  Number of initial keystream bytes to drop.
+ *
+ * @return Pointer to the initialized KStream structure.
+ */
+KStream *ks_create_ex(const uint8_t *key, size_t keylen, unsigned discard)
+{
+    return ks_init_ex(ks_alloc(), key, keylen, discard);
+}
 
-    for (int i = 0; i < 256; i++)
+/**
+ * @brief Create a KStream instance in storage from an allocator.
+ *
+ * @param keybytes  Eight-byte array containing the binary key data.
+ * @param alloc     Allocator hooks.
+ *
+ * @return Pointer to the initialized KStream, or NULL if out of memory.
+ */
+KStream *ks_create_with_alloc(const uint8_t keybytes[8],
+                              const KsAllocator *alloc)
+{
+    assert(alloc != NULL && alloc->alloc != NULL);
+
+    void *mem = alloc->alloc(alloc->ctx, sizeof(KStream), KS_STATE_ALIGN);
+    if (mem == NULL)
     {
-        ks->S[i] = (byte)i;
+        return NULL;
     }
+    STAT_ADD(ks_stats.allocs, 1);
+    return ks_init(mem, keybytes);
+}
 
-    ks->i = 0;
-    ks->j = 0;
+/**
+ * @brief Create an independent copy of a KStream instance.
+ *
+ * @param ks  Instance to copy.
+ *
+ * @return Pointer to the new KStream structure.
+ */
+KStream *ks_clone(const KStream *ks)
+{
+    assert(ks != NULL);
 
-    for (int i = 0; i < 256; i++)
-    {
-        ks->j = (ks->j + ks->S[i] + ks->key[i % ks->keylen]) & 0xFF;
-        swap_bytes(&ks->S[i], &ks->S[ks->j]);
-    }
+    KStream *copy = ks_alloc();
+
+    *copy = *ks;
+    return copy;
+}
+
+/**
+ * @brief Copy the state of one KStream instance into another.
+ *
+ * @param dst  Instance that receives the state.
+ * @param src  Instance whose state is copied.
+ */
+void ks_copy(KStream *dst, const KStream *src)
+{
+    assert(dst != NULL);
+    assert(src != NULL);
+
+    *dst = *src;
+}
 
-    ks->i = 0;
-    for (int n = 0; n < 1024; n++)
+/**
+ * @brief Serialize the keystream state of a KStream instance.
+ *
+ * @param ks     Instance to serialize.
+ * @param state  Receives S, i and j.
+ */
+void ks_save_state(const KStream *ks, uint8_t state[KS_SNAPSHOT_SIZE])
+{
+    assert(ks != NULL);
+    assert(state != NULL);
+
+    memcpy(state, ks->S, 256);
+    state[256] = ks->i;
+    state[257] = ks->j;
+}
+
+/**
+ * @brief Create a KStream instance from a serialized state.
+ *
+ * The S array is checked to be a permutation so that a corrupted
+ * snapshot is rejected rather than silently producing a weak keystream.
+ *
+ * @param state  Snapshot written by ks_save_state().
+ *
+ * @return Pointer to the new KStream structure, or NULL if invalid.
+ */
+KStream *ks_load_state(const uint8_t state[KS_SNAPSHOT_SIZE])
+{
+    assert(state != NULL);
+
+    byte seen[256] = {0};
+    for (int n = 0; n < 256; n++)
     {
-        (void)ks_next_byte(ks);
+        if (seen[state[n]])
+        {
+            return NULL;
+        }
+        seen[state[n]] = 1;
     }
 
+    KStream *ks = ks_alloc();
+
+    memcpy(ks->S, state, 256);
+    ks->i = state[256];
+    ks->j = state[257];
+
     return ks;
 }
 
@@ -134,18 +423,461 @@ void ks_destroy(KStream *ks)
     free(ks);
 }
 
+/**
+ * @brief Destroy a KStream made by ks_create_with_alloc().
+ *
+ * @param ks     Instance to destroy (may be NULL).
+ * @param alloc  Allocator the instance was created with.
+ */
+void ks_destroy_with_alloc(KStream *ks, const KsAllocator *alloc)
+{
+    assert(alloc != NULL);
+
+    if (ks != NULL && alloc->release != NULL)
+    {
+        alloc->release(alloc->ctx, ks);
+    }
+}
+
+/**
+ * @brief Produce keystream bytes with the state held in locals.
+ *
+ * This is the serial RC4 "next_byte" step of the assignment, run `num`
+ * times with S, i and j kept out of the struct until the end of the
+ * block.
+ *
+ * @param ks       Initialized KStream instance.
+ * @param ks_out   Receives `num` keystream bytes.
+ * @param num      Number of bytes to produce.
+ */
+static void generate_block(KStream *ks, byte *ks_out, size_t num)
+{
+    byte *S = ks->S;
+    unsigned i = ks->i;
+    unsigned j = ks->j;
+
+    for (size_t n = 0; n < num; n++)
+    {
+        i = (i + 1) & 0xFF;
+        byte si = S[i];
+        j = (j + si) & 0xFF;
+        byte sj = S[j];
+        S[i] = sj;
+        S[j] = si;
+        ks_out[n] = S[(si + sj) & 0xFF];
+    }
+
+    ks->i = (byte)i;
+    ks->j = (byte)j;
+}
+
+/**
+ * @brief Produce keystream for KS_MULTI_WAYS streams in lockstep.
+ *
+ * Runs one step of every stream per iteration. The inner loop has a
+ * constant trip count, so it is unrolled and each stream's S pointer and
+ * indices stay in registers.
+ *
+ * @param ks      The streams; must all be distinct.
+ * @param ks_out  ks_out[k] receives `num` keystream bytes of ks[k].
+ * @param num     Number of bytes to produce per stream.
+ */
+static void generate_block_multi(KStream *const *ks,
+                                 byte ks_out[][KS_BLOCK], size_t num)
+{
+    byte *S[KS_MULTI_WAYS];
+    unsigned i[KS_MULTI_WAYS];
+    unsigned j[KS_MULTI_WAYS];
+
+    for (int k = 0; k < KS_MULTI_WAYS; k++)
+    {
+        S[k] = ks[k]->S;
+        i[k] = ks[k]->i;
+        j[k] = ks[k]->j;
+    }
+
+    for (size_t n = 0; n < num; n++)
+    {
+        for (int k = 0; k < KS_MULTI_WAYS; k++)
+        {
+            i[k] = (i[k] + 1) & 0xFF;
+            byte si = S[k][i[k]];
+            j[k] = (j[k] + si) & 0xFF;
+            byte sj = S[k][j[k]];
+            S[k][i[k]] = sj;
+            S[k][j[k]] = si;
+            ks_out[k][n] = S[k][(si + sj) & 0xFF];
+        }
+    }
+
+    for (int k = 0; k < KS_MULTI_WAYS; k++)
+    {
+        ks[k]->i = (byte)i[k];
+        ks[k]->j = (byte)j[k];
+    }
+}
+
+/**
+ * @brief XOR kernel: dst[n] = src[n] ^ keys[n] for n < num.
+ *
+ * `dst` may be the same pointer as `src`, which is how the in-place
+ * variant uses it; any other overlap is not allowed.
+ */
+typedef void (*XorFn)(byte *dst, const byte *src, const byte *keys,
+                      size_t num);
+
+/**
+ * @brief Portable XOR kernel, 8 bytes at a time plus a byte tail.
+ *
+ * Also finishes the tail for the vector kernels.
+ *
+ * @param dst   Receives the XORed bytes.
+ * @param src   Data to XOR.
+ * @param keys  Keystream bytes.
+ * @param num   Number of bytes.
+ */
+static void xor_scalar(byte *dst, const byte *src, const byte *keys,
+                       size_t num)
+{
+    size_t n = 0;
+    for (; n + 8 <= num; n += 8)
+    {
+        uint64_t d;
+        uint64_t k;
+        memcpy(&d, src + n, 8);
+        memcpy(&k, keys + n, 8);
+        d ^= k;
+        memcpy(dst + n, &d, 8);
+    }
+
+    for (; n < num; n++)
+    {
+        dst[n] = src[n] ^ keys[n];
+    }
+}
+
+#if defined(KS_X86_DISPATCH)
+
+/**
+ * @brief XOR kernel using SSE2, 16 bytes at a time.
+ *
+ * @param dst   Receives the XORed bytes.
+ * @param src   Data to XOR.
+ * @param keys  Keystream bytes.
+ * @param num   Number of bytes.
+ */
+__attribute__((target("sse2"))) static void
+xor_sse2(byte *dst, const byte *src, const byte *keys, size_t num)
+{
+    size_t n = 0;
+    for (; n + 16 <= num; n += 16)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + n));
+        __m128i k = _mm_loadu_si128((const __m128i *)(keys + n));
+        _mm_storeu_si128((__m128i *)(dst + n), _mm_xor_si128(d, k));
+    }
+    xor_scalar(dst + n, src + n, keys + n, num - n);
+}
+
+/**
+ * @brief XOR kernel using AVX2, 32 bytes at a time.
+ *
+ * @param dst   Receives the XORed bytes.
+ * @param src   Data to XOR.
+ * @param keys  Keystream bytes.
+ * @param num   Number of bytes.
+ */
+__attribute__((target("avx2"))) static void
+xor_avx2(byte *dst, const byte *src, const byte *keys, size_t num)
+{
+    size_t n = 0;
+    for (; n + 32 <= num; n += 32)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(src + n));
+        __m256i k = _mm256_loadu_si256((const __m256i *)(keys + n));
+        _mm256_storeu_si256((__m256i *)(dst + n), _mm256_xor_si256(d, k));
+    }
+    xor_sse2(dst + n, src + n, keys + n, num - n);
+}
+
+/**
+ * @brief XOR kernel using AVX-512, 64 bytes at a time.
+ *
+ * @param dst   Receives the XORed bytes.
+ * @param src   Data to XOR.
+ * @param keys  Keystream bytes.
+ * @param num   Number of bytes.
+ */
+__attribute__((target("avx512f"))) static void
+xor_avx512(byte *dst, const byte *src, const byte *keys, size_t num)
+{
+    size_t n = 0;
+    for (; n + 64 <= num; n += 64)
+    {
+        __m512i d = _mm512_loadu_si512((const void *)(src + n));
+        __m512i k = _mm512_loadu_si512((const void *)(keys + n));
+        _mm512_storeu_si512((void *)(dst + n), _mm512_xor_si512(d, k));
+    }
+    xor_avx2(dst + n, src + n, keys + n, num - n);
+}
+
+/**
+ * @brief Report whether the CPU supports SSE2.
+ *
+ * @return Nonzero if supported.
+ */
+static int cpu_sse2(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+/**
+ * @brief Report whether the CPU supports AVX2.
+ *
+ * @return Nonzero if supported.
+ */
+static int cpu_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+/**
+ * @brief Report whether the CPU supports AVX-512F.
+ *
+ * @return Nonzero if supported.
+ */
+static int cpu_avx512(void)
+{
+    return __builtin_cpu_supports("avx512f");
+}
+
+#elif defined(__ARM_NEON)
+
+/**
+ * @brief XOR kernel using NEON, 16 bytes at a time.
+ *
+ * NEON is part of the baseline on AArch64 and on ARM builds that define
+ * __ARM_NEON, so it needs no run-time check.
+ *
+ * @param dst   Receives the XORed bytes.
+ * @param src   Data to XOR.
+ * @param keys  Keystream bytes.
+ * @param num   Number of bytes.
+ */
+static void xor_neon(byte *dst, const byte *src, const byte *keys,
+                     size_t num)
+{
+    size_t n = 0;
+    for (; n + 16 <= num; n += 16)
+    {
+        vst1q_u8(dst + n, veorq_u8(vld1q_u8(src + n), vld1q_u8(keys + n)));
+    }
+    xor_scalar(dst + n, src + n, keys + n, num - n);
+}
+
+#endif
+
+/**
+ * @brief Report that a kernel needs no CPU features.
+ *
+ * @return Always 1.
+ */
+static int cpu_any(void)
+{
+    return 1;
+}
+
+/**
+ * @brief One XOR kernel and the check for whether it can run here.
+ */
+typedef struct
+{
+    const char *name;       /**< Name used by KSTREAM_IMPL. */
+    XorFn xor;              /**< The kernel. */
+    int (*supported)(void); /**< Nonzero if the CPU can run it. */
+} KsImpl;
+
+/**
+ * @brief Kernels built into this binary, fastest first.
+ */
+static const KsImpl ks_impls[] = {
+#if defined(KS_X86_DISPATCH)
+    {"avx512", xor_avx512, cpu_avx512},
+    {"avx2", xor_avx2, cpu_avx2},
+    {"sse2", xor_sse2, cpu_sse2},
+#elif defined(__ARM_NEON)
+    {"neon", xor_neon, cpu_any},
+#endif
+    {"scalar", xor_scalar, cpu_any},
+};
+
+/**
+ * @brief Kernel in use, or NULL until the first call of ks_impl().
+ */
+static const KsImpl *ks_impl_chosen = NULL;
+
+/**
+ * @brief Pick the kernel for this process.
+ *
+ * KSTREAM_IMPL names a kernel to use instead of the fastest supported
+ * one; a name that is unknown or not supported by the CPU is ignored.
+ *
+ * @return The chosen kernel.
+ */
+static const KsImpl *ks_impl_select(void)
+{
+    size_t count = sizeof(ks_impls) / sizeof(ks_impls[0]);
+
+#if defined(KS_X86_DISPATCH)
+    __builtin_cpu_init();
+#endif
+
+    const char *want = getenv("KSTREAM_IMPL");
+    for (size_t n = 0; want != NULL && n < count; n++)
+    {
+        if (strcmp(want, ks_impls[n].name) == 0 && ks_impls[n].supported())
+        {
+            return &ks_impls[n];
+        }
+    }
+
+    for (size_t n = 0; n < count; n++)
+    {
+        if (ks_impls[n].supported())
+        {
+            return &ks_impls[n];
+        }
+    }
+    return &ks_impls[count - 1];
+}
+
+/**
+ * @brief Kernel in use, choosing it on the first call.
+ *
+ * Threads racing on the first call all choose the same kernel, so the
+ * pointer only needs to be published atomically.
+ *
+ * @return The kernel in use.
+ */
+static inline const KsImpl *ks_impl(void)
+{
+#if defined(__GNUC__)
+    const KsImpl *impl = __atomic_load_n(&ks_impl_chosen, __ATOMIC_ACQUIRE);
+    if (impl == NULL)
+    {
+        impl = ks_impl_select();
+        __atomic_store_n(&ks_impl_chosen, impl, __ATOMIC_RELEASE);
+    }
+#else
+    const KsImpl *impl = ks_impl_chosen;
+    if (impl == NULL)
+    {
+        impl = ks_impl_select();
+        ks_impl_chosen = impl;
+    }
+#endif
+    return impl;
+}
+
+/**
+ * @brief XOR a block of data with a block of keystream.
+ *
+ * Goes through the kernel chosen for this CPU. `dst` may be the same
+ * pointer as `src`; any other overlap is not allowed.
+ *
+ * @param dst   Receives the XORed bytes.
+ * @param src   Data to XOR.
+ * @param keys  Keystream bytes.
+ * @param num   Number of bytes.
+ */
+static inline void xor_block(byte *dst, const byte *src, const byte *keys,
+                             size_t num)
+{
+    ks_impl()->xor(dst, src, keys, num);
+}
+
+/**
+ * @brief Name of the XOR kernel in use.
+ *
+ * @return A static string such as "avx2" or "scalar".
+ */
+const char *ks_impl_name(void)
+{
+    return ks_impl()->name;
+}
+
+/**
+ * @brief Generate raw keystream bytes.
+ *
+ * @param ks      Initialized KStream instance.
+ * @param ks_out  Buffer that receives the keystream.
+ * @param num     Number of keystream bytes to produce.
+ */
+void ks_generate(KStream *ks, uint8_t *ks_out, size_t num)
+{
+    assert(ks != NULL);
+    if (num == 0)
+    {
+        return;
+    }
+    assert(ks_out != NULL);
+
+    generate_block(ks, ks_out, num);
+}
+
+/**
+ * @brief XOR previously generated keystream into a buffer.
+ *
+ * @param buf        Buffer to translate in place.
+ * @param keystream  Keystream bytes from ks_generate().
+ * @param num        Number of bytes.
+ */
+void ks_xor_keystream(uint8_t *buf, const uint8_t *keystream, size_t num)
+{
+    if (num == 0)
+    {
+        return;
+    }
+    assert(buf != NULL);
+    assert(keystream != NULL);
+
+    xor_block(buf, buf, keystream, num);
+}
+
+/**
+ * @brief Discard keystream bytes.
+ *
+ * @param ks   Initialized KStream instance.
+ * @param num  Number of keystream bytes to skip.
+ */
+void ks_skip(KStream *ks, uint64_t num)
+{
+    assert(ks != NULL);
+
+    byte scratch[KS_BLOCK];
+
+    while (num > 0)
+    {
+        size_t len = num < KS_BLOCK ? (size_t)num : KS_BLOCK;
+        generate_block(ks, scratch, len);
+        num -= len;
+    }
+}
+
 /**
  * @brief Translate bytes using the keystream.
  *
  * Uses XOR with successive keystream bytes to turn plaintext into ciphertext
- * or ciphertext back into plaintext.
+ * or ciphertext back into plaintext. The keystream is generated KS_BLOCK
+ * bytes at a time and then XORed with the data by xor_block().
  *
  * @param ks   Initialized KStream instance.
  * @param in   Input buffer containing plaintext or ciphertext data.
  * @param out  Output buffer that receives translated bytes.
  * @param num  Number of bytes to translate.
  */
-void ks_translate(KStream *ks, const uint8_t *in, uint8_t *out, size_t num)
+void ks_translate(KStream *ks, const uint8_t *restrict in,
+                  uint8_t *restrict out, size_t num)
 {
     assert(ks != NULL);
     if (num == 0)
@@ -155,9 +887,177 @@ void ks_translate(KStream *ks, const uint8_t *in, uint8_t *out, size_t num)
     assert(in != NULL);
     assert(out != NULL);
 
-    for (size_t i = 0; i < num; i++)
+    byte keys[KS_BLOCK];
+    STAT_TIMER(start);
+
+    for (size_t off = 0; off < num; off += KS_BLOCK)
     {
-        byte k = ks_next_byte(ks);
-        out[i] = in[i] ^ k;
+        size_t len = num - off < KS_BLOCK ? num - off : KS_BLOCK;
+        generate_block(ks, keys, len);
+        xor_block(out + off, in + off, keys, len);
     }
+
+    KS_COUNT_TRANSLATE(num, start);
+}
+
+/**
+ * @brief Translate a buffer in place using the keystream.
+ *
+ * Same block structure as ks_translate(), with xor_block() reading and
+ * writing the same buffer.
+ *
+ * @param ks   Initialized KStream instance.
+ * @param buf  Buffer whose bytes are replaced by their translation.
+ * @param num  Number of bytes to translate.
+ */
+void ks_translate_inplace(KStream *ks, uint8_t *buf, size_t num)
+{
+    assert(ks != NULL);
+    if (num == 0)
+    {
+        return;
+    }
+    assert(buf != NULL);
+
+    byte keys[KS_BLOCK];
+    STAT_TIMER(start);
+
+    for (size_t off = 0; off < num; off += KS_BLOCK)
+    {
+        size_t len = num - off < KS_BLOCK ? num - off : KS_BLOCK;
+        generate_block(ks, keys, len);
+        xor_block(buf + off, buf + off, keys, len);
+    }
+
+    KS_COUNT_TRANSLATE(num, start);
+}
+
+/**
+ * @brief Translate several independent streams at once.
+ *
+ * The streams share KS_MULTI_WAYS lanes whose keystream is generated in
+ * lockstep, one block at a time. A block is as long as the shortest
+ * remainder among the lanes, so a lane whose stream finishes is refilled
+ * straight away from the streams still waiting, and streams of mixed
+ * lengths keep all lanes busy. Once fewer than KS_MULTI_WAYS streams are
+ * left, they are finished one at a time through ks_translate() or
+ * ks_translate_inplace().
+ *
+ * @param streams  Streams to advance; must all be distinct.
+ * @param in       in[k] is the input for streams[k].
+ * @param out      out[k] receives the translation of in[k].
+ * @param len      len[k] is the number of bytes for streams[k].
+ * @param count    Number of streams.
+ */
+void ks_translate_multi(KStream *const *streams, const uint8_t *const *in,
+                        uint8_t *const *out, const size_t *len, size_t count)
+{
+    assert(count == 0 || (streams != NULL && in != NULL && out != NULL &&
+                          len != NULL));
+
+    KStream *lane[KS_MULTI_WAYS];
+    size_t cur[KS_MULTI_WAYS]; /* stream in each busy lane */
+    size_t pos[KS_MULTI_WAYS]; /* bytes of it translated so far */
+    int busy = 0;
+    size_t next = 0;
+    uint64_t lockstep = 0;
+    byte keys[KS_MULTI_WAYS][KS_BLOCK];
+    STAT_TIMER(start);
+
+    for (;;)
+    {
+        while (busy < KS_MULTI_WAYS && next < count)
+        {
+            if (len[next] > 0)
+            {
+                lane[busy] = streams[next];
+                cur[busy] = next;
+                pos[busy] = 0;
+                busy++;
+            }
+            next++;
+        }
+        if (busy < KS_MULTI_WAYS)
+        {
+            break;
+        }
+
+        size_t blen = KS_BLOCK;
+        for (int w = 0; w < KS_MULTI_WAYS; w++)
+        {
+            if (len[cur[w]] - pos[w] < blen)
+            {
+                blen = len[cur[w]] - pos[w];
+            }
+        }
+
+        generate_block_multi(lane, keys, blen);
+        for (int w = 0; w < KS_MULTI_WAYS; w++)
+        {
+            xor_block(out[cur[w]] + pos[w], in[cur[w]] + pos[w], keys[w],
+                      blen);
+            pos[w] += blen;
+        }
+        lockstep += (uint64_t)blen * KS_MULTI_WAYS;
+
+        /* free the lanes whose stream is done, keeping busy ones first */
+        for (int w = 0; w < busy;)
+        {
+            if (pos[w] == len[cur[w]])
+            {
+                busy--;
+                lane[w] = lane[busy];
+                cur[w] = cur[busy];
+                pos[w] = pos[busy];
+            }
+            else
+            {
+                w++;
+            }
+        }
+    }
+
+    /* the remainders below count themselves through ks_translate() */
+    KS_COUNT_TRANSLATE(lockstep, start);
+
+    for (int w = 0; w < busy; w++)
+    {
+        size_t k = cur[w];
+        size_t rest = len[k] - pos[w];
+        if (in[k] == out[k])
+        {
+            ks_translate_inplace(streams[k], out[k] + pos[w], rest);
+        }
+        else
+        {
+            ks_translate(streams[k], in[k] + pos[w], out[k] + pos[w], rest);
+        }
+    }
+}
+
+/**
+ * @brief Read the process-wide KStream counters.
+ *
+ * @param out  Receives the counters.
+ *
+ * @return 0 if counters are compiled in, or -1 if they are not.
+ */
+int ks_get_stats(KStreamStats *out)
+{
+    assert(out != NULL);
+
+#ifdef KS_STATS
+    /* relaxed loads of each field; the snapshot is not atomic as a whole */
+    out->creates = STAT_LOAD(ks_stats.creates);
+    out->ksa_ns = STAT_LOAD(ks_stats.ksa_ns);
+    out->discard_ns = STAT_LOAD(ks_stats.discard_ns);
+    out->allocs = STAT_LOAD(ks_stats.allocs);
+    out->translate_calls = STAT_LOAD(ks_stats.translate_calls);
+    out->translate_bytes = STAT_LOAD(ks_stats.translate_bytes);
+    out->translate_ns = STAT_LOAD(ks_stats.translate_ns);
+    return 0;
+#else
+    memset(out, 0, sizeof(*out));
+    return -1;
+#endif
 }
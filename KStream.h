@@ -18,10 +18,28 @@
  *
  * 2. In ks_translate(), the **client allocates the output buffer**.
  *    The function fills it with translated bytes. This avoids repeated
- *    malloc/free calls and allows the client to reuse buffers.
+ *    malloc/free calls and allows the client to reuse buffers. Clients
+ *    that do not need to keep the input can use ks_translate_inplace()
+ *    and skip the output buffer altogether.
  *
  * 3. The KStream struct is intentionally opaque. Clients cannot see the
  *    internal fields or manipulate the algorithm state.
+ *
+ * 4. The XOR kernel is chosen once per process from the CPU features
+ *    found at run time (AVX-512, AVX2 or SSE2 on x86, NEON on ARM, else
+ *    a portable one), so one binary runs at full speed on every host.
+ *    Setting KSTREAM_IMPL to one of "avx512", "avx2", "sse2", "neon" or
+ *    "scalar" forces a kernel for A/B comparisons; names the CPU or
+ *    build does not support are ignored.
+ *
+ * 5. The header is usable from C++, and `make lib` builds libkstream.a
+ *    and libkstream.so for embedding. The shared library exports only
+ *    the functions declared here, under the KSTREAM_1 symbol version
+ *    (see kstream.map). KStream stays opaque, so its layout can change
+ *    without breaking callers; KS_STATE_SIZE, KS_STATE_ALIGN and
+ *    KS_SNAPSHOT_SIZE are part of the ABI, and changing any of them
+ *    means a new KS_ABI_VERSION and soname. kstream.hpp wraps the API
+ *    in a C++ class.
  */
 
 #ifndef KSTREAM_H
@@ -36,11 +54,62 @@
  */
 #include <stdint.h>
 
+/**
+ * @brief Major version of the library ABI, also the soname suffix.
+ */
+#define KS_ABI_VERSION 1
+
+/**
+ * @brief `restrict` in C, and the equivalent extension in C++.
+ */
+#if !defined(__cplusplus)
+#define KS_RESTRICT restrict
+#elif defined(__GNUC__) || defined(_MSC_VER)
+#define KS_RESTRICT __restrict
+#else
+#define KS_RESTRICT
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 /**
  * @brief Opaque data type for the KStream object.
  */
 typedef struct KStream KStream;
 
+/**
+ * @brief Number of bytes of storage occupied by one KStream.
+ *
+ * Callers that want to embed streams in their own arrays instead of
+ * allocating each one with ks_create() reserve this many bytes per
+ * stream and pass the storage to ks_init().
+ */
+#define KS_STATE_SIZE 320
+
+/**
+ * @brief Required alignment, in bytes, of KStream storage for ks_init().
+ *
+ * The S array starts at the beginning of the storage and is kept on a
+ * cache-line boundary.
+ */
+#define KS_STATE_ALIGN 64
+
+/**
+ * @brief Number of initial keystream bytes ks_create() discards.
+ */
+#define KS_DEFAULT_DISCARD 1024
+
+/**
+ * @brief Size in bytes of a serialized KStream state.
+ *
+ * A snapshot holds the 256-byte S array followed by the i and j indices,
+ * one byte each.
+ */
+#define KS_SNAPSHOT_SIZE 258
+
 /**
  * @brief Create and initialize a new KStream instance.
  *
@@ -58,6 +127,62 @@ typedef struct KStream KStream;
  */
 KStream *ks_create(const uint8_t keybytes[8]);
 
+/**
+ * @brief Initialize a KStream in caller-provided storage.
+ *
+ * Performs the same key schedule and 1024-byte discard as ks_create(),
+ * but without allocating. This lets callers hold many streams in one
+ * array, e.g.
+ *
+ *      static unsigned char pool[N][KS_STATE_SIZE]
+ *          __attribute__((aligned(KS_STATE_ALIGN)));
+ *      KStream *ks = ks_init(pool[n], key);
+ *
+ * A stream initialized this way must not be passed to ks_destroy(); its
+ * storage belongs to the caller.
+ *
+ * @param storage   At least KS_STATE_SIZE bytes, aligned to KS_STATE_ALIGN.
+ * @param keybytes  An eight-byte array containing the binary key.
+ *
+ * @return `storage`, viewed as an initialized KStream.
+ *
+ * @pre  `storage` is suitably sized and aligned.
+ */
+KStream *ks_init(void *storage, const uint8_t keybytes[8]);
+
+/**
+ * @brief Create a KStream from a key of any length.
+ *
+ * ks_create() is the fast path for the 8-byte keys used by mcrypt, with
+ * the key length and the KS_DEFAULT_DISCARD discard fixed at compile
+ * time. This variant takes both at run time for other key sizes;
+ * ks_create_ex(key, 8, KS_DEFAULT_DISCARD) produces the same stream as
+ * ks_create(key). As in ks_create(), the generator starts from the j
+ * left by the key schedule rather than from 0.
+ *
+ * @param key      Key bytes.
+ * @param keylen   Key length, 1 to 256.
+ * @param discard  Number of initial keystream bytes to drop.
+ *
+ * @return Pointer to a newly allocated and initialized KStream.
+ */
+KStream *ks_create_ex(const uint8_t *key, size_t keylen, unsigned discard);
+
+/**
+ * @brief Initialize caller-provided storage from a key of any length.
+ *
+ * The ks_init() counterpart of ks_create_ex().
+ *
+ * @param storage  At least KS_STATE_SIZE bytes, aligned to KS_STATE_ALIGN.
+ * @param key      Key bytes.
+ * @param keylen   Key length, 1 to 256.
+ * @param discard  Number of initial keystream bytes to drop.
+ *
+ * @return `storage`, viewed as an initialized KStream.
+ */
+KStream *ks_init_ex(void *storage, const uint8_t *key, size_t keylen,
+                    unsigned discard);
+
 /**
  * @brief Destroy a KStream instance and free all associated memory.
  *
@@ -68,6 +193,45 @@ KStream *ks_create(const uint8_t keybytes[8]);
  */
 void ks_destroy(KStream *ks);
 
+/**
+ * @brief Caller-supplied memory hooks for KStream instances.
+ *
+ * Lets programs that create and destroy many streams take them from a
+ * pool or arena instead of the general-purpose heap.
+ */
+typedef struct
+{
+    /** Return `size` bytes aligned to `align`, or NULL if exhausted. */
+    void *(*alloc)(void *ctx, size_t size, size_t align);
+    /** Give back storage from alloc; may be NULL for arenas that are
+     *  released as a whole. */
+    void (*release)(void *ctx, void *ptr);
+    void *ctx; /**< Passed unchanged to both hooks. */
+} KsAllocator;
+
+/**
+ * @brief Create a KStream in storage obtained from an allocator.
+ *
+ * Same as ks_create(), except that the storage comes from
+ * `alloc->alloc` and must be given back with ks_destroy_with_alloc()
+ * using the same allocator.
+ *
+ * @param keybytes  An eight-byte array containing the binary key.
+ * @param alloc     Allocator hooks; `alloc->alloc` must not be NULL.
+ *
+ * @return A new KStream, or NULL if the allocator returned NULL.
+ */
+KStream *ks_create_with_alloc(const uint8_t keybytes[8],
+                              const KsAllocator *alloc);
+
+/**
+ * @brief Destroy a KStream made by ks_create_with_alloc().
+ *
+ * @param ks     Instance to destroy (may be NULL).
+ * @param alloc  The allocator the instance was created with.
+ */
+void ks_destroy_with_alloc(KStream *ks, const KsAllocator *alloc);
+
 /**
  * @brief Translate input bytes to output bytes using the KStream.
  *
@@ -77,6 +241,9 @@ void ks_destroy(KStream *ks);
  * The caller allocates both the input and output buffers. The output
  * buffer must be at least `num` bytes long.
  *
+ * Aliasing contract: `in` and `out` must not overlap. To translate a
+ * buffer in place, call ks_translate_inplace() instead.
+ *
  * @param ks        A valid KStream instance.
  * @param in        Pointer to input buffer containing plaintext or ciphertext.
  * @param out       Pointer to output buffer (must be pre-allocated).
@@ -84,12 +251,194 @@ void ks_destroy(KStream *ks);
  *
  * @pre  ks is initialized. `in` and `out` point to valid buffers.
  * @pre  `out` has room for at least `num` bytes.
+ * @pre  The ranges [in, in + num) and [out, out + num) do not overlap.
  *
  * @post `out` contains the XOR-translated bytes.
  *
  * @return void
  */
-void ks_translate(KStream *ks, const uint8_t *in, uint8_t *out, size_t num);
+void ks_translate(KStream *ks, const uint8_t *KS_RESTRICT in,
+                  uint8_t *KS_RESTRICT out, size_t num);
+
+/**
+ * @brief Translate a buffer in place using the KStream.
+ *
+ * Every byte of `buf` is replaced by what ks_translate() would produce
+ * for it with a separate output buffer. Passing the same buffer as both
+ * arguments of ks_translate() is not allowed; this is the call for that.
+ * Consumes the same keystream bytes as ks_translate(), so the two calls
+ * can be mixed freely on one stream.
+ *
+ * @param ks   A valid KStream instance.
+ * @param buf  Buffer holding the bytes to translate; overwritten.
+ * @param num  Number of bytes to translate.
+ *
+ * @pre  ks is initialized. `buf` points to at least `num` bytes.
+ *
+ * @post `buf` contains the XOR-translated bytes.
+ */
+void ks_translate_inplace(KStream *ks, uint8_t *buf, size_t num);
+
+/**
+ * @brief Generate raw keystream bytes.
+ *
+ * Writes the next `num` keystream bytes to `ks_out` and advances the
+ * stream past them, exactly as if `num` bytes had been translated.
+ * XORing data with these bytes gives the same result as ks_translate(),
+ * which lets callers produce keystream ahead of time and apply it once
+ * the data is available.
+ *
+ * @param ks      A valid KStream instance.
+ * @param ks_out  Buffer that receives the keystream.
+ * @param num     Number of keystream bytes to produce.
+ *
+ * @pre  ks is initialized. `ks_out` has room for at least `num` bytes.
+ *
+ * @post `ks_out` holds the keystream; the stream has advanced by `num`.
+ */
+void ks_generate(KStream *ks, uint8_t *ks_out, size_t num);
+
+/**
+ * @brief XOR previously generated keystream into a buffer.
+ *
+ * The second half of ks_translate_inplace(), for keystream produced
+ * ahead of time with ks_generate(). Uses the same vectorized XOR as the
+ * translate functions and does not touch any KStream.
+ *
+ * @param buf        Buffer whose bytes are replaced by their translation.
+ * @param keystream  `num` bytes from ks_generate(); may not overlap `buf`.
+ * @param num        Number of bytes.
+ */
+void ks_xor_keystream(uint8_t *buf, const uint8_t *keystream, size_t num);
+
+/**
+ * @brief Translate data for several independent KStreams at once.
+ *
+ * Equivalent to calling ks_translate(streams[k], in[k], out[k], len[k])
+ * for every k, but the streams are advanced in interleaved lanes so
+ * that the serial dependency chain of one stream overlaps with the work
+ * of the others; a lane whose stream finishes takes the next one, so
+ * the lengths need not match. Aggregate throughput per core is higher
+ * than that of a loop over ks_translate() when many streams are active,
+ * e.g. one per record or per tenant.
+ *
+ * Aliasing contract: out[k] may equal in[k] for in-place translation;
+ * otherwise no two of the buffers may overlap.
+ *
+ * @param streams  Array of `count` streams; no stream may appear twice.
+ * @param in       Array of `count` input buffers.
+ * @param out      Array of `count` output buffers.
+ * @param len      Array of `count` byte counts.
+ * @param count    Number of streams.
+ *
+ * @pre  Every streams[k] is initialized, and in[k] and out[k] point to at
+ *       least len[k] bytes.
+ */
+void ks_translate_multi(KStream *const *streams, const uint8_t *const *in,
+                        uint8_t *const *out, const size_t *len, size_t count);
+
+/**
+ * @brief Advance a KStream without producing output.
+ *
+ * Discards the next `num` keystream bytes, leaving the stream where it
+ * would be after translating `num` bytes. Combined with a snapshot from
+ * ks_save_state() taken at a known offset, this positions a stream at
+ * any later offset without touching the data that precedes it.
+ *
+ * @param ks   A valid KStream instance.
+ * @param num  Number of keystream bytes to skip.
+ */
+void ks_skip(KStream *ks, uint64_t num);
+
+/**
+ * @brief Create an independent copy of a KStream.
+ *
+ * The copy starts at exactly the same point in the keystream as `ks`,
+ * and from then on the two streams advance separately. Cloning a freshly
+ * created stream skips the key schedule and the 1024-byte discard, so a
+ * caller encrypting many records under one key can prime a template once
+ * and clone it for each record.
+ *
+ * @param ks  A valid KStream instance.
+ *
+ * @return A new heap-allocated KStream; destroy it with ks_destroy().
+ */
+KStream *ks_clone(const KStream *ks);
+
+/**
+ * @brief Overwrite the state of one KStream with that of another.
+ *
+ * Like ks_clone(), but reuses an existing instance instead of allocating
+ * a new one.
+ *
+ * @param dst  Stream whose state is replaced.
+ * @param src  Stream whose state is copied.
+ *
+ * @post `dst` produces the same keystream as `src` would from now on.
+ */
+void ks_copy(KStream *dst, const KStream *src);
+
+/**
+ * @brief Serialize the current state of a KStream.
+ *
+ * @param ks     A valid KStream instance.
+ * @param state  Receives KS_SNAPSHOT_SIZE bytes: S, then i, then j.
+ */
+void ks_save_state(const KStream *ks, uint8_t state[KS_SNAPSHOT_SIZE]);
+
+/**
+ * @brief Create a KStream from a serialized state.
+ *
+ * The new stream continues the keystream from the point at which the
+ * snapshot was taken with ks_save_state(). No key schedule or discard
+ * is performed.
+ *
+ * @param state  KS_SNAPSHOT_SIZE bytes written by ks_save_state().
+ *
+ * @return A new heap-allocated KStream, or NULL if the S array in the
+ *         snapshot is not a permutation of 0-255.
+ */
+KStream *ks_load_state(const uint8_t state[KS_SNAPSHOT_SIZE]);
+
+/**
+ * @brief Process-wide KStream counters, see ks_get_stats().
+ *
+ * Times are in nanoseconds of wall-clock time summed over all threads.
+ */
+typedef struct
+{
+    uint64_t creates;         /**< Key schedules run by ks_init(). */
+    uint64_t ksa_ns;          /**< Time in the key scheduling loop. */
+    uint64_t discard_ns;      /**< Time discarding the first 1024 bytes. */
+    uint64_t allocs;          /**< KStream allocations. */
+    uint64_t translate_calls; /**< Calls to the translate functions. */
+    uint64_t translate_bytes; /**< Bytes translated. */
+    uint64_t translate_ns;    /**< Time spent translating. */
+} KStreamStats;
+
+/**
+ * @brief Read the process-wide KStream counters.
+ *
+ * The counters exist only when the module is built with KS_STATS
+ * defined (make STATS=1); otherwise nothing is counted and `out` is
+ * zeroed.
+ *
+ * @param out  Receives the counters.
+ *
+ * @return 0 if counters are compiled in, or -1 if they are not.
+ */
+int ks_get_stats(KStreamStats *out);
+
+/**
+ * @brief Name of the XOR kernel chosen for this process.
+ *
+ * @return A static string, one of the KSTREAM_IMPL names.
+ */
+const char *ks_impl_name(void);
+
+#ifdef __cplusplus
+}
+#endif
 
 /**
  * @brief End of the KSTREAM_H include guard.
@@ -0,0 +1,179 @@
+/**
+ * @file affinity.c
+ * @author Shane Girolamo
+ *
+ * @brief Implementation of NUMA-aware worker placement.
+ *
+ * The node topology is loaded once, on the first worker that asks for
+ * it: each node's cpulist is parsed into a CPU set and intersected with
+ * the process affinity mask, and nodes left without CPUs are dropped.
+ */
+
+#define _GNU_SOURCE
+
+#include "affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * @brief Highest number of NUMA nodes considered.
+ */
+#define AFFINITY_MAX_NODES 64
+
+/**
+ * @brief Usable CPUs of each node in node_ids.
+ */
+static cpu_set_t node_cpus[AFFINITY_MAX_NODES];
+
+/**
+ * @brief Kernel numbers of the usable nodes.
+ */
+static int node_ids[AFFINITY_MAX_NODES];
+
+/**
+ * @brief Number of entries in node_cpus and node_ids.
+ */
+static int node_count = 0;
+
+/**
+ * @brief Nonzero once affinity_enable() has turned placement on.
+ */
+static int enabled = 0;
+
+/**
+ * @brief Makes sure the topology is loaded exactly once.
+ */
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Turn worker placement on or off.
+ *
+ * @param enable  Nonzero to pin workers to NUMA nodes.
+ */
+void affinity_enable(int enable)
+{
+    enabled = enable;
+}
+
+/**
+ * @brief Parse a kernel CPU list such as "0-3,8-11".
+ *
+ * @param list  The list, possibly ending in a newline.
+ * @param set   Receives the CPUs.
+ *
+ * @return 0 on success, or -1 if the list is malformed.
+ */
+static int parse_cpulist(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    while (*list != '\0' && *list != '\n')
+    {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0)
+        {
+            return -1;
+        }
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+            {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+        {
+            CPU_SET((int)cpu, set);
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+/**
+ * @brief Load the usable NUMA nodes into node_cpus and node_ids.
+ */
+static void load_topology(void)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return;
+    }
+
+    for (int node = 0; node < AFFINITY_MAX_NODES; node++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (f == NULL)
+        {
+            continue;
+        }
+
+        char line[4096];
+        cpu_set_t cpus;
+        if (fgets(line, sizeof(line), f) != NULL &&
+            parse_cpulist(line, &cpus) == 0)
+        {
+            CPU_AND(&cpus, &cpus, &allowed);
+            if (CPU_COUNT(&cpus) > 0)
+            {
+                node_cpus[node_count] = cpus;
+                node_ids[node_count] = node;
+                node_count++;
+            }
+        }
+        fclose(f);
+    }
+}
+
+/**
+ * @brief Pin the calling worker thread to one NUMA node.
+ *
+ * @param index  Worker number within its pool, from 0.
+ *
+ * @return The node the thread was pinned to, or -1 if it was not.
+ */
+int affinity_pin_worker(int index)
+{
+    if (!enabled || index < 0)
+    {
+        return -1;
+    }
+    pthread_once(&topology_once, load_topology);
+    if (node_count == 0)
+    {
+        return -1;
+    }
+
+    int slot = index % node_count;
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                               &node_cpus[slot]) != 0)
+    {
+        return -1;
+    }
+    return node_ids[slot];
+}
+
+/**
+ * @brief NUMA node the calling thread is running on.
+ *
+ * @return The node, or 0 if placement is off or the node is unknown.
+ */
+int affinity_current_node(void)
+{
+    unsigned cpu;
+    unsigned node;
+    if (!enabled || getcpu(&cpu, &node) != 0)
+    {
+        return 0;
+    }
+    return (int)node;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file affinity.h
+ * @author Shane Girolamo
+ *
+ * @brief NUMA-aware placement of worker threads.
+ *
+ * On a multi-socket host a worker that allocates its buffers and stream
+ * state and then migrates to the other socket pays for remote memory on
+ * every access. With placement enabled, the worker pools of batch and
+ * container mode pin each worker to the CPUs of one NUMA node before it
+ * allocates anything, handing nodes out round-robin so every socket gets
+ * its share. Linux places pages on the node of the thread that first
+ * touches them, so everything a pinned worker allocates stays local.
+ *
+ * The topology is read from /sys/devices/system/node and limited to the
+ * CPUs the process may run on, so taskset and cgroup limits still hold.
+ * No libnuma is needed; where the topology cannot be read, workers are
+ * simply left unpinned.
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+/**
+ * @brief Turn worker placement on or off; it is off by default.
+ *
+ * @param enable  Nonzero to pin workers to NUMA nodes.
+ */
+void affinity_enable(int enable);
+
+/**
+ * @brief Pin the calling worker thread to one NUMA node.
+ *
+ * Call it first thing in the worker, before any buffers are allocated.
+ * Worker `index` goes to the index-th usable node modulo their number.
+ *
+ * @param index  Worker number within its pool, from 0.
+ *
+ * @return The node the thread was pinned to, or -1 if placement is off
+ *         or the thread could not be pinned.
+ */
+int affinity_pin_worker(int index);
+
+/**
+ * @brief NUMA node the calling thread is running on.
+ *
+ * @return The node, or 0 if placement is off or the node is unknown.
+ */
+int affinity_current_node(void);
+
+/**
+ * @brief End of the AFFINITY_H include guard.
+ */
+#endif
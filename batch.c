@@ -0,0 +1,334 @@
+/**
+ * @file batch.c
+ * @author Shane Girolamo
+ *
+ * @brief Implementation of the mcrypt batch mode.
+ *
+ * The manifest is parsed up front into an array of jobs. Worker threads
+ * then claim jobs one at a time through a shared counter. Each worker
+ * keeps the primed KStream for the last key file it loaded, so runs of
+ * jobs under the same key skip the key schedule via ks_copy().
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "batch.h"
+#include "affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * @brief One line of the manifest.
+ */
+typedef struct
+{
+    char *keyfile; /**< Path of the key file. */
+    char *infile;  /**< Path of the input file. */
+    char *outfile; /**< Path of the output file. */
+    int line;      /**< Manifest line number, for error messages. */
+} BatchJob;
+
+/**
+ * @brief State shared by all worker threads.
+ */
+typedef struct
+{
+    BatchJob *jobs;        /**< Parsed manifest. */
+    size_t count;          /**< Number of jobs. */
+    size_t next;           /**< Index of the next unclaimed job. */
+    int workers;           /**< Workers started so far. */
+    size_t failed;         /**< Number of jobs that failed. */
+    uint64_t bytes;        /**< Total input bytes translated. */
+    MioBackend backend;    /**< Backend used for every job. */
+    pthread_mutex_t lock;  /**< Protects next, workers, failed, bytes. */
+} BatchState;
+
+/**
+ * @brief Duplicate a string, exiting if memory runs out.
+ *
+ * @param s  String to copy.
+ *
+ * @return Heap-allocated copy of `s`.
+ */
+static char *copy_string(const char *s)
+{
+    char *copy = malloc(strlen(s) + 1);
+    assert(copy != NULL);
+    strcpy(copy, s);
+    return copy;
+}
+
+/**
+ * @brief Parse a manifest file into an array of jobs.
+ *
+ * @param manifest   Path of the manifest file.
+ * @param count_out  Receives the number of jobs.
+ *
+ * @return Heap-allocated job array, or NULL after printing a message if
+ *         the manifest cannot be read or contains a malformed line.
+ */
+static BatchJob *parse_manifest(const char *manifest, size_t *count_out)
+{
+    FILE *f = fopen(manifest, "r");
+    if (!f)
+    {
+        perror("manifest");
+        return NULL;
+    }
+
+    size_t count = 0;
+    size_t cap = 16;
+    BatchJob *jobs = malloc(cap * sizeof(BatchJob));
+    assert(jobs != NULL);
+
+    char line[3 * 4096];
+    int lineno = 0;
+    int ok = 1;
+    while (ok && fgets(line, sizeof(line), f) != NULL)
+    {
+        lineno++;
+
+        /* a line that filled the buffer must end here, or it was split */
+        if (strchr(line, '\n') == NULL)
+        {
+            int c = getc(f);
+            if (c != EOF && c != '\n')
+            {
+                fprintf(stderr, "error: %s:%d: line too long\n", manifest,
+                        lineno);
+                ok = 0;
+                break;
+            }
+        }
+
+        char *fields[4];
+        int nfields = 0;
+        char *save = NULL;
+        for (char *tok = strtok_r(line, " \t\r\n", &save);
+             tok != NULL && nfields < 4;
+             tok = strtok_r(NULL, " \t\r\n", &save))
+        {
+            fields[nfields++] = tok;
+        }
+
+        if (nfields == 0 || fields[0][0] == '#')
+        {
+            continue;
+        }
+        if (nfields != 3 || strcmp(fields[1], "-") == 0 ||
+            strcmp(fields[2], "-") == 0)
+        {
+            fprintf(stderr, "error: %s:%d: expected key-file in-file "
+                            "out-file\n", manifest, lineno);
+            ok = 0;
+            break;
+        }
+
+        if (count == cap)
+        {
+            cap *= 2;
+            jobs = realloc(jobs, cap * sizeof(BatchJob));
+            assert(jobs != NULL);
+        }
+
+        jobs[count].keyfile = copy_string(fields[0]);
+        jobs[count].infile = copy_string(fields[1]);
+        jobs[count].outfile = copy_string(fields[2]);
+        jobs[count].line = lineno;
+        count++;
+    }
+
+    fclose(f);
+
+    if (!ok)
+    {
+        for (size_t n = 0; n < count; n++)
+        {
+            free(jobs[n].keyfile);
+            free(jobs[n].infile);
+            free(jobs[n].outfile);
+        }
+        free(jobs);
+        return NULL;
+    }
+
+    *count_out = count;
+    return jobs;
+}
+
+/**
+ * @brief Worker thread body: claim and run jobs until none are left.
+ *
+ * @param arg  Pointer to the shared BatchState.
+ *
+ * @return Always NULL.
+ */
+static void *batch_worker(void *arg)
+{
+    BatchState *st = arg;
+    KStream *primed = NULL;
+    KStream *ks = NULL;
+    const char *primed_key = NULL;
+
+    /* pin before the streams and buffers below are first touched */
+    pthread_mutex_lock(&st->lock);
+    int index = st->workers++;
+    pthread_mutex_unlock(&st->lock);
+    affinity_pin_worker(index);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&st->lock);
+        size_t idx = st->next++;
+        pthread_mutex_unlock(&st->lock);
+
+        if (idx >= st->count)
+        {
+            break;
+        }
+
+        const BatchJob *job = &st->jobs[idx];
+        int status = 0;
+
+        if (primed == NULL || strcmp(primed_key, job->keyfile) != 0)
+        {
+            KStream *loaded = mio_load_stream(job->keyfile);
+            if (loaded == NULL)
+            {
+                status = -1;
+            }
+            else
+            {
+                ks_destroy(primed);
+                primed = loaded;
+                primed_key = job->keyfile;
+            }
+        }
+
+        if (status == 0)
+        {
+            if (ks == NULL)
+            {
+                ks = ks_clone(primed);
+            }
+            else
+            {
+                ks_copy(ks, primed);
+            }
+            status = mio_translate_file(ks, job->infile, job->outfile,
+                                        st->backend);
+        }
+
+        struct stat sb;
+        uint64_t size = 0;
+        if (status == 0 && stat(job->infile, &sb) == 0)
+        {
+            size = (uint64_t)sb.st_size;
+        }
+
+        if (status != 0)
+        {
+            fprintf(stderr, "error: line %d: %s %s %s failed\n", job->line,
+                    job->keyfile, job->infile, job->outfile);
+        }
+
+        pthread_mutex_lock(&st->lock);
+        st->bytes += size;
+        if (status != 0)
+        {
+            st->failed++;
+        }
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    ks_destroy(ks);
+    ks_destroy(primed);
+    return NULL;
+}
+
+/**
+ * @brief Run every job in a batch manifest.
+ *
+ * @param manifest  Path of the manifest file.
+ * @param jobs      Number of worker threads, or 0 for one per online CPU.
+ * @param backend   I/O backend used for every job.
+ *
+ * @return 0 if every job succeeded, or -1 otherwise.
+ */
+int batch_run(const char *manifest, int jobs, MioBackend backend)
+{
+    BatchState st;
+    st.jobs = parse_manifest(manifest, &st.count);
+    if (st.jobs == NULL)
+    {
+        return -1;
+    }
+    st.next = 0;
+    st.workers = 0;
+    st.failed = 0;
+    st.bytes = 0;
+    st.backend = backend;
+    pthread_mutex_init(&st.lock, NULL);
+
+    if (jobs <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+    if ((size_t)jobs > st.count)
+    {
+        jobs = st.count > 0 ? (int)st.count : 1;
+    }
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t *threads = malloc((size_t)jobs * sizeof(pthread_t));
+    assert(threads != NULL);
+
+    int started = 0;
+    for (; started < jobs; started++)
+    {
+        if (pthread_create(&threads[started], NULL, batch_worker, &st) != 0)
+        {
+            break;
+        }
+    }
+    if (started == 0)
+    {
+        batch_worker(&st);
+    }
+    for (int n = 0; n < started; n++)
+    {
+        pthread_join(threads[n], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (double)(end.tv_sec - start.tv_sec) +
+                  (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    double mbps = secs > 0 ? (double)st.bytes / 1e6 / secs : 0.0;
+
+    fprintf(stderr, "batch: %zu files, %zu failed, %llu bytes in %.3f s "
+                    "(%.1f MB/s, %d threads)\n",
+            st.count, st.failed, (unsigned long long)st.bytes, secs, mbps,
+            started > 0 ? started : 1);
+
+    for (size_t n = 0; n < st.count; n++)
+    {
+        free(st.jobs[n].keyfile);
+        free(st.jobs[n].infile);
+        free(st.jobs[n].outfile);
+    }
+    free(st.jobs);
+    free(threads);
+    pthread_mutex_destroy(&st.lock);
+
+    return st.failed == 0 ? 0 : -1;
+}
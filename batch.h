@@ -0,0 +1,41 @@
+/**
+ * @file batch.h
+ * @author Shane Girolamo
+ *
+ * @brief Multi-file batch mode for mcrypt.
+ *
+ * A batch manifest lists one translation job per line:
+ *
+ *      key-file in-file out-file
+ *
+ * Fields are separated by blanks; empty lines and lines starting with
+ * '#' are ignored. The key-file may also be a state file written by
+ * mcrypt --precompute. Each job gets its own KStream, so jobs are handed out
+ * to a pool of worker threads and run fully in parallel. Reading stdin
+ * or writing stdout ("-") is not supported in batch mode.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "mio.h"
+
+/**
+ * @brief Run every job in a batch manifest.
+ *
+ * Jobs that fail are reported on stderr and do not stop the remaining
+ * jobs. A throughput summary for the whole batch is printed on stderr
+ * when all jobs have finished.
+ *
+ * @param manifest  Path of the manifest file.
+ * @param jobs      Number of worker threads, or 0 for one per online CPU.
+ * @param backend   I/O backend used for every job.
+ *
+ * @return 0 if every job succeeded, or -1 otherwise.
+ */
+int batch_run(const char *manifest, int jobs, MioBackend backend);
+
+/**
+ * @brief End of the BATCH_H include guard.
+ */
+#endif
@@ -0,0 +1,785 @@
+/**
+ * @file bench.c
+ * @author Shane Girolamo
+ *
+ * @brief Benchmark driver for KStream and mcrypt.
+ *
+ * Measures ks_create() setup latency, ks_translate() throughput for
+ * buffer sizes from 16 bytes up to a configurable maximum (1 GiB by
+ * default), aggregate throughput of ks_translate_multi() against a loop
+ * over ks_translate(), and end-to-end mcrypt throughput for the file and
+ * stdout output paths. For messages of 32 to 512 bytes it also reports
+ * the p50, p99 and maximum latency of single library calls and of whole
+ * mcrypt runs. Results are printed one measurement per line as CSV, or
+ * as a JSON array with --json, so runs can be compared across releases.
+ *
+ * Usage:
+ *      ksbench [--json] [--max-size BYTES] [--e2e-size BYTES]
+ *              [--latency-runs N] [--mcrypt PATH]
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "KStream.h"
+
+/**
+ * @brief Minimum wall time, in seconds, for a single measurement.
+ *
+ * Each measurement repeats its operation, doubling the repetition count,
+ * until at least this much time has been spent.
+ */
+#define MIN_SECONDS 0.2
+
+/**
+ * @brief Environment of the benchmark process, passed to mcrypt.
+ */
+extern char **environ;
+
+/**
+ * @brief Output format for the results.
+ */
+static int json = 0;
+
+/**
+ * @brief Number of results printed so far; used for JSON separators.
+ */
+static int results = 0;
+
+/**
+ * @brief Read the monotonic clock.
+ *
+ * @return Current time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Print one measurement.
+ *
+ * @param name   Benchmark name.
+ * @param size   Buffer or file size in bytes, or 0 if not applicable.
+ * @param iters  Number of repetitions measured.
+ * @param secs   Total wall time of all repetitions.
+ * @param rate   Reported figure of merit.
+ * @param unit   Unit of `rate`.
+ */
+static void report(const char *name, uint64_t size, uint64_t iters,
+                   double secs, double rate, const char *unit)
+{
+    if (json)
+    {
+        printf("%s\n  {\"name\": \"%s\", \"size\": %llu, \"iterations\": %llu, "
+               "\"seconds\": %.6f, \"rate\": %.3f, \"unit\": \"%s\"}",
+               results > 0 ? "," : "[", name, (unsigned long long)size,
+               (unsigned long long)iters, secs, rate, unit);
+    }
+    else
+    {
+        if (results == 0)
+        {
+            printf("name,size,iterations,seconds,rate,unit\n");
+        }
+        printf("%s,%llu,%llu,%.6f,%.3f,%s\n", name, (unsigned long long)size,
+               (unsigned long long)iters, secs, rate, unit);
+    }
+    results++;
+    fflush(stdout);
+}
+
+/**
+ * @brief Fill a buffer with pseudorandom bytes.
+ *
+ * @param buf  Buffer to fill.
+ * @param len  Number of bytes.
+ * @param seed Seed for the generator.
+ */
+static void fill_random(uint8_t *buf, size_t len, uint64_t seed)
+{
+    uint64_t x = seed | 1;
+    for (size_t n = 0; n < len; n++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf[n] = (uint8_t)(x >> 32);
+    }
+}
+
+/**
+ * @brief Number of KStream slots in the benchmark's free-list pool.
+ */
+#define SLAB_SLOTS 64
+
+/**
+ * @brief Fixed pool of KStream storage handed out through a free list.
+ */
+typedef struct
+{
+    void *free[SLAB_SLOTS]; /**< Slots not currently in use. */
+    size_t nfree;           /**< Number of entries in free. */
+} Slab;
+
+/**
+ * @brief KsAllocator hook: pop a slot from the pool.
+ *
+ * @param ctx    The Slab.
+ * @param size   Requested size; at most KS_STATE_SIZE.
+ * @param align  Requested alignment; at most KS_STATE_ALIGN.
+ *
+ * @return A free slot, or NULL if the pool is empty.
+ */
+static void *slab_alloc(void *ctx, size_t size, size_t align)
+{
+    Slab *slab = ctx;
+    (void)size;
+    (void)align;
+    return slab->nfree > 0 ? slab->free[--slab->nfree] : NULL;
+}
+
+/**
+ * @brief KsAllocator hook: push a slot back onto the pool.
+ *
+ * @param ctx  The Slab.
+ * @param ptr  Slot to give back.
+ */
+static void slab_release(void *ctx, void *ptr)
+{
+    Slab *slab = ctx;
+    slab->free[slab->nfree++] = ptr;
+}
+
+/**
+ * @brief Measure the cost of creating and destroying a KStream.
+ *
+ * Runs once with the heap and once with a free-list pool through
+ * ks_create_with_alloc(), so the allocator's share of the cost shows.
+ */
+static void bench_create(void)
+{
+    static unsigned char storage[SLAB_SLOTS][KS_STATE_SIZE]
+        __attribute__((aligned(KS_STATE_ALIGN)));
+    Slab slab;
+    slab.nfree = 0;
+    for (size_t n = 0; n < SLAB_SLOTS; n++)
+    {
+        slab.free[slab.nfree++] = storage[n];
+    }
+    KsAllocator pool = {slab_alloc, slab_release, &slab};
+
+    for (int variant = 0; variant < 2; variant++)
+    {
+        uint8_t key[8] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+        uint64_t iters = 1;
+        double secs;
+
+        for (;;)
+        {
+            double start = now();
+            for (uint64_t n = 0; n < iters; n++)
+            {
+                key[n & 7] ^= (uint8_t)n;
+                if (variant == 0)
+                {
+                    ks_destroy(ks_create(key));
+                }
+                else
+                {
+                    ks_destroy_with_alloc(ks_create_with_alloc(key, &pool),
+                                          &pool);
+                }
+            }
+            secs = now() - start;
+            if (secs >= MIN_SECONDS)
+            {
+                break;
+            }
+            iters *= 2;
+        }
+
+        report(variant == 0 ? "ks_create" : "ks_create_with_alloc", 0, iters,
+               secs, secs * 1e9 / (double)iters, "ns/op");
+    }
+}
+
+/**
+ * @brief Measure ks_translate() throughput for increasing buffer sizes.
+ *
+ * @param max_size  Largest buffer size to measure.
+ */
+static void bench_translate(size_t max_size)
+{
+    uint8_t key[8] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+
+    uint8_t *in = malloc(max_size);
+    uint8_t *out = malloc(max_size);
+    if (in == NULL || out == NULL)
+    {
+        fprintf(stderr, "error: cannot allocate %zu-byte buffers\n", max_size);
+        exit(EXIT_FAILURE);
+    }
+    fill_random(in, max_size, 42);
+    memset(out, 0, max_size);
+
+    KStream *ks = ks_create(key);
+
+    for (size_t size = 16; size <= max_size; size *= 4)
+    {
+        uint64_t iters = 1;
+        double secs;
+
+        for (;;)
+        {
+            double start = now();
+            for (uint64_t n = 0; n < iters; n++)
+            {
+                ks_translate(ks, in, out, size);
+            }
+            secs = now() - start;
+            if (secs >= MIN_SECONDS)
+            {
+                break;
+            }
+            iters *= 2;
+        }
+
+        double mbps = (double)size * (double)iters / 1e6 / secs;
+        report("ks_translate", size, iters, secs, mbps, "MB/s");
+
+        if (size > max_size / 4)
+        {
+            break;
+        }
+    }
+
+    ks_destroy(ks);
+    free(in);
+    free(out);
+}
+
+/**
+ * @brief Number of independent streams in the multi-stream benchmark.
+ */
+#define MULTI_STREAMS 8
+
+/**
+ * @brief Compare ks_translate_multi() with a loop over ks_translate().
+ *
+ * Both variants translate one buffer per stream for MULTI_STREAMS
+ * streams; the reported figure is aggregate throughput over all streams.
+ * With `mixed` set, stream k gets size * (k + 1) / MULTI_STREAMS bytes
+ * instead, so the lanes of ks_translate_multi() finish at different
+ * times and have to be refilled.
+ *
+ * @param size   Bytes per stream, or for the longest stream if `mixed`.
+ * @param mixed  Nonzero to give the streams unequal lengths.
+ */
+static void bench_multi(size_t size, int mixed)
+{
+    KStream *streams[MULTI_STREAMS];
+    const uint8_t *in[MULTI_STREAMS];
+    uint8_t *out[MULTI_STREAMS];
+    size_t len[MULTI_STREAMS];
+    size_t total = 0;
+
+    for (int k = 0; k < MULTI_STREAMS; k++)
+    {
+        uint8_t key[8] = {0x10, 0x32, 0x54, 0x76, 0x98, 0xba, 0xdc, 0xfe};
+        key[0] = (uint8_t)k;
+        streams[k] = ks_create(key);
+
+        uint8_t *buf = malloc(size);
+        out[k] = malloc(size);
+        assert(buf != NULL && out[k] != NULL);
+        fill_random(buf, size, (uint64_t)k + 1);
+        in[k] = buf;
+        len[k] = mixed ? size * (size_t)(k + 1) / MULTI_STREAMS : size;
+        total += len[k];
+    }
+
+    for (int variant = 0; variant < 2; variant++)
+    {
+        uint64_t iters = 1;
+        double secs;
+
+        for (;;)
+        {
+            double start = now();
+            for (uint64_t n = 0; n < iters; n++)
+            {
+                if (variant == 0)
+                {
+                    for (int k = 0; k < MULTI_STREAMS; k++)
+                    {
+                        ks_translate(streams[k], in[k], out[k], len[k]);
+                    }
+                }
+                else
+                {
+                    ks_translate_multi(streams, in, out, len, MULTI_STREAMS);
+                }
+            }
+            secs = now() - start;
+            if (secs >= MIN_SECONDS)
+            {
+                break;
+            }
+            iters *= 2;
+        }
+
+        static const char *const names[2][2] = {
+            {"ks_translate_loop", "ks_translate_multi"},
+            {"ks_translate_loop_mixed", "ks_translate_multi_mixed"},
+        };
+        double bytes = (double)total * (double)iters;
+        report(names[mixed != 0][variant], size, iters, secs,
+               bytes / 1e6 / secs, "MB/s");
+    }
+
+    for (int k = 0; k < MULTI_STREAMS; k++)
+    {
+        ks_destroy(streams[k]);
+        free((void *)in[k]);
+        free(out[k]);
+    }
+}
+
+/**
+ * @brief Run mcrypt once and wait for it to finish.
+ *
+ * @param mcrypt  Path of the mcrypt binary.
+ * @param argv    Argument vector, starting with argv[0].
+ * @param outfd   Descriptor to use as the child's stdout, or -1.
+ *
+ * @return 0 if mcrypt exited successfully, or -1 otherwise.
+ */
+static int run_mcrypt(const char *mcrypt, char **argv, int outfd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (outfd >= 0)
+    {
+        posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+    }
+
+    pid_t pid;
+    int rc = posix_spawn(&pid, mcrypt, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0)
+    {
+        return -1;
+    }
+
+    int wstatus;
+    if (waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus) ||
+        WEXITSTATUS(wstatus) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Create a temporary file holding the given bytes.
+ *
+ * @param path  Template for mkstemp(); rewritten with the actual name.
+ * @param data  Contents of the file.
+ * @param len   Number of bytes.
+ */
+static void make_temp(char *path, const uint8_t *data, size_t len)
+{
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n <= 0)
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        done += (size_t)n;
+    }
+    close(fd);
+}
+
+/**
+ * @brief Measure end-to-end mcrypt throughput.
+ *
+ * Runs mcrypt on a temporary input of `size` bytes for the file output
+ * path with each I/O backend, and for the stdout output path with stdout
+ * redirected to /dev/null.
+ *
+ * @param mcrypt  Path of the mcrypt binary.
+ * @param size    Size of the input file.
+ */
+static void bench_mcrypt(const char *mcrypt, size_t size)
+{
+    uint8_t key[8] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+    uint8_t *data = malloc(size);
+    assert(data != NULL);
+    fill_random(data, size, 7);
+
+    char keyfile[] = "/tmp/ksbench-key-XXXXXX";
+    char infile[] = "/tmp/ksbench-in-XXXXXX";
+    char outfile[] = "/tmp/ksbench-out-XXXXXX";
+    make_temp(keyfile, key, sizeof(key));
+    make_temp(infile, data, size);
+    make_temp(outfile, NULL, 0);
+    free(data);
+
+    int devnull = open("/dev/null", O_WRONLY);
+    assert(devnull >= 0);
+
+    static const char *const cases[][2] = {
+        {"mcrypt_file_mmap", "--io=mmap"},
+        {"mcrypt_file_stdio", "--io=stdio"},
+        {"mcrypt_stdout", NULL},
+    };
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        char *argv[6];
+        int argc = 0;
+        argv[argc++] = (char *)mcrypt;
+        if (cases[c][1] != NULL)
+        {
+            argv[argc++] = (char *)cases[c][1];
+        }
+        argv[argc++] = keyfile;
+        argv[argc++] = infile;
+        argv[argc++] = cases[c][1] != NULL ? outfile : "-";
+        argv[argc] = NULL;
+
+        int outfd = cases[c][1] != NULL ? -1 : devnull;
+        uint64_t iters = 0;
+        double start = now();
+        double secs;
+        do
+        {
+            if (run_mcrypt(mcrypt, argv, outfd) != 0)
+            {
+                fprintf(stderr, "error: %s failed\n", mcrypt);
+                exit(EXIT_FAILURE);
+            }
+            iters++;
+            secs = now() - start;
+        } while (secs < MIN_SECONDS);
+
+        double mbps = (double)size * (double)iters / 1e6 / secs;
+        report(cases[c][0], size, iters, secs, mbps, "MB/s");
+    }
+
+    close(devnull);
+    unlink(keyfile);
+    unlink(infile);
+    unlink(outfile);
+}
+
+/**
+ * @brief Number of timed calls per size in the library latency runs.
+ */
+#define LATENCY_SAMPLES 20000
+
+/**
+ * @brief Message sizes covered by the latency runs.
+ */
+static const size_t latency_sizes[] = {32, 64, 128, 256, 512};
+
+/**
+ * @brief qsort() comparison for doubles in ascending order.
+ *
+ * @param a  First value.
+ * @param b  Second value.
+ *
+ * @return Negative, zero or positive as `a` is below, equal to or above
+ *         `b`.
+ */
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Print the p50, p99 and max of a set of latency samples.
+ *
+ * Each figure is one result named `name` with a _p50, _p99 or _max
+ * suffix, in microseconds. The samples are sorted in place.
+ *
+ * @param name     Benchmark name.
+ * @param size     Message size in bytes.
+ * @param samples  Latency of each call, in seconds.
+ * @param count    Number of samples; at least one.
+ */
+static void report_latency(const char *name, size_t size, double *samples,
+                           size_t count)
+{
+    qsort(samples, count, sizeof(samples[0]), compare_double);
+
+    double total = 0;
+    for (size_t n = 0; n < count; n++)
+    {
+        total += samples[n];
+    }
+
+    static const char *const suffixes[] = {"p50", "p99", "max"};
+    size_t ranks[] = {count / 2, count * 99 / 100, count - 1};
+    for (size_t k = 0; k < 3; k++)
+    {
+        char label[64];
+        snprintf(label, sizeof(label), "%s_%s", name, suffixes[k]);
+        report(label, size, count, total, samples[ranks[k]] * 1e6, "us");
+    }
+}
+
+/**
+ * @brief Measure per-message library latency for small messages.
+ *
+ * Every call is timed on its own and the distribution is reported, so
+ * that tail latency shows and not only the average. Two ways to handle a
+ * message are measured: a fresh stream per message with ks_create(),
+ * ks_translate() and ks_destroy(), and resetting a reused stream from a
+ * primed one with ks_copy() before ks_translate().
+ */
+static void bench_latency_lib(void)
+{
+    uint8_t key[8] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+    uint8_t in[512];
+    uint8_t out[512];
+    fill_random(in, sizeof(in), 11);
+
+    double *samples = malloc(LATENCY_SAMPLES * sizeof(double));
+    assert(samples != NULL);
+    KStream *primed = ks_create(key);
+    KStream *ks = ks_create(key);
+
+    for (size_t s = 0; s < sizeof(latency_sizes) / sizeof(size_t); s++)
+    {
+        size_t size = latency_sizes[s];
+
+        for (size_t n = 0; n < LATENCY_SAMPLES; n++)
+        {
+            double start = now();
+            KStream *fresh = ks_create(key);
+            ks_translate(fresh, in, out, size);
+            ks_destroy(fresh);
+            samples[n] = now() - start;
+        }
+        report_latency("latency_create_translate", size, samples,
+                       LATENCY_SAMPLES);
+
+        for (size_t n = 0; n < LATENCY_SAMPLES; n++)
+        {
+            double start = now();
+            ks_copy(ks, primed);
+            ks_translate(ks, in, out, size);
+            samples[n] = now() - start;
+        }
+        report_latency("latency_copy_translate", size, samples,
+                       LATENCY_SAMPLES);
+    }
+
+    ks_destroy(ks);
+    ks_destroy(primed);
+    free(samples);
+}
+
+/**
+ * @brief Measure per-message mcrypt latency for small messages.
+ *
+ * Each run of mcrypt on a small input is timed from spawn to exit, once
+ * with a file as output and once printing to stdout redirected to
+ * /dev/null.
+ *
+ * @param mcrypt  Path of the mcrypt binary.
+ * @param runs    Number of runs per size and output.
+ */
+static void bench_latency_mcrypt(const char *mcrypt, size_t runs)
+{
+    uint8_t key[8] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+    uint8_t data[512];
+    fill_random(data, sizeof(data), 13);
+
+    char keyfile[] = "/tmp/ksbench-key-XXXXXX";
+    char outfile[] = "/tmp/ksbench-out-XXXXXX";
+    make_temp(keyfile, key, sizeof(key));
+    make_temp(outfile, NULL, 0);
+
+    int devnull = open("/dev/null", O_WRONLY);
+    assert(devnull >= 0);
+    double *samples = malloc(runs * sizeof(double));
+    assert(samples != NULL);
+
+    for (size_t s = 0; s < sizeof(latency_sizes) / sizeof(size_t); s++)
+    {
+        size_t size = latency_sizes[s];
+        char infile[] = "/tmp/ksbench-in-XXXXXX";
+        make_temp(infile, data, size);
+
+        for (int to_stdout = 0; to_stdout < 2; to_stdout++)
+        {
+            char *argv[] = {(char *)mcrypt, keyfile, infile,
+                            to_stdout ? "-" : outfile, NULL};
+            int outfd = to_stdout ? devnull : -1;
+
+            for (size_t n = 0; n < runs; n++)
+            {
+                double start = now();
+                if (run_mcrypt(mcrypt, argv, outfd) != 0)
+                {
+                    fprintf(stderr, "error: %s failed\n", mcrypt);
+                    exit(EXIT_FAILURE);
+                }
+                samples[n] = now() - start;
+            }
+            report_latency(to_stdout ? "latency_mcrypt_stdout"
+                                     : "latency_mcrypt_file",
+                           size, samples, runs);
+        }
+        unlink(infile);
+    }
+
+    free(samples);
+    close(devnull);
+    unlink(keyfile);
+    unlink(outfile);
+}
+
+/**
+ * @brief Parse a byte count with an optional K, M or G suffix.
+ *
+ * @param s  String to parse.
+ *
+ * @return The number of bytes, or 0 if the string is malformed.
+ */
+static size_t parse_size(const char *s)
+{
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+
+    switch (*end)
+    {
+    case 'G':
+        v <<= 10;
+        /* fall through */
+    case 'M':
+        v <<= 10;
+        /* fall through */
+    case 'K':
+        v <<= 10;
+        end++;
+        break;
+    default:
+        break;
+    }
+
+    return *end == '\0' ? (size_t)v : 0;
+}
+
+/**
+ * @brief Print usage message to stderr.
+ */
+static void usage(void)
+{
+    fprintf(stderr, "usage: ksbench [--json] [--max-size BYTES] "
+                    "[--e2e-size BYTES] [--latency-runs N] "
+                    "[--mcrypt PATH]\n");
+}
+
+/**
+ * @brief Program entry point for the benchmark driver.
+ *
+ * @param argc  Argument count.
+ * @param argv  Argument vector.
+ *
+ * @return EXIT_SUCCESS on success; EXIT_FAILURE on invalid usage.
+ */
+int main(int argc, char **argv)
+{
+    size_t max_size = (size_t)1 << 30;
+    size_t e2e_size = (size_t)64 << 20;
+    size_t latency_runs = 200;
+    const char *mcrypt = "./mcrypt";
+
+    for (int argi = 1; argi < argc; argi++)
+    {
+        if (strcmp(argv[argi], "--json") == 0)
+        {
+            json = 1;
+        }
+        else if (strcmp(argv[argi], "--max-size") == 0 && argi + 1 < argc)
+        {
+            max_size = parse_size(argv[++argi]);
+        }
+        else if (strcmp(argv[argi], "--e2e-size") == 0 && argi + 1 < argc)
+        {
+            e2e_size = parse_size(argv[++argi]);
+        }
+        else if (strcmp(argv[argi], "--latency-runs") == 0 &&
+                 argi + 1 < argc)
+        {
+            latency_runs = parse_size(argv[++argi]);
+        }
+        else if (strcmp(argv[argi], "--mcrypt") == 0 && argi + 1 < argc)
+        {
+            mcrypt = argv[++argi];
+        }
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (max_size < 16 || e2e_size == 0 || latency_runs == 0)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "ksbench: %s xor kernel\n", ks_impl_name());
+    bench_create();
+    bench_translate(max_size);
+    bench_multi(64 * 1024, 0);
+    bench_multi(64 * 1024, 1);
+    bench_latency_lib();
+    if (access(mcrypt, X_OK) == 0)
+    {
+        bench_mcrypt(mcrypt, e2e_size);
+        bench_latency_mcrypt(mcrypt, latency_runs);
+    }
+    else
+    {
+        fprintf(stderr, "warning: %s not found, skipping mcrypt runs\n",
+                mcrypt);
+    }
+
+    if (json && results > 0)
+    {
+        printf("\n]\n");
+    }
+
+    return EXIT_SUCCESS;
+}
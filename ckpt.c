@@ -0,0 +1,445 @@
+/**
+ * @file ckpt.c
+ * @author Shane Girolamo
+ *
+ * @brief Implementation of the keystream checkpoint index.
+ *
+ * Checkpointed translation streams the input through the cipher in
+ * chunks that never cross an interval boundary, so a snapshot can be
+ * taken exactly at each boundary. Entries are appended to the index as
+ * they are taken and the entry count in the header is filled in last.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "ckpt.h"
+#include "mio.h"
+#include "le.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Magic bytes at the start of every index file.
+ */
+static const char ckpt_magic[4] = {'K', 'S', 'I', 'X'};
+
+/**
+ * @brief Index format version written by this implementation.
+ */
+#define CKPT_VERSION 1
+
+/**
+ * @brief Size of the index header in bytes.
+ */
+#define CKPT_HEADER 24
+
+/**
+ * @brief Size of one index entry in bytes.
+ */
+#define CKPT_ENTRY (8 + KS_SNAPSHOT_SIZE)
+
+/**
+ * @brief Number of bytes translated per read in this module.
+ */
+#define CKPT_CHUNK (64 * 1024)
+
+/**
+ * @brief Build the index path for a data file.
+ *
+ * @param path  Path of the data file.
+ *
+ * @return Heap-allocated index path.
+ */
+static char *index_path(const char *path)
+{
+    char *name = malloc(strlen(path) + sizeof(CKPT_SUFFIX));
+    assert(name != NULL);
+    strcpy(name, path);
+    strcat(name, CKPT_SUFFIX);
+    return name;
+}
+
+/**
+ * @brief Write the index header.
+ *
+ * @param f         Index stream, positioned at the start.
+ * @param interval  Checkpoint interval.
+ * @param count     Number of entries.
+ *
+ * @return 0 on success, or -1 on a write error.
+ */
+static int write_header(FILE *f, uint64_t interval, uint64_t count)
+{
+    uint8_t hdr[CKPT_HEADER];
+    memcpy(hdr, ckpt_magic, 4);
+    hdr[4] = CKPT_VERSION;
+    hdr[5] = hdr[6] = hdr[7] = 0;
+    put_le64(hdr + 8, interval);
+    put_le64(hdr + 16, count);
+    return fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr) ? 0 : -1;
+}
+
+/**
+ * @brief Open the output file, refusing to overwrite the input.
+ *
+ * The output is only truncated once it is known to be a different file
+ * from the input.
+ *
+ * @param infd     Descriptor of the input file.
+ * @param outfile  Path of the output file.
+ *
+ * @return Output stream, or NULL after printing a message on failure.
+ */
+static FILE *open_output(int infd, const char *outfile)
+{
+    int outfd = open(outfile, O_WRONLY | O_CREAT, 0666);
+    if (outfd < 0)
+    {
+        perror("output-file");
+        return NULL;
+    }
+
+    struct stat inst;
+    struct stat outst;
+    if (fstat(infd, &inst) != 0 || fstat(outfd, &outst) != 0)
+    {
+        perror("output-file");
+        close(outfd);
+        return NULL;
+    }
+    if (inst.st_dev == outst.st_dev && inst.st_ino == outst.st_ino)
+    {
+        fprintf(stderr, "error: input and output are the same file\n");
+        close(outfd);
+        return NULL;
+    }
+    if (S_ISREG(outst.st_mode) && ftruncate(outfd, 0) != 0)
+    {
+        perror("output-file");
+        close(outfd);
+        return NULL;
+    }
+
+    FILE *out = fdopen(outfd, "wb");
+    if (out == NULL)
+    {
+        perror("output-file");
+        close(outfd);
+    }
+    return out;
+}
+
+/**
+ * @brief Translate a file and write a checkpoint index next to it.
+ *
+ * @param ks        Freshly created KStream instance.
+ * @param infile    Path of the file to translate.
+ * @param outfile   Path of the translated file.
+ * @param interval  Distance in bytes between checkpoints.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int ckpt_translate_file(KStream *ks, const char *infile, const char *outfile,
+                        uint64_t interval)
+{
+    assert(interval > 0);
+
+    int infd = open(infile, O_RDONLY);
+    FILE *in = infd >= 0 ? fdopen(infd, "rb") : NULL;
+    if (!in)
+    {
+        perror("input-file");
+        if (infd >= 0)
+        {
+            close(infd);
+        }
+        return -1;
+    }
+
+    FILE *out = open_output(infd, outfile);
+    if (!out)
+    {
+        fclose(in);
+        return -1;
+    }
+
+    char *ipath = index_path(outfile);
+    int ifd = open(ipath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    FILE *idx = ifd >= 0 ? fdopen(ifd, "wb") : NULL;
+    if (idx == NULL)
+    {
+        perror(ipath);
+        if (ifd >= 0)
+        {
+            close(ifd);
+        }
+        free(ipath);
+        fclose(in);
+        fclose(out);
+        return -1;
+    }
+
+    uint8_t *buf = malloc(CKPT_CHUNK);
+    assert(buf != NULL);
+
+    int status = write_header(idx, interval, 0);
+    uint64_t pos = 0;
+    uint64_t count = 0;
+
+    while (status == 0)
+    {
+        uint64_t into = pos % interval;
+        size_t want = CKPT_CHUNK;
+        if (interval - into < want)
+        {
+            want = (size_t)(interval - into);
+        }
+
+        uint8_t entry[CKPT_ENTRY];
+        if (into == 0)
+        {
+            put_le64(entry, pos);
+            ks_save_state(ks, entry + 8);
+        }
+
+        size_t n = fread(buf, 1, want, in);
+        if (n == 0)
+        {
+            break;
+        }
+
+        if (into == 0)
+        {
+            if (fwrite(entry, 1, sizeof(entry), idx) != sizeof(entry))
+            {
+                status = -1;
+                break;
+            }
+            count++;
+        }
+
+        ks_translate_inplace(ks, buf, n);
+        if (fwrite(buf, 1, n, out) != n)
+        {
+            fprintf(stderr, "error: failed to write output file\n");
+            status = -2;
+            break;
+        }
+        pos += n;
+    }
+
+    if (status == 0 && ferror(in))
+    {
+        fprintf(stderr, "error: could not read entire input file\n");
+        status = -2;
+    }
+
+    /* an empty input still gets the offset-0 entry used to check keys */
+    if (status == 0 && count == 0)
+    {
+        uint8_t entry[CKPT_ENTRY];
+        put_le64(entry, 0);
+        ks_save_state(ks, entry + 8);
+        if (fwrite(entry, 1, sizeof(entry), idx) != sizeof(entry))
+        {
+            status = -1;
+        }
+        count = 1;
+    }
+
+    if (status == 0 &&
+        (fseek(idx, 0, SEEK_SET) != 0 || write_header(idx, interval, count)))
+    {
+        status = -1;
+    }
+    if (fclose(idx) != 0 && status == 0)
+    {
+        status = -1;
+    }
+    if (status == -1)
+    {
+        perror(ipath);
+    }
+
+    if (fclose(out) != 0 && status == 0)
+    {
+        fprintf(stderr, "error: failed to write output file\n");
+        status = -2;
+    }
+    fclose(in);
+    free(buf);
+    free(ipath);
+
+    return status == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Position a stream at `off` using the index of `infile`.
+ *
+ * Reads only the header, entry 0 and the one entry needed. If the index
+ * is missing, malformed or was made with a different key, `ks` is left
+ * at offset 0 and the caller skips forward on its own.
+ *
+ * @param ks      Freshly created KStream instance.
+ * @param infile  Path of the data file.
+ * @param off     Target offset.
+ *
+ * @return Offset at which `ks` now stands (at most `off`).
+ */
+static uint64_t seek_checkpoint(KStream *ks, const char *infile, uint64_t off)
+{
+    char *ipath = index_path(infile);
+    FILE *idx = fopen(ipath, "rb");
+    free(ipath);
+    if (idx == NULL)
+    {
+        return 0;
+    }
+
+    uint8_t hdr[CKPT_HEADER];
+    uint8_t first[CKPT_ENTRY];
+    uint8_t entry[CKPT_ENTRY];
+    uint64_t at = 0;
+
+    if (fread(hdr, 1, sizeof(hdr), idx) != sizeof(hdr) ||
+        memcmp(hdr, ckpt_magic, 4) != 0 || hdr[4] != CKPT_VERSION ||
+        fread(first, 1, sizeof(first), idx) != sizeof(first))
+    {
+        fprintf(stderr, "warning: ignoring malformed checkpoint index\n");
+        fclose(idx);
+        return 0;
+    }
+
+    uint64_t interval = get_le64(hdr + 8);
+    uint64_t count = get_le64(hdr + 16);
+
+    uint8_t state[KS_SNAPSHOT_SIZE];
+    ks_save_state(ks, state);
+    if (interval == 0 || count == 0 || get_le64(first) != 0 ||
+        memcmp(first + 8, state, KS_SNAPSHOT_SIZE) != 0)
+    {
+        fprintf(stderr, "warning: checkpoint index does not match key\n");
+        fclose(idx);
+        return 0;
+    }
+
+    uint64_t k = off / interval;
+    if (k >= count)
+    {
+        k = count - 1;
+    }
+
+    if (k > 0 &&
+        fseek(idx, (long)(CKPT_HEADER + k * CKPT_ENTRY), SEEK_SET) == 0 &&
+        fread(entry, 1, sizeof(entry), idx) == sizeof(entry) &&
+        get_le64(entry) <= off)
+    {
+        KStream *restored = ks_load_state(entry + 8);
+        if (restored != NULL)
+        {
+            ks_copy(ks, restored);
+            ks_destroy(restored);
+            at = get_le64(entry);
+        }
+    }
+
+    fclose(idx);
+    return at;
+}
+
+/**
+ * @brief Translate the byte range [off, off + len) of a file.
+ *
+ * @param ks       Freshly created KStream instance for the key.
+ * @param infile   Path of the file to read from.
+ * @param outfile  Path of the output file, or "-" for stdout.
+ * @param off      Offset of the first byte to translate.
+ * @param len      Number of bytes to translate.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int ckpt_translate_range(KStream *ks, const char *infile, const char *outfile,
+                         uint64_t off, uint64_t len)
+{
+    int infd = open(infile, O_RDONLY);
+    if (infd < 0)
+    {
+        perror("input-file");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(infd, &st) != 0)
+    {
+        perror("input-file");
+        close(infd);
+        return -1;
+    }
+    uint64_t size = (uint64_t)st.st_size;
+    if (off > size)
+    {
+        fprintf(stderr, "error: range starts past the end of the input\n");
+        close(infd);
+        return -1;
+    }
+    if (len > size - off)
+    {
+        len = size - off;
+    }
+
+    int text = outfile[0] == '-' && outfile[1] == '\0';
+    FILE *out = text ? stdout : open_output(infd, outfile);
+    if (!out)
+    {
+        close(infd);
+        return -1;
+    }
+
+    uint64_t at = seek_checkpoint(ks, infile, off);
+    ks_skip(ks, off - at);
+
+    uint8_t *buf = malloc(CKPT_CHUNK);
+    assert(buf != NULL);
+
+    int status = 0;
+    while (status == 0 && len > 0)
+    {
+        size_t want = len < CKPT_CHUNK ? (size_t)len : CKPT_CHUNK;
+        ssize_t n = pread(infd, buf, want, (off_t)off);
+        if (n <= 0)
+        {
+            fprintf(stderr, "error: could not read entire input file\n");
+            status = -1;
+            break;
+        }
+
+        ks_translate_inplace(ks, buf, (size_t)n);
+        if (text)
+        {
+            status = mio_write_text(out, buf, (size_t)n);
+        }
+        else if (fwrite(buf, 1, (size_t)n, out) != (size_t)n)
+        {
+            fprintf(stderr, "error: failed to write output file\n");
+            status = -1;
+        }
+
+        off += (uint64_t)n;
+        len -= (uint64_t)n;
+    }
+
+    if ((text ? fflush(out) : fclose(out)) != 0 && status == 0)
+    {
+        fprintf(stderr, "error: failed to write output file\n");
+        status = -1;
+    }
+    free(buf);
+    close(infd);
+
+    return status;
+}
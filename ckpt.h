@@ -0,0 +1,72 @@
+/**
+ * @file ckpt.h
+ * @author Shane Girolamo
+ *
+ * @brief Keystream checkpoint index for random access into ciphertext.
+ *
+ * While translating a file, mcrypt can record the serialized KStream
+ * state every `interval` bytes into a sidecar index next to the output,
+ * named "<out-file>.kidx". Any byte range of that file can later be
+ * translated by restoring the nearest earlier checkpoint and skipping
+ * forward, so the cost of reading a range is bounded by the checkpoint
+ * interval instead of the file size.
+ *
+ * Index layout, all integers little-endian:
+ *
+ *      "KSIX"  u32 version  u64 interval  u64 count
+ *      count x { u64 offset, KS_SNAPSHOT_SIZE bytes of state }
+ *
+ * Entry 0 is the state at offset 0 and doubles as a check that the index
+ * belongs to the key in use. The index holds raw keystream state, so it
+ * must be protected like the key itself; it is created with mode 0600.
+ */
+
+#ifndef CKPT_H
+#define CKPT_H
+
+#include "KStream.h"
+
+/**
+ * @brief Suffix appended to the output path to name the index file.
+ */
+#define CKPT_SUFFIX ".kidx"
+
+/**
+ * @brief Translate a file and write a checkpoint index next to it.
+ *
+ * @param ks        Freshly created KStream instance.
+ * @param infile    Path of the file to translate.
+ * @param outfile   Path of the translated file; the index is written to
+ *                  outfile followed by CKPT_SUFFIX.
+ * @param interval  Distance in bytes between checkpoints; must be > 0.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int ckpt_translate_file(KStream *ks, const char *infile, const char *outfile,
+                        uint64_t interval);
+
+/**
+ * @brief Translate the byte range [off, off + len) of a file.
+ *
+ * If an index for `infile` exists and matches the stream, translation
+ * starts from the nearest checkpoint at or before `off`; otherwise the
+ * stream is skipped forward from the start. Only the requested range of
+ * the input is read. A range extending past the end of the file is cut
+ * short at the end.
+ *
+ * @param ks       Freshly created KStream instance for the key.
+ * @param infile   Path of the file to read from.
+ * @param outfile  Path of the output file, or "-" to print the range on
+ *                 stdout using the ASCII/hex rules.
+ * @param off      Offset of the first byte to translate.
+ * @param len      Number of bytes to translate.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int ckpt_translate_range(KStream *ks, const char *infile, const char *outfile,
+                         uint64_t off, uint64_t len);
+
+/**
+ * @brief End of the CKPT_H include guard.
+ */
+#endif
@@ -0,0 +1,722 @@
+/**
+ * @file container.c
+ * @author Shane Girolamo
+ *
+ * @brief Implementation of the segmented container format.
+ *
+ * Creation and extraction share one worker pool. Workers claim segment
+ * indices through a shared counter, key a KStream for the segment in
+ * their own storage via ks_init(), and move the segment through a
+ * private buffer with pread()/pwrite(), so no two workers ever touch the
+ * same file offsets.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "container.h"
+#include "affinity.h"
+#include "le.h"
+#include "KStream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Magic bytes at the start of every container.
+ */
+static const char container_magic[4] = {'K', 'S', 'C', 'T'};
+
+/**
+ * @brief Container format version written by this implementation.
+ */
+#define CONTAINER_VERSION 2
+
+/**
+ * @brief Bytes each worker moves per pread()/pwrite() pair.
+ */
+#define CONTAINER_CHUNK (1024 * 1024)
+
+/**
+ * @brief State shared by the worker threads of one run.
+ */
+typedef struct
+{
+    const uint8_t *keybytes; /**< Key read from the key file. */
+    int infd;                /**< Input descriptor. */
+    int outfd;               /**< Output descriptor. */
+    uint64_t in_base;        /**< Input offset of segment 0. */
+    uint64_t out_base;       /**< Output offset of segment `first`. */
+    uint64_t segsize;        /**< Segment size. */
+    uint64_t length;         /**< Data length of the whole container. */
+    uint64_t first;          /**< First segment to translate. */
+    uint64_t end;            /**< One past the last segment to translate. */
+    uint64_t next;           /**< Next unclaimed segment. */
+    int workers;             /**< Workers started so far. */
+    int failed;              /**< Set once any segment has failed. */
+    pthread_mutex_t lock;    /**< Protects next, workers and failed. */
+} ContainerRun;
+
+/**
+ * @brief Derive the key for one container segment.
+ *
+ * The key is the first eight bytes of keystream, after the usual discard,
+ * of an RC4 stream keyed with the key file followed by the little-endian
+ * segment index. Recovering the key file from a segment key means
+ * recovering an RC4 key from its output, so a leaked segment key exposes
+ * only its own segment.
+ *
+ * @param keybytes  Key read from the key file.
+ * @param segment   Segment index.
+ * @param out       Receives the 8-byte segment key.
+ */
+void container_segment_key(const uint8_t keybytes[8], uint64_t segment,
+                           uint8_t out[8])
+{
+    unsigned char storage[KS_STATE_SIZE]
+        __attribute__((aligned(KS_STATE_ALIGN)));
+    uint8_t material[16];
+    memcpy(material, keybytes, 8);
+    put_le64(material + 8, segment);
+
+    KStream *ks = ks_init_ex(storage, material, sizeof(material),
+                             KS_DEFAULT_DISCARD);
+    ks_generate(ks, out, 8);
+}
+
+/**
+ * @brief Fill in a container header.
+ *
+ * @param hdr   Receives CONTAINER_HEADER bytes.
+ * @param plan  Layout to describe.
+ */
+static void format_header(uint8_t *hdr, const ContainerPlan *plan)
+{
+    memcpy(hdr, container_magic, 4);
+    hdr[4] = CONTAINER_VERSION;
+    hdr[5] = hdr[6] = hdr[7] = 0;
+    put_le64(hdr + 8, plan->segsize);
+    put_le64(hdr + 16, plan->count);
+    put_le64(hdr + 24, plan->length);
+}
+
+/**
+ * @brief Decode and check a container header.
+ *
+ * @param hdr   CONTAINER_HEADER bytes from the start of the file.
+ * @param size  Size of the whole file.
+ * @param plan  Receives the layout of a whole-container extraction.
+ *
+ * @return 0 if the header is valid, 1 if the magic is missing, or -1 if
+ *         the header is bad or does not match the file size.
+ */
+static int parse_header(const uint8_t *hdr, uint64_t size,
+                        ContainerPlan *plan)
+{
+    if (memcmp(hdr, container_magic, 4) != 0)
+    {
+        return 1;
+    }
+
+    plan->segsize = get_le64(hdr + 8);
+    plan->count = get_le64(hdr + 16);
+    plan->length = get_le64(hdr + 24);
+    plan->in_base = CONTAINER_HEADER;
+    plan->out_base = 0;
+
+    if (hdr[4] != CONTAINER_VERSION || plan->segsize == 0 ||
+        plan->count != plan->length / plan->segsize +
+                           (plan->length % plan->segsize != 0) ||
+        size != CONTAINER_HEADER + plan->length)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read exactly `len` bytes at `off`.
+ *
+ * @param fd   Descriptor to read from.
+ * @param buf  Destination.
+ * @param len  Number of bytes.
+ * @param off  File offset.
+ *
+ * @return 0 on success, or -1 on error or early end of file.
+ */
+static int pread_full(int fd, uint8_t *buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pread(fd, buf + done, len - done, (off_t)(off + done));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write exactly `len` bytes at `off`.
+ *
+ * @param fd   Descriptor to write to.
+ * @param buf  Source.
+ * @param len  Number of bytes.
+ * @param off  File offset.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+static int pwrite_full(int fd, const uint8_t *buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pwrite(fd, buf + done, len - done, (off_t)(off + done));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Translate one segment.
+ *
+ * @param run      Shared run state.
+ * @param storage  KS_STATE_SIZE bytes of aligned KStream storage.
+ * @param buf      CONTAINER_CHUNK bytes of scratch space.
+ * @param seg      Segment index.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+static int translate_segment(const ContainerRun *run, void *storage,
+                             uint8_t *buf, uint64_t seg)
+{
+    uint8_t key[8];
+    container_segment_key(run->keybytes, seg, key);
+    KStream *ks = ks_init(storage, key);
+
+    uint64_t start = seg * run->segsize;
+    uint64_t len = run->length - start;
+    if (len > run->segsize)
+    {
+        len = run->segsize;
+    }
+
+    uint64_t in_off = run->in_base + start;
+    uint64_t out_off = run->out_base + (seg - run->first) * run->segsize;
+
+    for (uint64_t done = 0; done < len;)
+    {
+        size_t n = CONTAINER_CHUNK;
+        if (len - done < n)
+        {
+            n = (size_t)(len - done);
+        }
+
+        if (pread_full(run->infd, buf, n, in_off + done) != 0)
+        {
+            fprintf(stderr, "error: could not read segment %llu\n",
+                    (unsigned long long)seg);
+            return -1;
+        }
+        ks_translate_inplace(ks, buf, n);
+        if (pwrite_full(run->outfd, buf, n, out_off + done) != 0)
+        {
+            fprintf(stderr, "error: could not write segment %llu\n",
+                    (unsigned long long)seg);
+            return -1;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Worker thread body: claim and translate segments until done.
+ *
+ * @param arg  Pointer to the shared ContainerRun.
+ *
+ * @return Always NULL.
+ */
+static void *container_worker(void *arg)
+{
+    ContainerRun *run = arg;
+
+    /* pin first so that the stream and buffer are node-local */
+    pthread_mutex_lock(&run->lock);
+    int index = run->workers++;
+    pthread_mutex_unlock(&run->lock);
+    affinity_pin_worker(index);
+
+    void *storage;
+    int rc = posix_memalign(&storage, KS_STATE_ALIGN, KS_STATE_SIZE);
+    assert(rc == 0);
+    (void)rc;
+    uint8_t *buf = malloc(CONTAINER_CHUNK);
+    assert(buf != NULL);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&run->lock);
+        uint64_t seg = run->next++;
+        int stop = run->failed || seg >= run->end;
+        pthread_mutex_unlock(&run->lock);
+
+        if (stop)
+        {
+            break;
+        }
+
+        if (translate_segment(run, storage, buf, seg) != 0)
+        {
+            pthread_mutex_lock(&run->lock);
+            run->failed = 1;
+            pthread_mutex_unlock(&run->lock);
+        }
+    }
+
+    free(buf);
+    free(storage);
+    return NULL;
+}
+
+/**
+ * @brief Translate segments [first, end) on a pool of threads.
+ *
+ * @param run   Run state with every field but next, workers, failed and
+ *              lock set.
+ * @param jobs  Number of worker threads, or 0 for one per online CPU.
+ *
+ * @return 0 if every segment was translated, or -1 otherwise.
+ */
+static int run_segments(ContainerRun *run, int jobs)
+{
+    run->next = run->first;
+    run->workers = 0;
+    run->failed = 0;
+    pthread_mutex_init(&run->lock, NULL);
+
+    if (jobs <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+    if ((uint64_t)jobs > run->end - run->first)
+    {
+        jobs = run->end > run->first ? (int)(run->end - run->first) : 1;
+    }
+
+    pthread_t *threads = malloc((size_t)jobs * sizeof(pthread_t));
+    assert(threads != NULL);
+
+    int started = 0;
+    for (; started < jobs; started++)
+    {
+        if (pthread_create(&threads[started], NULL, container_worker,
+                           run) != 0)
+        {
+            break;
+        }
+    }
+    if (started == 0)
+    {
+        container_worker(run);
+    }
+    for (int n = 0; n < started; n++)
+    {
+        pthread_join(threads[n], NULL);
+    }
+
+    free(threads);
+    pthread_mutex_destroy(&run->lock);
+
+    return run->failed ? -1 : 0;
+}
+
+/**
+ * @brief Open the output file, refusing to overwrite the input.
+ *
+ * @param infd     Open input descriptor.
+ * @param outfile  Path of the output file.
+ * @param size     Final size of the output.
+ *
+ * @return The output descriptor, or -1 after printing a message.
+ */
+static int open_output(int infd, const char *outfile, uint64_t size)
+{
+    int outfd = open(outfile, O_RDWR | O_CREAT, 0666);
+    if (outfd < 0)
+    {
+        perror("output-file");
+        return -1;
+    }
+
+    struct stat inst;
+    struct stat outst;
+    if (fstat(infd, &inst) == 0 && fstat(outfd, &outst) == 0 &&
+        inst.st_dev == outst.st_dev && inst.st_ino == outst.st_ino)
+    {
+        fprintf(stderr, "error: input and output are the same file\n");
+        close(outfd);
+        return -1;
+    }
+
+    if (ftruncate(outfd, (off_t)size) != 0)
+    {
+        perror("output-file");
+        close(outfd);
+        return -1;
+    }
+
+    return outfd;
+}
+
+/**
+ * @brief Encrypt a file into a new container.
+ *
+ * @param keybytes  Key read from the key file.
+ * @param infile    Path of the plaintext file.
+ * @param outfile   Path of the container to write.
+ * @param segsize   Segment size in bytes; must be > 0.
+ * @param jobs      Number of worker threads, or 0 for one per online CPU.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int container_create(const uint8_t keybytes[8], const char *infile,
+                     const char *outfile, uint64_t segsize, int jobs)
+{
+    assert(segsize > 0);
+
+    int infd = open(infile, O_RDONLY);
+    if (infd < 0)
+    {
+        perror("input-file");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(infd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "error: container input must be a regular file\n");
+        close(infd);
+        return -1;
+    }
+
+    ContainerPlan plan;
+    plan.segsize = segsize;
+    plan.length = (uint64_t)st.st_size;
+    plan.count = (plan.length + segsize - 1) / segsize;
+
+    ContainerRun run;
+    run.keybytes = keybytes;
+    run.infd = infd;
+    run.in_base = 0;
+    run.out_base = CONTAINER_HEADER;
+    run.segsize = segsize;
+    run.length = plan.length;
+    run.first = 0;
+    run.end = plan.count;
+
+    run.outfd = open_output(infd, outfile, CONTAINER_HEADER + run.length);
+    if (run.outfd < 0)
+    {
+        close(infd);
+        return -1;
+    }
+
+    uint8_t hdr[CONTAINER_HEADER];
+    format_header(hdr, &plan);
+
+    int status = pwrite_full(run.outfd, hdr, sizeof(hdr), 0);
+    if (status != 0)
+    {
+        perror("output-file");
+    }
+    else
+    {
+        status = run_segments(&run, jobs);
+    }
+
+    if (close(run.outfd) != 0 && status == 0)
+    {
+        perror("output-file");
+        status = -1;
+    }
+    close(infd);
+
+    return status;
+}
+
+/**
+ * @brief Decrypt a container, or one segment of it.
+ *
+ * @param keybytes  Key read from the key file.
+ * @param infile    Path of the container.
+ * @param outfile   Path of the plaintext file to write.
+ * @param segment   Index of the only segment to decrypt, or -1 for all.
+ * @param jobs      Number of worker threads, or 0 for one per online CPU.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int container_extract(const uint8_t keybytes[8], const char *infile,
+                      const char *outfile, int64_t segment, int jobs)
+{
+    int infd = open(infile, O_RDONLY);
+    if (infd < 0)
+    {
+        perror("input-file");
+        return -1;
+    }
+
+    struct stat st;
+    uint8_t hdr[CONTAINER_HEADER];
+    ContainerPlan plan;
+    int valid = 1;
+    if (fstat(infd, &st) == 0 &&
+        pread_full(infd, hdr, sizeof(hdr), 0) == 0)
+    {
+        valid = parse_header(hdr, (uint64_t)st.st_size, &plan);
+    }
+    if (valid != 0)
+    {
+        if (valid > 0)
+        {
+            fprintf(stderr, "error: %s is not a container\n", infile);
+        }
+        else
+        {
+            fprintf(stderr, "error: %s: bad or truncated container header\n",
+                    infile);
+        }
+        close(infd);
+        return -1;
+    }
+
+    ContainerRun run;
+    run.keybytes = keybytes;
+    run.infd = infd;
+    run.in_base = plan.in_base;
+    run.segsize = plan.segsize;
+    run.length = plan.length;
+    uint64_t count = plan.count;
+
+    uint64_t size = run.length;
+    run.first = 0;
+    run.end = count;
+    run.out_base = 0;
+    if (segment >= 0)
+    {
+        if ((uint64_t)segment >= count)
+        {
+            fprintf(stderr, "error: container has only %llu segments\n",
+                    (unsigned long long)count);
+            close(infd);
+            return -1;
+        }
+        run.first = (uint64_t)segment;
+        run.end = run.first + 1;
+        size = run.length - run.first * run.segsize;
+        if (size > run.segsize)
+        {
+            size = run.segsize;
+        }
+    }
+
+    run.outfd = open_output(infd, outfile, size);
+    if (run.outfd < 0)
+    {
+        close(infd);
+        return -1;
+    }
+
+    int status = run_segments(&run, jobs);
+
+    if (close(run.outfd) != 0 && status == 0)
+    {
+        perror("output-file");
+        status = -1;
+    }
+    close(infd);
+
+    return status;
+}
+
+/**
+ * @brief Prepare encrypting a file into a new container.
+ *
+ * @param infile   Path of the plaintext file.
+ * @param outfile  Path of the container to write.
+ * @param segsize  Segment size in bytes; must be > 0.
+ * @param plan     Receives the layout.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int container_plan_create(const char *infile, const char *outfile,
+                          uint64_t segsize, ContainerPlan *plan)
+{
+    assert(segsize > 0);
+
+    int infd = open(infile, O_RDONLY);
+    if (infd < 0)
+    {
+        perror(infile);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(infd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "error: container input must be a regular file\n");
+        close(infd);
+        return -1;
+    }
+
+    plan->segsize = segsize;
+    plan->length = (uint64_t)st.st_size;
+    plan->count = (plan->length + segsize - 1) / segsize;
+    plan->in_base = 0;
+    plan->out_base = CONTAINER_HEADER;
+
+    int outfd = open_output(infd, outfile, CONTAINER_HEADER + plan->length);
+    close(infd);
+    if (outfd < 0)
+    {
+        return -1;
+    }
+
+    uint8_t hdr[CONTAINER_HEADER];
+    format_header(hdr, plan);
+    int status = pwrite_full(outfd, hdr, sizeof(hdr), 0);
+    if (close(outfd) != 0)
+    {
+        status = -1;
+    }
+    if (status != 0)
+    {
+        perror(outfile);
+    }
+    return status;
+}
+
+/**
+ * @brief Prepare decrypting a whole container.
+ *
+ * @param infile   Path of the container.
+ * @param outfile  Path of the plaintext file to write.
+ * @param plan     Receives the layout.
+ *
+ * @return 0 on success, 1 if `infile` is not a valid container, or -1
+ *         after printing a message on failure.
+ */
+int container_plan_extract(const char *infile, const char *outfile,
+                           ContainerPlan *plan)
+{
+    int infd = open(infile, O_RDONLY);
+    if (infd < 0)
+    {
+        perror(infile);
+        return -1;
+    }
+
+    struct stat st;
+    uint8_t hdr[CONTAINER_HEADER];
+    if (fstat(infd, &st) != 0 ||
+        pread_full(infd, hdr, sizeof(hdr), 0) != 0 ||
+        parse_header(hdr, (uint64_t)st.st_size, plan) != 0)
+    {
+        close(infd);
+        return 1;
+    }
+
+    int outfd = open_output(infd, outfile, plan->length);
+    close(infd);
+    if (outfd < 0)
+    {
+        return -1;
+    }
+    if (close(outfd) != 0)
+    {
+        perror(outfile);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Translate one segment of a prepared container.
+ *
+ * @param keybytes  Key read from the key file.
+ * @param plan      Layout from one of the plan functions.
+ * @param infile    Path of the input.
+ * @param outfile   Path of the output.
+ * @param segment   Segment index, below plan->count.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int container_run_segment(const uint8_t keybytes[8],
+                          const ContainerPlan *plan, const char *infile,
+                          const char *outfile, uint64_t segment)
+{
+    assert(segment < plan->count);
+
+    ContainerRun run;
+    run.keybytes = keybytes;
+    run.in_base = plan->in_base;
+    run.out_base = plan->out_base;
+    run.segsize = plan->segsize;
+    run.length = plan->length;
+    run.first = 0;
+
+    run.infd = open(infile, O_RDONLY);
+    if (run.infd < 0)
+    {
+        perror(infile);
+        return -1;
+    }
+    run.outfd = open(outfile, O_WRONLY);
+    if (run.outfd < 0)
+    {
+        perror(outfile);
+        close(run.infd);
+        return -1;
+    }
+
+    void *storage;
+    int rc = posix_memalign(&storage, KS_STATE_ALIGN, KS_STATE_SIZE);
+    assert(rc == 0);
+    (void)rc;
+    uint8_t *buf = malloc(CONTAINER_CHUNK);
+    assert(buf != NULL);
+
+    int status = translate_segment(&run, storage, buf, segment);
+
+    free(buf);
+    free(storage);
+    if (close(run.outfd) != 0 && status == 0)
+    {
+        perror(outfile);
+        status = -1;
+    }
+    close(run.infd);
+    return status;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file container.h
+ * @author Shane Girolamo
+ *
+ * @brief Segmented container format for parallel translation.
+ *
+ * A plain RC4 stream has to be produced byte after byte, so one large
+ * file keeps one core busy. The container splits the data into
+ * fixed-size segments. Each segment is translated with its own KStream,
+ * so segments can be encrypted and decrypted on all cores at once and
+ * any single segment can be decrypted on its own.
+ *
+ * A segment's key is derived one way from the key file and the segment
+ * index, by taking keystream from RC4 keyed with both; see
+ * container_segment_key(). Handing out one segment's key therefore does
+ * not reveal the key file or any other segment. Skipping one stream
+ * ahead to each segment offset was rejected because it makes the cost
+ * of reaching a segment grow with its offset, which defeats the
+ * parallelism. Version 1 containers mixed the index into the key with a
+ * reversible function and are no longer accepted.
+ *
+ * Container layout, all integers little-endian:
+ *
+ *      "KSCT"  u32 version  u64 segment-size  u64 segment-count
+ *      u64 data-length
+ *      data-length bytes of ciphertext, segment n at
+ *          CONTAINER_HEADER + n * segment-size
+ *
+ * The raw format produced without --container stays the default.
+ *
+ * container_create() and container_extract() run the segments of one
+ * file on their own worker pool. Callers with a scheduler of their own,
+ * such as the recursive tree mode, can instead prepare a file with one
+ * of the container_plan functions and hand its segments to
+ * container_run_segment() from any thread, in any order.
+ */
+
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <stdint.h>
+
+/**
+ * @brief Size of the container header in bytes.
+ */
+#define CONTAINER_HEADER 32
+
+/**
+ * @brief Segment size used when none is given.
+ */
+#define CONTAINER_DEFAULT_SEGMENT (64 * 1024 * 1024)
+
+/**
+ * @brief Layout of one prepared container translation.
+ */
+typedef struct
+{
+    uint64_t segsize;  /**< Segment size. */
+    uint64_t count;    /**< Number of segments. */
+    uint64_t length;   /**< Data length of the whole container. */
+    uint64_t in_base;  /**< Input offset of segment 0. */
+    uint64_t out_base; /**< Output offset of segment 0. */
+} ContainerPlan;
+
+/**
+ * @brief Derive the key for one container segment.
+ *
+ * The derivation is one-way: a segment key and its index do not give
+ * away the key file.
+ *
+ * @param keybytes  Key read from the key file.
+ * @param segment   Segment index.
+ * @param out       Receives the 8-byte segment key.
+ */
+void container_segment_key(const uint8_t keybytes[8], uint64_t segment,
+                           uint8_t out[8]);
+
+/**
+ * @brief Encrypt a file into a new container.
+ *
+ * @param keybytes  Key read from the key file.
+ * @param infile    Path of the plaintext file.
+ * @param outfile   Path of the container to write.
+ * @param segsize   Segment size in bytes; must be > 0.
+ * @param jobs      Number of worker threads, or 0 for one per online CPU.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int container_create(const uint8_t keybytes[8], const char *infile,
+                     const char *outfile, uint64_t segsize, int jobs);
+
+/**
+ * @brief Decrypt a container, or one segment of it.
+ *
+ * @param keybytes  Key read from the key file.
+ * @param infile    Path of the container.
+ * @param outfile   Path of the plaintext file to write.
+ * @param segment   Index of the only segment to decrypt, or -1 for all.
+ * @param jobs      Number of worker threads, or 0 for one per online CPU.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int container_extract(const uint8_t keybytes[8], const char *infile,
+                      const char *outfile, int64_t segment, int jobs);
+
+/**
+ * @brief Prepare encrypting a file into a new container.
+ *
+ * Writes the header and sizes the output; the segments are translated
+ * afterwards with container_run_segment().
+ *
+ * @param infile   Path of the plaintext file.
+ * @param outfile  Path of the container to write.
+ * @param segsize  Segment size in bytes; must be > 0.
+ * @param plan     Receives the layout.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int container_plan_create(const char *infile, const char *outfile,
+                          uint64_t segsize, ContainerPlan *plan);
+
+/**
+ * @brief Prepare decrypting a whole container.
+ *
+ * Reads and checks the header and sizes the output; the segments are
+ * translated afterwards with container_run_segment().
+ *
+ * @param infile   Path of the container.
+ * @param outfile  Path of the plaintext file to write.
+ * @param plan     Receives the layout.
+ *
+ * @return 0 on success, 1 without a message if `infile` is not a valid
+ *         container, or -1 after printing a message on failure.
+ */
+int container_plan_extract(const char *infile, const char *outfile,
+                           ContainerPlan *plan);
+
+/**
+ * @brief Translate one segment of a prepared container.
+ *
+ * Opens both files itself, so any number of segments of the same plan
+ * may run at once on different threads.
+ *
+ * @param keybytes  Key read from the key file.
+ * @param plan      Layout from container_plan_create() or
+ *                  container_plan_extract().
+ * @param infile    Path of the input, as passed to the plan function.
+ * @param outfile   Path of the output, as passed to the plan function.
+ * @param segment   Segment index, below plan->count.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int container_run_segment(const uint8_t keybytes[8],
+                          const ContainerPlan *plan, const char *infile,
+                          const char *outfile, uint64_t segment);
+
+/**
+ * @brief End of the CONTAINER_H include guard.
+ */
+#endif
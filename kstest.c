@@ -0,0 +1,1239 @@
+/**
+ * @file kstest.c
+ * @author Shane Girolamo
+ *
+ * @brief Differential tests for every KStream translation path.
+ *
+ * A straightforward byte-at-a-time RC4 implementation, written the way
+ * the cipher was first specified, serves as the reference. Random keys,
+ * lengths and chunk splits are run through the library calls (translate,
+ * in place, generate, multi-stream, skip, snapshots, variable keys, the
+ * prefetch thread, state files, append mode) and
+ * through every I/O backend, into files and into a pipe, the checkpoint
+ * index, the container format and the recursive tree mode, and each
+ * result is compared with the reference. All randomness
+ * comes from one seed, which is printed with every failure so that it
+ * can be replayed with --seed.
+ *
+ * Finally a throughput gate measures ks_translate() against the
+ * reference loop, compiled with the same flags, and fails if it has
+ * fallen below --min-ratio times the reference speed (0.8 by default,
+ * since at -O3 the two run close to each other and timings are noisy),
+ * or below --min-mbps if given.
+ *
+ * Usage:
+ *      kstest [--seed N] [--iterations N] [--min-ratio R] [--min-mbps X]
+ *             [--no-perf]
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "KStream.h"
+#include "mio.h"
+#include "affinity.h"
+#include "prefetch.h"
+#include "ckpt.h"
+#include "container.h"
+#include "tree.h"
+
+/**
+ * @brief Largest buffer used by the in-memory tests.
+ */
+#define MAX_LEN ((size_t)256 * 1024)
+
+/**
+ * @brief Largest number of streams passed to ks_translate_multi().
+ */
+#define MAX_STREAMS 12
+
+/**
+ * @brief Size of the buffer measured by the throughput gate.
+ */
+#define PERF_LEN ((size_t)8 * 1024 * 1024)
+
+/**
+ * @brief Minimum wall time, in seconds, for one throughput measurement.
+ */
+#define PERF_SECONDS 0.3
+
+/**
+ * @brief Reference RC4 state, one byte per call.
+ */
+typedef struct
+{
+    uint8_t S[256]; /**< Permutation of 0-255. */
+    unsigned i;     /**< Generator index i. */
+    unsigned j;     /**< Generator index j. */
+} Ref;
+
+/**
+ * @brief Number of failed checks so far.
+ */
+static int failures = 0;
+
+/**
+ * @brief Seed of the current iteration, printed with failures.
+ */
+static uint64_t iter_seed;
+
+/**
+ * @brief Directory holding the temporary files of the backend tests.
+ */
+static char tmpdir[] = "/tmp/kstest.XXXXXX";
+
+/**
+ * @brief Produce the next reference keystream byte.
+ *
+ * @param r  Reference state.
+ *
+ * @return The keystream byte.
+ */
+static uint8_t ref_next(Ref *r)
+{
+    r->i = (r->i + 1) % 256;
+    r->j = (r->j + r->S[r->i]) % 256;
+    uint8_t t = r->S[r->i];
+    r->S[r->i] = r->S[r->j];
+    r->S[r->j] = t;
+    return r->S[(r->S[r->i] + r->S[r->j]) % 256];
+}
+
+/**
+ * @brief Key the reference state.
+ *
+ * The j left by the key schedule carries into the generator, and the
+ * first `discard` keystream bytes are dropped, as in KStream.
+ *
+ * @param r        Reference state to initialize.
+ * @param key      Key bytes.
+ * @param keylen   Key length, 1 to 256.
+ * @param discard  Number of initial keystream bytes to drop.
+ */
+static void ref_init(Ref *r, const uint8_t *key, size_t keylen,
+                     unsigned discard)
+{
+    for (unsigned n = 0; n < 256; n++)
+    {
+        r->S[n] = (uint8_t)n;
+    }
+
+    r->j = 0;
+    for (unsigned n = 0; n < 256; n++)
+    {
+        r->j = (r->j + r->S[n] + key[n % keylen]) % 256;
+        uint8_t t = r->S[n];
+        r->S[n] = r->S[r->j];
+        r->S[r->j] = t;
+    }
+
+    r->i = 0;
+    for (unsigned n = 0; n < discard; n++)
+    {
+        ref_next(r);
+    }
+}
+
+/**
+ * @brief Translate a buffer with the reference keystream.
+ *
+ * @param r    Reference state.
+ * @param in   Input bytes.
+ * @param out  Receives the translation; may equal `in`.
+ * @param len  Number of bytes.
+ */
+static void ref_translate(Ref *r, const uint8_t *in, uint8_t *out,
+                          size_t len)
+{
+    for (size_t n = 0; n < len; n++)
+    {
+        out[n] = in[n] ^ ref_next(r);
+    }
+}
+
+/**
+ * @brief Advance a 64-bit xorshift generator.
+ *
+ * @param x  Generator state; must not be zero.
+ *
+ * @return The next pseudorandom value.
+ */
+static uint64_t rng_next(uint64_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+/**
+ * @brief Draw a length, biased towards small values and block edges.
+ *
+ * Half of the draws are below 1100 bytes, a quarter land within a few
+ * bytes of a multiple of 512 and the rest are uniform up to `max`.
+ *
+ * @param x    Generator state.
+ * @param max  Largest length to return.
+ *
+ * @return A length between 0 and `max`.
+ */
+static size_t rng_len(uint64_t *x, size_t max)
+{
+    uint64_t r = rng_next(x);
+    size_t len;
+    switch (r & 3)
+    {
+    case 0:
+    case 1:
+        len = (size_t)(r >> 8) % 1100;
+        break;
+    case 2:
+        len = ((size_t)(r >> 8) % 64) * 512 + (size_t)(r >> 40) % 5 - 2;
+        break;
+    default:
+        len = (size_t)(r >> 8) % (max + 1);
+        break;
+    }
+    return len > max ? max : len;
+}
+
+/**
+ * @brief Fill a buffer with pseudorandom bytes.
+ *
+ * @param x    Generator state.
+ * @param buf  Buffer to fill.
+ * @param len  Number of bytes.
+ */
+static void rng_fill(uint64_t *x, uint8_t *buf, size_t len)
+{
+    for (size_t n = 0; n < len; n++)
+    {
+        buf[n] = (uint8_t)(rng_next(x) >> 32);
+    }
+}
+
+/**
+ * @brief Record a failed check.
+ *
+ * @param what  Description of the check.
+ */
+static void fail(const char *what)
+{
+    fprintf(stderr, "FAIL: %s (--seed %llu)\n", what,
+            (unsigned long long)iter_seed);
+    failures++;
+}
+
+/**
+ * @brief Compare two buffers and record a failure if they differ.
+ *
+ * @param what      Description of the check.
+ * @param got       Bytes produced by the path under test.
+ * @param expected  Reference bytes.
+ * @param len       Number of bytes.
+ */
+static void expect_bytes(const char *what, const uint8_t *got,
+                         const uint8_t *expected, size_t len)
+{
+    if (memcmp(got, expected, len) != 0)
+    {
+        fail(what);
+    }
+}
+
+/**
+ * @brief Translate random chunks through a mix of the library calls.
+ *
+ * One stream is driven through ks_translate(), ks_translate_inplace(),
+ * ks_generate() with ks_xor_keystream() and ks_skip(), chosen per chunk,
+ * and must match one reference stream over the whole buffer.
+ *
+ * @param x  Generator state.
+ */
+static void test_chunks(uint64_t *x)
+{
+    uint8_t key[8];
+    rng_fill(x, key, sizeof(key));
+    size_t len = rng_len(x, MAX_LEN);
+
+    uint8_t *in = malloc(MAX_LEN);
+    uint8_t *out = malloc(MAX_LEN);
+    uint8_t *expected = malloc(MAX_LEN);
+    uint8_t *keys = malloc(MAX_LEN);
+    assert(in && out && expected && keys);
+    rng_fill(x, in, len);
+
+    Ref ref;
+    ref_init(&ref, key, sizeof(key), KS_DEFAULT_DISCARD);
+    ref_translate(&ref, in, expected, len);
+
+    KStream *ks = ks_create(key);
+    size_t done = 0;
+    while (done < len)
+    {
+        size_t n = rng_len(x, len - done);
+        if (n == 0)
+        {
+            n = 1;
+        }
+
+        switch (rng_next(x) % 5)
+        {
+        case 0:
+            ks_translate(ks, in + done, out + done, n);
+            break;
+        case 1:
+            memcpy(out + done, in + done, n);
+            ks_translate_inplace(ks, out + done, n);
+            break;
+        case 2:
+            ks_generate(ks, keys, n);
+            memcpy(out + done, in + done, n);
+            ks_xor_keystream(out + done, keys, n);
+            break;
+        case 3:
+            ks_generate(ks, keys, n);
+            for (size_t k = 0; k < n; k++)
+            {
+                out[done + k] = in[done + k] ^ keys[k];
+            }
+            break;
+        default:
+            /* skipped bytes carry no output; fill them from the reference */
+            ks_skip(ks, n);
+            memcpy(out + done, expected + done, n);
+            break;
+        }
+        done += n;
+    }
+    expect_bytes("chunked translate", out, expected, len);
+
+    ks_destroy(ks);
+    free(keys);
+    free(expected);
+    free(out);
+    free(in);
+}
+
+/**
+ * @brief Check the variable-length key and caller-storage constructors.
+ *
+ * @param x  Generator state.
+ */
+static void test_keys(uint64_t *x)
+{
+    uint8_t key[256];
+    size_t keylen = 1 + (size_t)(rng_next(x) % 256);
+    unsigned discard = (unsigned)(rng_next(x) % 3000);
+    rng_fill(x, key, keylen);
+    size_t len = rng_len(x, 4096);
+
+    uint8_t in[4096], out[4096], expected[4096];
+    rng_fill(x, in, len);
+
+    Ref ref;
+    ref_init(&ref, key, keylen, discard);
+    ref_translate(&ref, in, expected, len);
+
+    KStream *ks = ks_create_ex(key, keylen, discard);
+    ks_translate(ks, in, out, len);
+    expect_bytes("ks_create_ex", out, expected, len);
+    ks_destroy(ks);
+
+    void *storage;
+    if (posix_memalign(&storage, KS_STATE_ALIGN, KS_STATE_SIZE) != 0)
+    {
+        storage = NULL;
+    }
+    assert(storage != NULL);
+
+    ks = ks_init_ex(storage, key, keylen, discard);
+    ks_translate(ks, in, out, len);
+    expect_bytes("ks_init_ex", out, expected, len);
+
+    /* the 8-byte fast path must agree with the general schedule */
+    ref_init(&ref, key, 8, KS_DEFAULT_DISCARD);
+    ref_translate(&ref, in, expected, len);
+    ks = ks_init(storage, key);
+    ks_translate(ks, in, out, len);
+    expect_bytes("ks_init", out, expected, len);
+
+    free(storage);
+}
+
+/**
+ * @brief Check ks_translate_multi() against one reference per stream.
+ *
+ * Several rounds with independent random lengths run on the same
+ * streams, half of them in place.
+ *
+ * @param x  Generator state.
+ */
+static void test_multi(uint64_t *x)
+{
+    size_t count = (size_t)(rng_next(x) % (MAX_STREAMS + 1));
+    KStream *streams[MAX_STREAMS];
+    Ref refs[MAX_STREAMS];
+    uint8_t *in[MAX_STREAMS], *out[MAX_STREAMS], *expected[MAX_STREAMS];
+    size_t len[MAX_STREAMS];
+
+    for (size_t k = 0; k < count; k++)
+    {
+        uint8_t key[8];
+        rng_fill(x, key, sizeof(key));
+        streams[k] = ks_create(key);
+        ref_init(&refs[k], key, sizeof(key), KS_DEFAULT_DISCARD);
+        in[k] = malloc(16384);
+        out[k] = malloc(16384);
+        expected[k] = malloc(16384);
+        assert(in[k] && out[k] && expected[k]);
+    }
+
+    for (int round = 0; round < 3; round++)
+    {
+        int inplace = (int)(rng_next(x) & 1);
+        for (size_t k = 0; k < count; k++)
+        {
+            len[k] = rng_len(x, 16384);
+            rng_fill(x, in[k], len[k]);
+            ref_translate(&refs[k], in[k], expected[k], len[k]);
+            if (inplace)
+            {
+                memcpy(out[k], in[k], len[k]);
+            }
+        }
+
+        uint8_t **src = inplace ? out : in;
+        ks_translate_multi(streams, (const uint8_t *const *)src, out, len,
+                           count);
+        for (size_t k = 0; k < count; k++)
+        {
+            expect_bytes("ks_translate_multi", out[k], expected[k], len[k]);
+        }
+    }
+
+    for (size_t k = 0; k < count; k++)
+    {
+        ks_destroy(streams[k]);
+        free(expected[k]);
+        free(out[k]);
+        free(in[k]);
+    }
+}
+
+/**
+ * @brief Check clones, copies and snapshots taken mid-stream.
+ *
+ * @param x  Generator state.
+ */
+static void test_state(uint64_t *x)
+{
+    uint8_t key[8];
+    rng_fill(x, key, sizeof(key));
+    size_t skip = rng_len(x, 20000);
+    size_t len = rng_len(x, 4096);
+
+    uint8_t in[4096], out[4096], expected[4096];
+    rng_fill(x, in, len);
+
+    Ref ref;
+    ref_init(&ref, key, sizeof(key), KS_DEFAULT_DISCARD);
+    for (size_t n = 0; n < skip; n++)
+    {
+        ref_next(&ref);
+    }
+    ref_translate(&ref, in, expected, len);
+
+    KStream *ks = ks_create(key);
+    ks_skip(ks, skip);
+
+    uint8_t snap[KS_SNAPSHOT_SIZE];
+    ks_save_state(ks, snap);
+    KStream *clone = ks_clone(ks);
+    KStream *copy = ks_create(key);
+    ks_copy(copy, ks);
+    KStream *loaded = ks_load_state(snap);
+    if (loaded == NULL)
+    {
+        fail("ks_load_state rejected a saved state");
+        loaded = ks_clone(ks);
+    }
+
+    ks_translate(ks, in, out, len);
+    expect_bytes("ks_skip", out, expected, len);
+    ks_translate(clone, in, out, len);
+    expect_bytes("ks_clone", out, expected, len);
+    ks_translate(copy, in, out, len);
+    expect_bytes("ks_copy", out, expected, len);
+    ks_translate(loaded, in, out, len);
+    expect_bytes("ks_load_state", out, expected, len);
+
+    ks_destroy(loaded);
+    ks_destroy(copy);
+    ks_destroy(clone);
+    ks_destroy(ks);
+}
+
+/**
+ * @brief Check keystream from a Prefetch thread in random chunks.
+ *
+ * Chunks larger than the ring make the consumer wait for the producer.
+ *
+ * @param x  Generator state.
+ */
+static void test_prefetch(uint64_t *x)
+{
+    uint8_t key[8];
+    rng_fill(x, key, sizeof(key));
+    size_t len = rng_len(x, MAX_LEN);
+    size_t ring = (size_t)4096 << (rng_next(x) % 7);
+
+    uint8_t *in = malloc(MAX_LEN);
+    uint8_t *out = malloc(MAX_LEN);
+    uint8_t *expected = malloc(MAX_LEN);
+    assert(in && out && expected);
+    rng_fill(x, in, len);
+
+    Ref ref;
+    ref_init(&ref, key, sizeof(key), KS_DEFAULT_DISCARD);
+    ref_translate(&ref, in, expected, len);
+
+    Prefetch *p = prefetch_create(ks_create(key), ring);
+    assert(p != NULL);
+    size_t done = 0;
+    while (done < len)
+    {
+        size_t n = rng_len(x, len - done);
+        if (n == 0)
+        {
+            n = 1;
+        }
+        if (rng_next(x) & 1)
+        {
+            prefetch_translate(p, in + done, out + done, n);
+        }
+        else
+        {
+            memcpy(out + done, in + done, n);
+            prefetch_translate(p, out + done, out + done, n);
+        }
+        done += n;
+    }
+    expect_bytes("prefetch", out, expected, len);
+
+    prefetch_destroy(p);
+    free(expected);
+    free(out);
+    free(in);
+}
+
+/**
+ * @brief Write a whole buffer to a new file.
+ *
+ * @param path  File to create or truncate.
+ * @param data  Contents.
+ * @param len   Number of bytes.
+ */
+static void write_file(const char *path, const uint8_t *data, size_t len)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL || fwrite(data, 1, len, f) != len || fclose(f) != 0)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Read a file and compare it with expected contents.
+ *
+ * @param what      Description of the check.
+ * @param path      File to read.
+ * @param expected  Expected contents.
+ * @param len       Expected size.
+ */
+static void expect_file(const char *what, const char *path,
+                        const uint8_t *expected, size_t len)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        fail(what);
+        return;
+    }
+
+    uint8_t *got = malloc(len + 1);
+    assert(got != NULL);
+    size_t n = fread(got, 1, len + 1, f);
+    fclose(f);
+
+    if (n != len || memcmp(got, expected, len) != 0)
+    {
+        fail(what);
+    }
+    free(got);
+}
+
+/**
+ * @brief Encode bytes with the ASCII/hex rules of the stdout path.
+ *
+ * @param in   Bytes to encode.
+ * @param len  Number of bytes.
+ * @param out  Receives up to 2 * len characters.
+ *
+ * @return Number of characters written.
+ */
+static size_t ref_text(const uint8_t *in, size_t len, uint8_t *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t o = 0;
+    for (size_t n = 0; n < len; n++)
+    {
+        if (in[n] < 128)
+        {
+            out[o++] = in[n];
+        }
+        else
+        {
+            out[o++] = (uint8_t)hex[in[n] >> 4];
+            out[o++] = (uint8_t)hex[in[n] & 15];
+        }
+    }
+    return o;
+}
+
+/**
+ * @brief Run mio_translate_stdout() with stdout redirected to a file.
+ *
+ * @param ks       Fresh stream for the key.
+ * @param infile   Input file.
+ * @param outfile  File that receives what would have gone to stdout.
+ *
+ * @return The result of mio_translate_stdout().
+ */
+static int translate_to_file(KStream *ks, const char *infile,
+                             const char *outfile)
+{
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    assert(saved >= 0 && fd >= 0);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+
+    int status = mio_translate_stdout(ks, infile);
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return status;
+}
+
+/**
+ * @brief Collects what a backend writes into a pipe.
+ */
+typedef struct
+{
+    int fd;       /**< Read end of the pipe. */
+    uint8_t *buf; /**< Receives up to cap bytes. */
+    size_t cap;   /**< Size of buf. */
+    size_t len;   /**< Bytes read so far, including any beyond cap. */
+} PipeReader;
+
+/**
+ * @brief Thread body: drain a pipe in small reads until EOF.
+ *
+ * Small reads keep the pipe full, so writers wrap around their buffers
+ * while earlier data is still queued.
+ *
+ * @param arg  The PipeReader.
+ *
+ * @return NULL.
+ */
+static void *pipe_reader(void *arg)
+{
+    PipeReader *r = arg;
+    uint8_t scratch[3000];
+    for (;;)
+    {
+        ssize_t n = read(r->fd, scratch, sizeof(scratch));
+        if (n <= 0)
+        {
+            break;
+        }
+        if (r->len + (size_t)n <= r->cap)
+        {
+            memcpy(r->buf + r->len, scratch, (size_t)n);
+        }
+        r->len += (size_t)n;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Run mio_translate_file() with a pipe as the output file.
+ *
+ * @param ks       Fresh stream for the key.
+ * @param infile   Input file.
+ * @param backend  Backend to use.
+ * @param got      Receives up to `cap` bytes of output.
+ * @param cap      Size of `got`.
+ * @param got_len  Receives the number of bytes written to the pipe.
+ *
+ * @return The result of mio_translate_file().
+ */
+static int translate_to_pipe(KStream *ks, const char *infile,
+                             MioBackend backend, uint8_t *got, size_t cap,
+                             size_t *got_len)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    PipeReader r = {fds[0], got, cap, 0};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pipe_reader, &r) != 0)
+    {
+        fprintf(stderr, "error: could not start the pipe reader\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fds[1]);
+    int status = mio_translate_file(ks, infile, path, backend);
+
+    close(fds[1]);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+    *got_len = r.len;
+    return status;
+}
+
+/**
+ * @brief Run one random file through every backend and file format.
+ *
+ * Sizes occasionally exceed the 1 MiB pipeline and io_uring chunks.
+ *
+ * @param x  Generator state.
+ */
+static void test_files(uint64_t *x)
+{
+    static const char *const backends[] = {
+        "auto", "stdio", "mmap", "pipeline", "uring", "lookahead", "splice",
+    };
+
+    uint8_t key[8];
+    rng_fill(x, key, sizeof(key));
+    size_t len = rng_len(x, MAX_LEN);
+    if (rng_next(x) % 8 == 0)
+    {
+        len += (size_t)(rng_next(x) % (3 * 1024 * 1024));
+    }
+
+    uint8_t *plain = malloc(len + 1);
+    uint8_t *cipher = malloc(len + 1);
+    uint8_t *text = malloc(2 * len + 1);
+    assert(plain && cipher && text);
+    rng_fill(x, plain, len);
+
+    Ref ref;
+    ref_init(&ref, key, sizeof(key), KS_DEFAULT_DISCARD);
+    ref_translate(&ref, plain, cipher, len);
+
+    char in[64], out[64], idx[64];
+    snprintf(in, sizeof(in), "%s/in", tmpdir);
+    snprintf(out, sizeof(out), "%s/out", tmpdir);
+    snprintf(idx, sizeof(idx), "%s/out.kidx", tmpdir);
+    write_file(in, plain, len);
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+    {
+        MioBackend backend;
+        mio_backend_parse(backends[b], &backend);
+        KStream *ks = ks_create(key);
+        if (mio_translate_file(ks, in, out, backend) != 0)
+        {
+            fail(backends[b]);
+        }
+        expect_file(backends[b], out, cipher, len);
+        ks_destroy(ks);
+    }
+
+    /* a precomputed state file must give the same stream as the key */
+    char keyfile[64], statefile[64];
+    snprintf(keyfile, sizeof(keyfile), "%s/key", tmpdir);
+    snprintf(statefile, sizeof(statefile), "%s/state", tmpdir);
+    write_file(keyfile, key, sizeof(key));
+    KStream *sks = NULL;
+    if (mio_precompute(keyfile, statefile) != 0 ||
+        (sks = mio_load_stream(statefile)) == NULL ||
+        mio_translate_file(sks, in, out, MIO_AUTO) != 0)
+    {
+        fail("state file");
+    }
+    expect_file("state file", out, cipher, len);
+    ks_destroy(sks);
+    unlink(statefile);
+
+    /* append mode: a growing input, translated a tail at a time */
+    char growing[64], appstate[80];
+    snprintf(growing, sizeof(growing), "%s/growing", tmpdir);
+    snprintf(appstate, sizeof(appstate), "%s%s", out, MIO_APPEND_SUFFIX);
+    unlink(out);
+    size_t have = 0;
+    for (int step = 0; step < 4; step++)
+    {
+        have = step == 3 ? len : have + rng_len(x, len - have);
+        write_file(growing, plain, have);
+        if (mio_append(keyfile, growing, out) != 0)
+        {
+            fail("append");
+        }
+        expect_file("append", out, cipher, have);
+    }
+    unlink(appstate);
+    unlink(growing);
+    unlink(keyfile);
+
+    /* lookahead with its keystream from a producer thread */
+    mio_set_prefetch(1);
+    KStream *pks = ks_create(key);
+    if (mio_translate_file(pks, in, out, MIO_LOOKAHEAD) != 0)
+    {
+        fail("lookahead prefetch");
+    }
+    expect_file("lookahead prefetch", out, cipher, len);
+    ks_destroy(pks);
+    mio_set_prefetch(0);
+
+    /* a pipe as output; auto picks splice there */
+    static const char *const pipe_backends[] = {"auto", "splice", "stdio"};
+    for (size_t b = 0; b < sizeof(pipe_backends) / sizeof(pipe_backends[0]);
+         b++)
+    {
+        MioBackend backend;
+        mio_backend_parse(pipe_backends[b], &backend);
+        KStream *ks = ks_create(key);
+        size_t got;
+        int status = translate_to_pipe(ks, in, backend, text, 2 * len + 1,
+                                       &got);
+        if (status != 0 || got != len || memcmp(text, cipher, len) != 0)
+        {
+            fail(pipe_backends[b]);
+        }
+        ks_destroy(ks);
+    }
+
+    KStream *ks = ks_create(key);
+    if (translate_to_file(ks, in, out) != 0)
+    {
+        fail("stdout");
+    }
+    expect_file("stdout", out, text, ref_text(cipher, len, text));
+    ks_destroy(ks);
+
+    /* checkpointed encode, then a random range decoded through it */
+    uint64_t interval = 1 + rng_next(x) % 70000;
+    ks = ks_create(key);
+    if (ckpt_translate_file(ks, in, out, interval) != 0)
+    {
+        fail("checkpoint");
+    }
+    expect_file("checkpoint", out, cipher, len);
+    ks_destroy(ks);
+
+    size_t off = len == 0 ? 0 : (size_t)(rng_next(x) % len);
+    size_t rlen = rng_len(x, len - off);
+    char rng[64];
+    snprintf(rng, sizeof(rng), "%s/range", tmpdir);
+    ks = ks_create(key);
+    if (ckpt_translate_range(ks, out, rng, off, rlen) != 0)
+    {
+        fail("checkpoint range");
+    }
+    expect_file("checkpoint range", rng, plain + off, rlen);
+    ks_destroy(ks);
+    unlink(idx);
+    unlink(rng);
+
+    /* container: each segment must be the reference under its own key,
+     * with the workers pinned to NUMA nodes half of the time */
+    uint64_t segsize = 1 + rng_next(x) % 200000;
+    int jobs = 1 + (int)(rng_next(x) % 4);
+    affinity_enable((int)(rng_next(x) & 1));
+    if (container_create(key, in, out, segsize, jobs) != 0)
+    {
+        fail("container create");
+    }
+    uint8_t *expected = malloc(CONTAINER_HEADER + len);
+    assert(expected != NULL);
+    FILE *f = fopen(out, "rb");
+    if (f == NULL || fread(expected, 1, CONTAINER_HEADER, f) !=
+                         CONTAINER_HEADER)
+    {
+        fail("container header");
+    }
+    if (f != NULL)
+    {
+        fclose(f);
+    }
+    for (uint64_t start = 0; start < len; start += segsize)
+    {
+        /* segment key: reference keystream under key || le64(index) */
+        uint8_t material[16], segkey[8];
+        memcpy(material, key, 8);
+        for (int b = 0; b < 8; b++)
+        {
+            material[8 + b] = (uint8_t)((start / segsize) >> (8 * b));
+        }
+        ref_init(&ref, material, sizeof(material), KS_DEFAULT_DISCARD);
+        for (int b = 0; b < 8; b++)
+        {
+            segkey[b] = ref_next(&ref);
+        }
+        size_t n = len - start < segsize ? len - start : (size_t)segsize;
+        ref_init(&ref, segkey, sizeof(segkey), KS_DEFAULT_DISCARD);
+        ref_translate(&ref, plain + start, expected + CONTAINER_HEADER + start,
+                      n);
+    }
+    expect_file("container segments", out, expected, CONTAINER_HEADER + len);
+    free(expected);
+
+    char dec[64];
+    snprintf(dec, sizeof(dec), "%s/dec", tmpdir);
+    if (container_extract(key, out, dec, -1, jobs) != 0)
+    {
+        fail("container extract");
+    }
+    expect_file("container extract", dec, plain, len);
+
+    if (len > 0)
+    {
+        uint64_t seg = rng_next(x) % ((len + segsize - 1) / segsize);
+        uint64_t start = seg * segsize;
+        size_t n = len - start < segsize ? len - start : (size_t)segsize;
+        if (container_extract(key, out, dec, (int64_t)seg, jobs) != 0)
+        {
+            fail("container segment");
+        }
+        expect_file("container segment", dec, plain + start, n);
+    }
+    affinity_enable(0);
+
+    unlink(dec);
+    unlink(out);
+    unlink(in);
+    free(text);
+    free(cipher);
+    free(plain);
+}
+
+/**
+ * @brief Number of files in the tree built by test_tree().
+ */
+#define TREE_FILES 6
+
+/**
+ * @brief Path of file `k` of the test tree below `root`.
+ *
+ * The first two files live in a subdirectory.
+ *
+ * @param buf   Receives the path.
+ * @param size  Size of `buf`.
+ * @param root  Root of the tree.
+ * @param k     File index.
+ */
+static void tree_path(char *buf, size_t size, const char *root, int k)
+{
+    snprintf(buf, size, "%s/%s%d", root, k < 2 ? "sub/" : "", k);
+}
+
+/**
+ * @brief Translate a small random tree and undo it with tree_run().
+ *
+ * File sizes straddle TREE_SMALL and the segment size, which is drawn on
+ * either side of TREE_SMALL, so bundles, plain files and containers all
+ * occur, including containers no larger than TREE_SMALL. Plain outputs
+ * must be the reference; containers must extract to the input.
+ *
+ * @param x  Random state.
+ */
+static void test_tree(uint64_t *x)
+{
+    const char *names[3] = {"src", "dst", "back"};
+    char root[3][64];
+    char path[256];
+    for (int d = 0; d < 3; d++)
+    {
+        snprintf(root[d], sizeof(root[d]), "%s/%s", tmpdir, names[d]);
+    }
+    snprintf(path, sizeof(path), "%s/sub", root[0]);
+    if (mkdir(root[0], 0700) != 0 || mkdir(path, 0700) != 0)
+    {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t key[8];
+    rng_fill(x, key, sizeof(key));
+    /* segments below TREE_SMALL turn bundle-sized files into containers */
+    uint64_t segsize = rng_next(x) % 2 == 0
+                           ? 4096 + rng_next(x) % (TREE_SMALL - 4096 + 1)
+                           : TREE_SMALL + 1 + rng_next(x) % 100000;
+    int jobs = 1 + (int)(rng_next(x) % 4);
+
+    uint8_t *plain[TREE_FILES];
+    size_t len[TREE_FILES];
+    for (int k = 0; k < TREE_FILES; k++)
+    {
+        /* small, plain and anything up to three segments, twice each */
+        if (k % 3 == 0)
+        {
+            len[k] = (size_t)(rng_next(x) % (TREE_SMALL + 1));
+        }
+        else if (k % 3 == 1 && segsize > TREE_SMALL)
+        {
+            len[k] = TREE_SMALL + 1 +
+                     (size_t)(rng_next(x) % (segsize - TREE_SMALL));
+        }
+        else if (k % 3 == 1)
+        {
+            len[k] = (size_t)(rng_next(x) % (segsize + 1));
+        }
+        else
+        {
+            len[k] = (size_t)(rng_next(x) % (3 * segsize));
+        }
+        plain[k] = malloc(len[k] + 1);
+        assert(plain[k] != NULL);
+        rng_fill(x, plain[k], len[k]);
+        tree_path(path, sizeof(path), root[0], k);
+        write_file(path, plain[k], len[k]);
+    }
+
+    if (tree_run(key, root[0], root[1], segsize, 0, jobs) != 0)
+    {
+        fail("tree create");
+    }
+    char dec[64];
+    snprintf(dec, sizeof(dec), "%s/dec", tmpdir);
+    for (int k = 0; k < TREE_FILES; k++)
+    {
+        tree_path(path, sizeof(path), root[1], k);
+        if (len[k] > segsize)
+        {
+            if (container_extract(key, path, dec, -1, 1) != 0)
+            {
+                fail("tree container");
+            }
+            expect_file("tree container", dec, plain[k], len[k]);
+            unlink(dec);
+            continue;
+        }
+
+        uint8_t *expected = malloc(len[k] + 1);
+        assert(expected != NULL);
+        Ref ref;
+        ref_init(&ref, key, sizeof(key), KS_DEFAULT_DISCARD);
+        ref_translate(&ref, plain[k], expected, len[k]);
+        expect_file("tree file", path, expected, len[k]);
+        free(expected);
+    }
+
+    if (tree_run(key, root[1], root[2], segsize, 1, jobs) != 0)
+    {
+        fail("tree extract");
+    }
+    for (int k = 0; k < TREE_FILES; k++)
+    {
+        tree_path(path, sizeof(path), root[2], k);
+        expect_file("tree extract", path, plain[k], len[k]);
+        free(plain[k]);
+    }
+
+    for (int d = 0; d < 3; d++)
+    {
+        for (int k = 0; k < TREE_FILES; k++)
+        {
+            tree_path(path, sizeof(path), root[d], k);
+            unlink(path);
+        }
+        snprintf(path, sizeof(path), "%s/sub", root[d]);
+        rmdir(path);
+        rmdir(root[d]);
+    }
+}
+
+/**
+ * @brief Read the monotonic clock.
+ *
+ * @return Current time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Measure reference and ks_translate() throughput.
+ *
+ * @param min_ratio  Required ks_translate() speed relative to the
+ *                   reference.
+ * @param min_mbps   Required absolute ks_translate() speed in MB/s, or 0.
+ */
+static void test_perf(double min_ratio, double min_mbps)
+{
+    static const uint8_t key[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t *buf = malloc(PERF_LEN);
+    assert(buf != NULL);
+    memset(buf, 0x5a, PERF_LEN);
+
+    Ref ref;
+    ref_init(&ref, key, sizeof(key), KS_DEFAULT_DISCARD);
+    uint64_t ref_bytes = 0;
+    double start = now();
+    double ref_secs;
+    while ((ref_secs = now() - start) < PERF_SECONDS)
+    {
+        ref_translate(&ref, buf, buf, PERF_LEN);
+        ref_bytes += PERF_LEN;
+    }
+
+    KStream *ks = ks_create(key);
+    uint64_t ks_bytes = 0;
+    start = now();
+    double ks_secs;
+    while ((ks_secs = now() - start) < PERF_SECONDS)
+    {
+        ks_translate_inplace(ks, buf, PERF_LEN);
+        ks_bytes += PERF_LEN;
+    }
+    ks_destroy(ks);
+    free(buf);
+
+    double ref_mbps = (double)ref_bytes / ref_secs / 1e6;
+    double ks_mbps = (double)ks_bytes / ks_secs / 1e6;
+    printf("throughput: ks_translate %.1f MB/s, reference %.1f MB/s "
+           "(%.2fx)\n",
+           ks_mbps, ref_mbps, ks_mbps / ref_mbps);
+
+    if (ks_mbps < min_ratio * ref_mbps)
+    {
+        fprintf(stderr, "FAIL: ks_translate below %.2fx the reference\n",
+                min_ratio);
+        failures++;
+    }
+    if (min_mbps > 0 && ks_mbps < min_mbps)
+    {
+        fprintf(stderr, "FAIL: ks_translate below %.1f MB/s\n", min_mbps);
+        failures++;
+    }
+}
+
+/**
+ * @brief Print usage message to stderr.
+ */
+static void usage(void)
+{
+    fprintf(stderr, "usage: kstest [--seed N] [--iterations N] "
+                    "[--min-ratio R] [--min-mbps X] [--no-perf]\n");
+}
+
+/**
+ * @brief Program entry point for the differential tests.
+ *
+ * @param argc  Argument count.
+ * @param argv  Argument vector.
+ *
+ * @return EXIT_SUCCESS if every check passed; EXIT_FAILURE otherwise.
+ */
+int main(int argc, char **argv)
+{
+    uint64_t seed = (uint64_t)time(NULL);
+    long iterations = 200;
+    double min_ratio = 0.8;
+    double min_mbps = 0;
+    int perf = 1;
+
+    for (int argi = 1; argi < argc; argi++)
+    {
+        if (strcmp(argv[argi], "--seed") == 0 && argi + 1 < argc)
+        {
+            seed = strtoull(argv[++argi], NULL, 10);
+        }
+        else if (strcmp(argv[argi], "--iterations") == 0 && argi + 1 < argc)
+        {
+            iterations = strtol(argv[++argi], NULL, 10);
+        }
+        else if (strcmp(argv[argi], "--min-ratio") == 0 && argi + 1 < argc)
+        {
+            min_ratio = strtod(argv[++argi], NULL);
+        }
+        else if (strcmp(argv[argi], "--min-mbps") == 0 && argi + 1 < argc)
+        {
+            min_mbps = strtod(argv[++argi], NULL);
+        }
+        else if (strcmp(argv[argi], "--no-perf") == 0)
+        {
+            perf = 0;
+        }
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (mkdtemp(tmpdir) == NULL)
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    /* each iteration reseeds, so a failure replays with --iterations 1 */
+    printf("kstest: seed %llu, %ld iterations, %s kernel\n",
+           (unsigned long long)seed, iterations, ks_impl_name());
+    for (long it = 0; it < iterations; it++)
+    {
+        iter_seed = seed + (uint64_t)it;
+        uint64_t x = iter_seed * 0x9e3779b97f4a7c15ull | 1;
+        test_chunks(&x);
+        test_keys(&x);
+        test_multi(&x);
+        test_state(&x);
+        test_prefetch(&x);
+        if (it % 10 == 0)
+        {
+            test_files(&x);
+            test_tree(&x);
+        }
+    }
+    rmdir(tmpdir);
+
+    if (perf)
+    {
+        test_perf(min_ratio, min_mbps);
+    }
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "kstest: %d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("kstest: all checks passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,147 @@
+/**
+ * @file kstest_cxx.cpp
+ * @author Shane Girolamo
+ *
+ * @brief Checks the C++ wrapper against the C API through libkstream.so.
+ *
+ * Built and linked against the shared library, so it also checks that
+ * the header works from C++ and that the library exports what the
+ * wrapper needs. Correctness of the cipher itself is kstest's job; here
+ * every wrapper call only has to agree with the matching C call.
+ */
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "kstream.hpp"
+
+/**
+ * @brief Number of failed checks so far.
+ */
+static int failures = 0;
+
+/**
+ * @brief Record the result of one check.
+ *
+ * @param ok    Whether the check passed.
+ * @param what  Description of the check.
+ */
+static void check(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/**
+ * @brief Program entry point for the wrapper tests.
+ *
+ * @return EXIT_SUCCESS if every check passed; EXIT_FAILURE otherwise.
+ */
+int main()
+{
+    const std::array<std::uint8_t, 8> key = {1, 2, 3, 4, 5, 6, 7, 8};
+
+    std::vector<std::uint8_t> in(10000);
+    for (std::size_t n = 0; n < in.size(); n++)
+    {
+        in[n] = static_cast<std::uint8_t>(n * 7);
+    }
+
+    /* the C API is the reference for the wrapper */
+    std::vector<std::uint8_t> expected(in.size());
+    ::KStream *ref = ks_create(key.data());
+    ks_translate(ref, in.data(), expected.data(), in.size());
+    ks_destroy(ref);
+
+    kstream::Stream ks(key);
+    std::vector<std::uint8_t> out(in.size());
+    ks.translate(std::span(in).first(4000), std::span(out).first(4000));
+
+    std::array<std::uint8_t, KS_SNAPSHOT_SIZE> snap;
+    ks.save(snap);
+    kstream::Stream copy = ks.clone();
+    kstream::Stream restored = kstream::Stream::from_state(snap);
+
+    std::vector<std::uint8_t> tail(in.begin() + 4000, in.end());
+    ks.translate(std::span(in).subspan(4000), std::span(out).subspan(4000));
+    check(out == expected, "translate");
+
+    std::vector<std::uint8_t> buf = tail;
+    copy.translate(buf);
+    check(std::memcmp(buf.data(), expected.data() + 4000, buf.size()) == 0,
+          "clone, translate in place");
+
+    std::vector<std::uint8_t> keys(tail.size());
+    restored.generate(keys);
+    for (std::size_t n = 0; n < tail.size(); n++)
+    {
+        tail[n] ^= keys[n];
+    }
+    check(std::memcmp(tail.data(), expected.data() + 4000, tail.size()) == 0,
+          "from_state, generate");
+
+    kstream::Stream ex = kstream::Stream::with_key(key);
+    ex.skip(4000);
+    kstream::Stream moved = std::move(ex);
+    buf.assign(in.begin() + 4000, in.end());
+    moved.translate(buf);
+    check(std::memcmp(buf.data(), expected.data() + 4000, buf.size()) == 0,
+          "with_key, skip, move");
+
+    bool threw = false;
+    try
+    {
+        ks.translate(in, std::span(out).first(10));
+    }
+    catch (const std::length_error &)
+    {
+        threw = true;
+    }
+    check(threw, "short output throws");
+
+    kstream::Stream same = kstream::Stream::with_key(key);
+    buf.assign(in.begin(), in.end());
+    same.translate(std::span<const std::uint8_t>(buf), std::span(buf));
+    check(std::memcmp(buf.data(), expected.data(), buf.size()) == 0,
+          "translate with the same span");
+
+    threw = false;
+    try
+    {
+        same.translate(std::span<const std::uint8_t>(buf).first(100),
+                       std::span(buf).subspan(1));
+    }
+    catch (const std::invalid_argument &)
+    {
+        threw = true;
+    }
+    check(threw, "overlapping spans throw");
+
+    snap[0] = snap[1];
+    threw = false;
+    try
+    {
+        kstream::Stream::from_state(snap);
+    }
+    catch (const std::invalid_argument &)
+    {
+        threw = true;
+    }
+    check(threw, "corrupt snapshot throws");
+
+    if (failures > 0)
+    {
+        std::fprintf(stderr, "kstest_cxx: %d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    std::printf("kstest_cxx: all checks passed (%s kernel)\n",
+                ks_impl_name());
+    return EXIT_SUCCESS;
+}
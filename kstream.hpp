@@ -0,0 +1,246 @@
+/**
+ * @file kstream.hpp
+ * @author Shane Girolamo
+ *
+ * @brief Header-only C++20 wrapper around the KStream C API.
+ *
+ * kstream::Stream owns one KStream and destroys it when it goes out of
+ * scope. Data is passed as std::span, so translation works directly on
+ * the caller's buffers without copies. Link with -lkstream, or with
+ * KStream.o, exactly as for the C API.
+ */
+
+#ifndef KSTREAM_HPP
+#define KSTREAM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include "KStream.h"
+
+namespace kstream
+{
+
+/**
+ * @brief Owning, move-only handle to a KStream.
+ */
+class Stream
+{
+public:
+    /**
+     * @brief Create a stream from an 8-byte key, as ks_create() does.
+     *
+     * @param key  The binary key.
+     */
+    explicit Stream(std::span<const std::uint8_t, 8> key)
+        : ks_(ks_create(key.data()))
+    {
+    }
+
+    /**
+     * @brief Create a stream from a key of any length, see ks_create_ex().
+     *
+     * @param key      Key bytes, 1 to 256 of them.
+     * @param discard  Number of initial keystream bytes to drop.
+     *
+     * @return The new stream.
+     *
+     * @throw std::invalid_argument if the key length is out of range.
+     */
+    static Stream with_key(std::span<const std::uint8_t> key,
+                           unsigned discard = KS_DEFAULT_DISCARD)
+    {
+        if (key.empty() || key.size() > 256)
+        {
+            throw std::invalid_argument("kstream: key must be 1-256 bytes");
+        }
+        return Stream(ks_create_ex(key.data(), key.size(), discard));
+    }
+
+    /**
+     * @brief Continue a stream from a snapshot, see ks_load_state().
+     *
+     * @param state  Snapshot written by save().
+     *
+     * @return The restored stream.
+     *
+     * @throw std::invalid_argument if the snapshot is corrupt.
+     */
+    static Stream
+    from_state(std::span<const std::uint8_t, KS_SNAPSHOT_SIZE> state)
+    {
+        ::KStream *ks = ks_load_state(state.data());
+        if (ks == nullptr)
+        {
+            throw std::invalid_argument("kstream: invalid state snapshot");
+        }
+        return Stream(ks);
+    }
+
+    /**
+     * @brief Move constructor; `other` is left empty.
+     *
+     * @param other  Stream to take over.
+     */
+    Stream(Stream &&other) noexcept : ks_(std::exchange(other.ks_, nullptr))
+    {
+    }
+
+    /**
+     * @brief Move assignment; `other` is left empty.
+     *
+     * @param other  Stream to take over.
+     *
+     * @return This stream.
+     */
+    Stream &operator=(Stream &&other) noexcept
+    {
+        if (this != &other)
+        {
+            ks_destroy(ks_);
+            ks_ = std::exchange(other.ks_, nullptr);
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Copying is explicit through clone().
+     */
+    Stream(const Stream &) = delete;
+
+    /**
+     * @brief Copying is explicit through clone().
+     */
+    Stream &operator=(const Stream &) = delete;
+
+    /**
+     * @brief Destroy the underlying KStream.
+     */
+    ~Stream()
+    {
+        ks_destroy(ks_);
+    }
+
+    /**
+     * @brief Independent copy at the same keystream position.
+     *
+     * @return The copy.
+     */
+    Stream clone() const
+    {
+        return Stream(ks_clone(ks_));
+    }
+
+    /**
+     * @brief Translate `in` into `out`, see ks_translate().
+     *
+     * If both spans start at the same byte the translation is done in
+     * place with ks_translate_inplace(); any other overlap is rejected,
+     * since ks_translate() requires separate buffers.
+     *
+     * @param in   Input bytes; the same bytes as `out` or disjoint from
+     *             its first in.size() bytes.
+     * @param out  Receives in.size() translated bytes.
+     *
+     * @throw std::length_error if `out` is smaller than `in`.
+     * @throw std::invalid_argument if `in` and `out` partially overlap.
+     */
+    void translate(std::span<const std::uint8_t> in,
+                   std::span<std::uint8_t> out)
+    {
+        if (out.size() < in.size())
+        {
+            throw std::length_error("kstream: output smaller than input");
+        }
+        if (in.empty())
+        {
+            return;
+        }
+        if (in.data() == out.data())
+        {
+            ks_translate_inplace(ks_, out.data(), in.size());
+            return;
+        }
+
+        std::less<const std::uint8_t *> before;
+        if (before(in.data(), out.data() + in.size()) &&
+            before(out.data(), in.data() + in.size()))
+        {
+            throw std::invalid_argument("kstream: input and output overlap");
+        }
+        ks_translate(ks_, in.data(), out.data(), in.size());
+    }
+
+    /**
+     * @brief Translate a buffer in place, see ks_translate_inplace().
+     *
+     * @param buf  Bytes replaced by their translation.
+     */
+    void translate(std::span<std::uint8_t> buf)
+    {
+        ks_translate_inplace(ks_, buf.data(), buf.size());
+    }
+
+    /**
+     * @brief Fill a buffer with raw keystream, see ks_generate().
+     *
+     * @param out  Receives out.size() keystream bytes.
+     */
+    void generate(std::span<std::uint8_t> out)
+    {
+        ks_generate(ks_, out.data(), out.size());
+    }
+
+    /**
+     * @brief Discard keystream bytes, see ks_skip().
+     *
+     * @param num  Number of bytes to skip.
+     */
+    void skip(std::uint64_t num)
+    {
+        ks_skip(ks_, num);
+    }
+
+    /**
+     * @brief Write a snapshot of the stream, see ks_save_state().
+     *
+     * @param state  Receives the snapshot.
+     */
+    void save(std::span<std::uint8_t, KS_SNAPSHOT_SIZE> state) const
+    {
+        ks_save_state(ks_, state.data());
+    }
+
+    /**
+     * @brief Underlying handle, for C functions such as
+     *        ks_translate_multi().
+     *
+     * @return The KStream; still owned by this object.
+     */
+    ::KStream *get() const noexcept
+    {
+        return ks_;
+    }
+
+private:
+    /**
+     * @brief Take ownership of a handle from the C API.
+     *
+     * @param ks  Handle to own.
+     */
+    explicit Stream(::KStream *ks) noexcept : ks_(ks)
+    {
+    }
+
+    ::KStream *ks_; /**< Owned stream, or null after a move. */
+};
+
+} // namespace kstream
+
+/**
+ * @brief End of the KSTREAM_HPP include guard.
+ */
+#endif
@@ -0,0 +1,51 @@
+/**
+ * @file le.h
+ * @author Shane Girolamo
+ *
+ * @brief Little-endian integer encoding for the on-disk and wire formats.
+ *
+ * Checkpoint indexes, containers, state files and the server protocol
+ * all store their integers little-endian, byte by byte, so the files
+ * are the same on every host.
+ */
+
+#ifndef LE_H
+#define LE_H
+
+#include <stdint.h>
+
+/**
+ * @brief Store a 64-bit value in little-endian order.
+ *
+ * @param p  Destination, 8 bytes.
+ * @param v  Value to store.
+ */
+static inline void put_le64(uint8_t *p, uint64_t v)
+{
+    for (int n = 0; n < 8; n++)
+    {
+        p[n] = (uint8_t)(v >> (8 * n));
+    }
+}
+
+/**
+ * @brief Load a 64-bit little-endian value.
+ *
+ * @param p  Source, 8 bytes.
+ *
+ * @return The decoded value.
+ */
+static inline uint64_t get_le64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int n = 7; n >= 0; n--)
+    {
+        v = (v << 8) | p[n];
+    }
+    return v;
+}
+
+/**
+ * @brief End of the LE_H include guard.
+ */
+#endif
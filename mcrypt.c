@@ -5,193 +5,546 @@
  * @brief Main driver program for the KStream stream cipher.
  *
  * Usage:
- *      mcrypt key-file input-file [output-file | - ]
+ *      mcrypt [--io=auto|stdio|mmap|pipeline|uring|lookahead|splice]
+ *             [--direct] [--hugepages] [--prefetch] [--checkpoint=SIZE]
+ *             key-file input-file [output-file | - ]
+ *      mcrypt --range=OFF:LEN key-file input-file [output-file | - ]
+ *      mcrypt --append key-file input-file output-file
+ *      mcrypt --container [--segment-size=SIZE] [--jobs=N] [--numa]
+ *             key-file input-file output-file
+ *      mcrypt --extract [--segment=N] [--jobs=N] [--numa]
+ *             key-file input-file output-file
+ *      mcrypt [--io=...] [--jobs=N] [--numa] --batch manifest
+ *      mcrypt [--jobs=N] --serve=SOCKET
+ *      mcrypt --connect=SOCKET key-file input-file [output-file | - ]
+ *      mcrypt --connect=SOCKET --stats
+ *      mcrypt --precompute key-file state-file
+ *      mcrypt -r [--extract] [--segment-size=SIZE] [--jobs=N] [--numa]
+ *             key-file src-dir dst-dir
+ *
+ * --precompute writes the primed keystream state of a key to a state
+ * file. The state file can then stand in for the key file in the plain,
+ * --checkpoint, --range, --append and --batch modes, skipping the key
+ * schedule and the discard on every run. Containers and --connect need
+ * the key itself.
+ *
+ * --append is for inputs that only grow, such as logs. It keeps the
+ * stream state in output-file.ksa and on every later run translates and
+ * appends only what was added to input-file since.
+ *
+ * An input-file of "-" reads stdin; keystream is then generated ahead
+ * while the input is idle (--io=lookahead), or all the time on a second
+ * thread with --prefetch. An output-file that is a pipe, such as
+ * /dev/stdout in a pipeline, is written without copies (--io=splice).
+ *
+ * -r translates every file under src-dir into the same path under
+ * dst-dir on a pool of threads. Files longer than one segment are
+ * written as containers; -r --extract undoes it, extracting containers
+ * and translating everything else.
+ *
+ * --numa pins the worker threads of --batch, -r, --container and --extract
+ * to NUMA nodes, spreading them over all sockets, so that each worker's
+ * buffers and stream state live in memory local to it.
+ *
+ * In any other mode, --stats prints the KStream and I/O counters on
+ * stderr at exit; they are only collected in a STATS=1 build.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <ctype.h>
-#include <assert.h>
+#include <string.h>
 #include "KStream.h"
+#include "mio.h"
+#include "affinity.h"
+#include "batch.h"
+#include "ckpt.h"
+#include "container.h"
+#include "serve.h"
+#include "tree.h"
 
 /**
  * @brief Print usage message to stderr.
  */
 static void usage(void)
 {
-    fprintf(stderr, "usage: mcrypt key-file in-file [ out-file | - ]\n");
+    fprintf(stderr, "usage: mcrypt "
+                    "[--io=auto|stdio|mmap|pipeline|uring|lookahead|splice]"
+                    "\n"
+                    "              [--direct] [--hugepages] [--prefetch]\n"
+                    "              [--checkpoint=SIZE] "
+                    "key-file in-file [ out-file | - ]\n"
+                    "       mcrypt --range=OFF:LEN "
+                    "key-file in-file [ out-file | - ]\n"
+                    "       mcrypt --append key-file in-file out-file\n"
+                    "       mcrypt --container [--segment-size=SIZE] "
+                    "[--jobs=N] [--numa]\n"
+                    "              key-file in-file out-file\n"
+                    "       mcrypt --extract [--segment=N] [--jobs=N] "
+                    "[--numa] key-file in-file out-file\n"
+                    "       mcrypt [--io=...] [--jobs=N] [--numa] "
+                    "--batch manifest\n"
+                    "       mcrypt [--jobs=N] --serve=SOCKET\n"
+                    "       mcrypt --connect=SOCKET "
+                    "key-file in-file [ out-file | - ]\n"
+                    "       mcrypt --connect=SOCKET --stats\n"
+                    "       mcrypt --precompute key-file state-file\n"
+                    "       mcrypt -r [--extract] [--segment-size=SIZE] "
+                    "[--jobs=N] [--numa]\n"
+                    "              key-file src-dir dst-dir\n"
+                    "       (in-file - reads stdin; --stats in other modes "
+                    "reports counters at exit)"
+                    "\n");
 }
 
 /**
- * @brief Read an 8-byte key from the provided key file.
+ * @brief Match a command-line option that takes a value.
+ *
+ * Both "--name=value" and "--name value" are accepted. A missing value
+ * is a usage error and terminates the program.
+ *
+ * @param argc  Argument count.
+ * @param argv  Argument vector.
+ * @param argi  Index of the current argument; advanced past the value
+ *              when it is given as a separate argument.
+ * @param name  Option name, including the leading dashes.
  *
- * @param keyfile   Path to the binary key file.
- * @param keybytes  Output buffer that receives the 8-byte key.
+ * @return The option value, or NULL if argv[*argi] is not this option.
  */
-static void read_key(const char *keyfile, uint8_t keybytes[8])
+static const char *option_value(int argc, char **argv, int *argi,
+                                const char *name)
 {
-    FILE *kf = fopen(keyfile, "rb");
-    if (!kf)
+    const char *arg = argv[*argi];
+    size_t len = strlen(name);
+
+    if (strncmp(arg, name, len) != 0)
+    {
+        return NULL;
+    }
+    if (arg[len] == '=')
+    {
+        return arg + len + 1;
+    }
+    if (arg[len] != '\0')
     {
-        perror("key-file");
+        return NULL;
+    }
+    if (*argi + 1 >= argc)
+    {
+        usage();
         exit(EXIT_FAILURE);
     }
 
-    size_t n = fread(keybytes, 1, 8, kf);
-    fclose(kf);
+    *argi += 1;
+    return argv[*argi];
+}
 
-    if (n != 8)
+/**
+ * @brief Print the KStream and I/O counters on stderr.
+ *
+ * Registered with atexit() when --stats is given.
+ */
+static void print_stats(void)
+{
+    KStreamStats ks;
+    MioStats io;
+    if (ks_get_stats(&ks) != 0 || mio_get_stats(&io) != 0)
     {
-        fprintf(stderr, "error: key file must contain 8 bytes\n");
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "stats: not compiled in; rebuild with make STATS=1\n");
+        return;
     }
+
+    double xlate_s = (double)ks.translate_ns / 1e9;
+    fprintf(stderr,
+            "stats: xor kernel %s\n"
+            "stats: ks_create %llu (ksa %.3f ms, discard %.3f ms), "
+            "%llu allocs\n"
+            "stats: translate %llu bytes in %llu calls, %.3f s (%.1f MB/s)\n"
+            "stats: read %llu bytes in %llu calls, %.3f s\n"
+            "stats: write %llu bytes in %llu calls, %.3f s\n"
+            "stats: io_uring wait %.3f s, mmap %llu bytes\n"
+            "stats: %llu buffers mapped, %llu reused, "
+            "peak %llu bytes live\n",
+            ks_impl_name(), (unsigned long long)ks.creates,
+            (double)ks.ksa_ns / 1e6,
+            (double)ks.discard_ns / 1e6, (unsigned long long)ks.allocs,
+            (unsigned long long)ks.translate_bytes,
+            (unsigned long long)ks.translate_calls, xlate_s,
+            xlate_s > 0 ? (double)ks.translate_bytes / 1e6 / xlate_s : 0.0,
+            (unsigned long long)io.read_bytes,
+            (unsigned long long)io.read_calls, (double)io.read_ns / 1e9,
+            (unsigned long long)io.write_bytes,
+            (unsigned long long)io.write_calls, (double)io.write_ns / 1e9,
+            (double)io.uring_wait_ns / 1e9,
+            (unsigned long long)io.mapped_bytes,
+            (unsigned long long)io.buffer_allocs,
+            (unsigned long long)io.buffer_reuses,
+            (unsigned long long)io.buffer_peak);
 }
 
 /**
- * @brief Read an entire file into a heap-allocated buffer.
+ * @brief Parse a byte count with an optional K, M or G suffix.
  *
- * @param filename  Path to the file to read.
- * @param len_out   Output parameter that receives the file length.
+ * @param arg  Text to parse.
+ * @param end  Receives a pointer just past the parsed count.
+ * @param out  Receives the count.
  *
- * @return Pointer to a buffer containing the file contents.
+ * @return 0 on success, or -1 if `arg` does not start with a count or
+ *         the count does not fit in 64 bits.
  */
-static uint8_t *read_input(const char *filename, size_t *len_out)
+static int parse_size(const char *arg, char **end, uint64_t *out)
 {
-    FILE *f = fopen(filename, "rb");
-    if (!f)
+    if (*arg < '0' || *arg > '9')
     {
-        perror("input-file");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    rewind(f);
-
-    if (size < 0)
+    errno = 0;
+    unsigned long long val = strtoull(arg, end, 10);
+    if (errno == ERANGE || val > UINT64_MAX)
     {
-        fprintf(stderr, "error: cannot read file size\n");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    uint8_t *buf = malloc(size);
-    assert(buf != NULL);
-
-    size_t n = fread(buf, 1, size, f);
-    fclose(f);
-
-    if (n != (size_t)size)
+    int shift = 0;
+    switch (**end)
     {
-        fprintf(stderr, "error: could not read entire input file\n");
-        exit(EXIT_FAILURE);
+    case 'G':
+        shift = 30;
+        break;
+    case 'M':
+        shift = 20;
+        break;
+    case 'K':
+        shift = 10;
+        break;
+    default:
+        break;
+    }
+    if (shift > 0)
+    {
+        if (val > (UINT64_MAX >> shift))
+        {
+            return -1;
+        }
+        val <<= shift;
+        *end += 1;
     }
 
-    *len_out = (size_t)size;
-    return buf;
+    *out = (uint64_t)val;
+    return 0;
 }
 
 /**
- * @brief Write binary output to a file.
+ * @brief Program entry point for the mcrypt driver.
  *
- * @param filename  Output file path.
- * @param data      Buffer containing the data to write.
- * @param len       Number of bytes to write.
+ * @param argc  Argument count.
+ * @param argv  Argument vector describing key/input/output paths.
+ *
+ * @return EXIT_SUCCESS on success; EXIT_FAILURE on invalid usage.
  */
-static void write_output_file(const char *filename,
-                              const uint8_t *data,
-                              size_t len)
+int main(int argc, char **argv)
 {
-    FILE *f = fopen(filename, "wb");
-    if (!f)
+    MioBackend backend = MIO_AUTO;
+    const char *manifest = NULL;
+    int jobs = 0;
+    uint64_t interval = 0;
+    uint64_t range_off = 0;
+    uint64_t range_len = 0;
+    int ranged = 0;
+    int container = 0;
+    int extract = 0;
+    uint64_t segsize = CONTAINER_DEFAULT_SEGMENT;
+    int64_t segment = -1;
+    const char *serve_path = NULL;
+    const char *connect_path = NULL;
+    int stats = 0;
+    int precompute = 0;
+    int recursive = 0;
+    int append = 0;
+
+    int argi = 1;
+    while (argi < argc && (strncmp(argv[argi], "--", 2) == 0 ||
+                           strcmp(argv[argi], "-r") == 0))
     {
-        perror("output-file");
-        exit(EXIT_FAILURE);
+        const char *val;
+
+        if ((val = option_value(argc, argv, &argi, "--io")) != NULL)
+        {
+            if (mio_backend_parse(val, &backend) != 0)
+            {
+                fprintf(stderr, "error: unknown I/O backend '%s'\n", val);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[argi], "--direct") == 0)
+        {
+            mio_set_direct(1);
+        }
+        else if (strcmp(argv[argi], "--hugepages") == 0)
+        {
+            mio_set_hugepages(1);
+        }
+        else if (strcmp(argv[argi], "--prefetch") == 0)
+        {
+            mio_set_prefetch(1);
+        }
+        else if (strcmp(argv[argi], "--numa") == 0)
+        {
+            affinity_enable(1);
+        }
+        else if ((val = option_value(argc, argv, &argi, "--batch")) != NULL)
+        {
+            manifest = val;
+        }
+        else if ((val = option_value(argc, argv, &argi, "--jobs")) != NULL)
+        {
+            jobs = atoi(val);
+            if (jobs <= 0)
+            {
+                fprintf(stderr, "error: --jobs needs a positive count\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if ((val = option_value(argc, argv, &argi, "--checkpoint")) !=
+                 NULL)
+        {
+            char *end;
+            if (parse_size(val, &end, &interval) != 0 || *end != '\0' ||
+                interval == 0)
+            {
+                fprintf(stderr, "error: bad checkpoint interval '%s'\n",
+                        val);
+                return EXIT_FAILURE;
+            }
+        }
+        else if ((val = option_value(argc, argv, &argi, "--range")) != NULL)
+        {
+            char *end;
+            if (parse_size(val, &end, &range_off) != 0 || *end != ':' ||
+                parse_size(end + 1, &end, &range_len) != 0 || *end != '\0')
+            {
+                fprintf(stderr, "error: bad range '%s'\n", val);
+                return EXIT_FAILURE;
+            }
+            ranged = 1;
+        }
+        else if (strcmp(argv[argi], "--container") == 0)
+        {
+            container = 1;
+        }
+        else if ((val = option_value(argc, argv, &argi,
+                                     "--segment-size")) != NULL)
+        {
+            char *end;
+            if (parse_size(val, &end, &segsize) != 0 || *end != '\0' ||
+                segsize == 0)
+            {
+                fprintf(stderr, "error: bad segment size '%s'\n", val);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[argi], "--extract") == 0)
+        {
+            extract = 1;
+        }
+        else if ((val = option_value(argc, argv, &argi, "--segment")) !=
+                 NULL)
+        {
+            char *end;
+            uint64_t n;
+            if (parse_size(val, &end, &n) != 0 || *end != '\0' ||
+                n > INT64_MAX)
+            {
+                fprintf(stderr, "error: bad segment index '%s'\n", val);
+                return EXIT_FAILURE;
+            }
+            segment = (int64_t)n;
+        }
+        else if ((val = option_value(argc, argv, &argi, "--serve")) != NULL)
+        {
+            serve_path = val;
+        }
+        else if ((val = option_value(argc, argv, &argi, "--connect")) !=
+                 NULL)
+        {
+            connect_path = val;
+        }
+        else if (strcmp(argv[argi], "--stats") == 0)
+        {
+            stats = 1;
+        }
+        else if (strcmp(argv[argi], "--precompute") == 0)
+        {
+            precompute = 1;
+        }
+        else if (strcmp(argv[argi], "--append") == 0)
+        {
+            append = 1;
+        }
+        else if (strcmp(argv[argi], "-r") == 0 ||
+                 strcmp(argv[argi], "--recursive") == 0)
+        {
+            recursive = 1;
+        }
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+        argi++;
     }
-    if (len == 0)
+
+    if (stats && connect_path != NULL && argi == argc)
     {
-        fclose(f);
-        return;
+        return serve_client_stats(connect_path) == 0 ? EXIT_SUCCESS
+                                                     : EXIT_FAILURE;
+    }
+    if (stats)
+    {
+        atexit(print_stats);
     }
 
-    size_t written = fwrite(data, 1, len, f);
-    fclose(f);
+    if (precompute)
+    {
+        if (argc - argi != 2)
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+        return mio_precompute(argv[argi], argv[argi + 1]) == 0
+                   ? EXIT_SUCCESS
+                   : EXIT_FAILURE;
+    }
 
-    if (written != len)
+    if (manifest != NULL)
     {
-        fprintf(stderr, "error: failed to write output file\n");
-        exit(EXIT_FAILURE);
+        if (argi != argc)
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+        return batch_run(manifest, jobs, backend) == 0 ? EXIT_SUCCESS
+                                                       : EXIT_FAILURE;
     }
-}
 
-/**
- * @brief Write translated bytes to stdout using ASCII/hex rules.
- *
- * @param data  Buffer containing the bytes to print.
- * @param len   Number of bytes in the buffer.
- */
-static void write_stdout(const uint8_t *data, size_t len)
-{
-    for (size_t i = 0; i < len; i++)
+    if (serve_path != NULL)
     {
-        unsigned char c = data[i];
+        if (argi != argc)
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+        return serve_run(serve_path, jobs) == 0 ? EXIT_SUCCESS
+                                                : EXIT_FAILURE;
+    }
 
-        if (c < 128)
+    if (recursive)
+    {
+        uint8_t keybytes[8];
+        if (argc - argi != 3 || connect_path != NULL || ranged ||
+            interval != 0 || container || segment >= 0)
         {
-            putchar(c);
+            usage();
+            return EXIT_FAILURE;
         }
-        else
+        if (mio_read_key(argv[argi], keybytes) != 0)
         {
-            printf("%02x", c);
+            return EXIT_FAILURE;
         }
+        return tree_run(keybytes, argv[argi + 1], argv[argi + 2], segsize,
+                        extract, jobs) == 0
+                   ? EXIT_SUCCESS
+                   : EXIT_FAILURE;
     }
-}
 
-/**
- * @brief Program entry point for the mcrypt driver.
- *
- * @param argc  Argument count.
- * @param argv  Argument vector describing key/input/output paths.
- *
- * @return EXIT_SUCCESS on success; EXIT_FAILURE on invalid usage.
- */
-int main(int argc, char **argv)
-{
-    if (argc != 4)
+    int modes = (connect_path != NULL) + ranged + (interval != 0) +
+                container + extract + append;
+    if (argc - argi != 3 || modes > 1 || (segment >= 0 && !extract))
     {
         usage();
         return EXIT_FAILURE;
     }
 
-    const char *keyfile = argv[1];
-    const char *infile = argv[2];
-    const char *outfile = argv[3];
+    const char *keyfile = argv[argi];
+    const char *infile = argv[argi + 1];
+    const char *outfile = argv[argi + 2];
 
-    uint8_t keybytes[8];
-    read_key(keyfile, keybytes);
+    if (append)
+    {
+        if (outfile[0] == '-' && outfile[1] == '\0')
+        {
+            fprintf(stderr, "error: --append needs an output file\n");
+            return EXIT_FAILURE;
+        }
+        return mio_append(keyfile, infile, outfile) == 0 ? EXIT_SUCCESS
+                                                         : EXIT_FAILURE;
+    }
 
-    size_t in_len = 0;
-    uint8_t *inbuf = read_input(infile, &in_len);
+    /* these modes derive or send the key itself, not a primed stream */
+    if (connect_path != NULL || container || extract)
+    {
+        uint8_t keybytes[8];
+        if (mio_read_key(keyfile, keybytes) != 0)
+        {
+            return EXIT_FAILURE;
+        }
 
-    uint8_t *outbuf = malloc(in_len);
-    assert(outbuf != NULL);
+        if (connect_path != NULL)
+        {
+            return serve_client(connect_path, keybytes, infile, outfile) == 0
+                       ? EXIT_SUCCESS
+                       : EXIT_FAILURE;
+        }
 
-    KStream *ks = ks_create(keybytes);
+        if (outfile[0] == '-' && outfile[1] == '\0')
+        {
+            fprintf(stderr, "error: containers need an output file\n");
+            return EXIT_FAILURE;
+        }
+        int status = container
+                         ? container_create(keybytes, infile, outfile,
+                                            segsize, jobs)
+                         : container_extract(keybytes, infile, outfile,
+                                             segment, jobs);
+        return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    ks_translate(ks, inbuf, outbuf, in_len);
+    KStream *ks = mio_load_stream(keyfile);
+    if (ks == NULL)
+    {
+        return EXIT_FAILURE;
+    }
 
-    if (outfile[0] == '-' && outfile[1] == '\0')
+    int status;
+    if (ranged)
+    {
+        status = ckpt_translate_range(ks, infile, outfile, range_off,
+                                      range_len);
+    }
+    else if (interval != 0)
+    {
+        if (outfile[0] == '-' && outfile[1] == '\0')
+        {
+            fprintf(stderr, "error: --checkpoint needs an output file\n");
+            status = -1;
+        }
+        else
+        {
+            status = ckpt_translate_file(ks, infile, outfile, interval);
+        }
+    }
+    else if (outfile[0] == '-' && outfile[1] == '\0')
     {
-        write_stdout(outbuf, in_len);
+        status = mio_translate_stdout(ks, infile);
     }
     else
     {
-        write_output_file(outfile, outbuf, in_len);
+        status = mio_translate_file(ks, infile, outfile, backend);
     }
 
     ks_destroy(ks);
-    free(inbuf);
-    free(outbuf);
 
-    return EXIT_SUCCESS;
+    return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
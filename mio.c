@@ -0,0 +1,2460 @@
+/**
+ * @file mio.c
+ * @author Shane Girolamo
+ *
+ * @brief Implementation of the mcrypt I/O backends.
+ *
+ * The stdio backend reads the input in CHUNK_SIZE pieces, translates each
+ * piece in place and writes it out again. The mmap backend maps the input
+ * and output files window by window and lets ks_translate() read from one
+ * mapping and write into the other, so the data is never copied through
+ * a user-space buffer. The pipeline backend runs a reader thread and a
+ * writer thread around the translating thread, passing buffers through a
+ * small ring so that input, translation and output overlap. The io_uring
+ * backend keeps several positioned reads and writes in flight from a
+ * single thread using registered buffers. The lookahead backend generates
+ * keystream while its input is idle, and the splice backend hands its
+ * buffer pages to an output pipe with vmsplice() instead of copying them.
+ */
+
+#define _GNU_SOURCE
+
+#include "mio.h"
+#include "affinity.h"
+#include "le.h"
+#include "prefetch.h"
+#include "uring.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/**
+ * @brief Number of bytes translated per pass of the streaming loop.
+ *
+ * Input is processed in chunks of this size, so memory use stays constant
+ * no matter how large the input file is.
+ */
+#define CHUNK_SIZE (64 * 1024)
+
+/**
+ * @brief Number of bytes mapped at a time by the mmap backend.
+ *
+ * Mapping fixed windows rather than the whole file keeps address space use
+ * bounded and lets files larger than the address space be translated. Must
+ * be a multiple of the page size.
+ */
+#define MMAP_WINDOW ((size_t)64 * 1024 * 1024)
+
+/**
+ * @brief Number of buffers in the pipeline ring.
+ *
+ * With four buffers the reader can fill one while one is translated and
+ * one is written, with a spare to absorb jitter between the stages.
+ */
+#define PIPE_DEPTH 4
+
+/**
+ * @brief Size of each buffer in the pipeline ring.
+ */
+#define PIPE_CHUNK ((size_t)1024 * 1024)
+
+/**
+ * @brief Number of buffers, and so requests in flight, for io_uring.
+ */
+#define URING_DEPTH 8
+
+/**
+ * @brief Size of each io_uring buffer.
+ */
+#define URING_CHUNK ((size_t)1024 * 1024)
+
+/**
+ * @brief Keystream kept generated ahead by the lookahead backend.
+ */
+#define LOOKAHEAD_SIZE ((size_t)256 * 1024)
+
+/**
+ * @brief Keystream generated per step while the lookahead input is idle.
+ *
+ * Small enough that data arriving mid-step waits only briefly.
+ */
+#define LOOKAHEAD_STEP ((size_t)16 * 1024)
+
+/**
+ * @brief Pipe capacity the splice backend asks for on its output.
+ *
+ * The default Linux limit for unprivileged processes.
+ */
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+/**
+ * @brief Alignment of io_uring buffers, offsets and lengths for O_DIRECT.
+ */
+#define DIRECT_ALIGN 4096
+
+/**
+ * @brief Largest regular input translated through a stack buffer.
+ *
+ * Messages this small are dominated by fixed costs, so they skip the
+ * backends' buffer pools, mappings and threads: one read, one
+ * translation and one write.
+ */
+#define SMALL_MESSAGE 4096
+
+#ifdef KS_STATS
+/**
+ * @brief Process-wide counters reported by mio_get_stats().
+ */
+static MioStats mio_stats;
+#endif
+
+/**
+ * @brief Count one read or write call of `n` bytes timed from `start`.
+ *
+ * @param dir  Either read or write, naming the counters to update.
+ */
+#define MIO_COUNT_IO(dir, n, start) \
+    (STAT_ADD(mio_stats.dir##_calls, 1), \
+     STAT_ADD(mio_stats.dir##_bytes, (n)), \
+     STAT_ELAPSED(mio_stats.dir##_ns, (start)))
+
+/**
+ * @brief Number of idle buffers the pool keeps for reuse.
+ */
+#define POOL_SLOTS 16
+
+/**
+ * @brief Size of a transparent or explicit huge page.
+ */
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+/**
+ * @brief One idle buffer held by the pool.
+ */
+typedef struct
+{
+    void *buf;   /**< Page-aligned anonymous mapping. */
+    size_t size; /**< Size of the mapping. */
+    int node;    /**< NUMA node of the thread that returned it. */
+} PoolEntry;
+
+/**
+ * @brief Idle buffers, reused by the next request of the same size.
+ */
+static PoolEntry pool[POOL_SLOTS];
+
+/**
+ * @brief Number of entries in pool.
+ */
+static size_t pool_count = 0;
+
+/**
+ * @brief Protects pool and pool_count; batch workers share the pool.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Nonzero if new pool buffers should be backed by huge pages.
+ */
+static int huge_pages = 0;
+
+/**
+ * @brief Nonzero if the io_uring backend should bypass the page cache.
+ */
+static int direct_io = 0;
+
+/**
+ * @brief Nonzero if the lookahead backend generates on its own thread.
+ */
+static int prefetch_thread = 0;
+
+/**
+ * @brief Request O_DIRECT for the io_uring backend.
+ *
+ * @param enable  Nonzero to open files with O_DIRECT where supported.
+ */
+void mio_set_direct(int enable)
+{
+    direct_io = enable;
+}
+
+/**
+ * @brief Generate lookahead keystream on a background thread.
+ *
+ * @param enable  Nonzero to use a Prefetch producer thread.
+ */
+void mio_set_prefetch(int enable)
+{
+    prefetch_thread = enable;
+}
+
+/**
+ * @brief Back new I/O buffers with huge pages where possible.
+ *
+ * @param enable  Nonzero to request huge pages for new buffers.
+ */
+void mio_set_hugepages(int enable)
+{
+    huge_pages = enable;
+}
+
+/**
+ * @brief Map a fresh, page-aligned I/O buffer.
+ *
+ * With huge pages requested, buffers that are a whole number of huge
+ * pages first try MAP_HUGETLB; otherwise transparent huge pages are
+ * requested with madvise().
+ *
+ * @param size  Size in bytes, a multiple of the page size.
+ *
+ * @return The new buffer; exits the program if memory runs out.
+ */
+static void *map_buffer(size_t size)
+{
+    void *buf = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (huge_pages && size % HUGE_PAGE_SIZE == 0)
+    {
+        buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (buf == MAP_FAILED)
+    {
+        buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED)
+        {
+            fprintf(stderr, "error: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+#ifdef MADV_HUGEPAGE
+        if (huge_pages)
+        {
+            (void)madvise(buf, size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    return buf;
+}
+
+/**
+ * @brief Take a page-aligned I/O buffer from the pool.
+ *
+ * Buffers come back from pool_put() already faulted in, so a run of
+ * files, as in batch mode, pays for page faults only once. With worker
+ * placement on, only buffers returned on the caller's NUMA node are
+ * reused, so a pinned worker never picks up memory from another socket.
+ *
+ * @param size  Size in bytes, a multiple of the page size.
+ *
+ * @return A buffer of `size` bytes; release it with pool_put().
+ */
+static void *pool_get(size_t size)
+{
+    void *buf = NULL;
+    int node = affinity_current_node();
+
+    pthread_mutex_lock(&pool_lock);
+    for (size_t n = 0; n < pool_count; n++)
+    {
+        if (pool[n].size == size && pool[n].node == node)
+        {
+            buf = pool[n].buf;
+            pool[n] = pool[--pool_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (buf != NULL)
+    {
+        STAT_ADD(mio_stats.buffer_reuses, 1);
+    }
+    else
+    {
+        buf = map_buffer(size);
+        STAT_ADD(mio_stats.buffer_allocs, 1);
+    }
+    STAT_GAUGE_ADD(mio_stats.buffer_bytes, mio_stats.buffer_peak, size);
+    return buf;
+}
+
+/**
+ * @brief Return a buffer from pool_get() to the pool.
+ *
+ * @param buf   Buffer to return, or NULL.
+ * @param size  Size it was requested with.
+ */
+static void pool_put(void *buf, size_t size)
+{
+    if (buf == NULL)
+    {
+        return;
+    }
+    STAT_SUB(mio_stats.buffer_bytes, size);
+    int node = affinity_current_node();
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_count < POOL_SLOTS)
+    {
+        pool[pool_count].buf = buf;
+        pool[pool_count].size = size;
+        pool[pool_count].node = node;
+        pool_count++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (buf != NULL)
+    {
+        munmap(buf, size);
+    }
+}
+
+/**
+ * @brief Magic bytes at the start of a precomputed state file.
+ */
+static const char state_magic[4] = {'K', 'S', 'S', 'T'};
+
+/**
+ * @brief Format version written to new state files.
+ */
+#define STATE_VERSION 1
+
+/**
+ * @brief Offset of the checksum in a state file.
+ */
+#define STATE_SUM_OFFSET (8 + KS_SNAPSHOT_SIZE)
+
+/**
+ * @brief Magic bytes at the start of an append state file.
+ */
+static const char append_magic[4] = {'K', 'S', 'A', 'P'};
+
+/**
+ * @brief Format version written to new append state files.
+ */
+#define APPEND_VERSION 1
+
+/**
+ * @brief Offset of the snapshot in an append state file.
+ *
+ * It follows the magic, the version, the byte offset and the key check.
+ */
+#define APPEND_SNAP_OFFSET (8 + 8 + 8)
+
+/**
+ * @brief Offset of the checksum in an append state file.
+ */
+#define APPEND_SUM_OFFSET (APPEND_SNAP_OFFSET + KS_SNAPSHOT_SIZE)
+
+/**
+ * @brief Size of an append state file in bytes.
+ */
+#define APPEND_STATE_SIZE (APPEND_SUM_OFFSET + 8)
+
+/**
+ * @brief 64-bit FNV-1a hash, used as the state file checksum.
+ *
+ * @param p    Bytes to hash.
+ * @param len  Number of bytes.
+ *
+ * @return The hash.
+ */
+static uint64_t fnv1a64(const uint8_t *p, size_t len)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t n = 0; n < len; n++)
+    {
+        h = (h ^ p[n]) * 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * @brief Read a key file or state file without going through stdio.
+ *
+ * A regular file is normally read by a single read() call. One byte
+ * more than a state file is requested, so that a longer file is not
+ * mistaken for one.
+ *
+ * @param keyfile  Path of the file.
+ * @param buf      Receives up to MIO_STATE_FILE_SIZE + 1 bytes.
+ *
+ * @return Number of bytes read, or -1 after printing a message.
+ */
+static long read_key_file(const char *keyfile,
+                          uint8_t buf[MIO_STATE_FILE_SIZE + 1])
+{
+    int fd = open(keyfile, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("key-file");
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < MIO_STATE_FILE_SIZE + 1)
+    {
+        ssize_t n = read(fd, buf + done, MIO_STATE_FILE_SIZE + 1 - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            perror("key-file");
+            close(fd);
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        done += (size_t)n;
+    }
+    close(fd);
+    return (long)done;
+}
+
+/**
+ * @brief Tell whether bytes read from a key file are a state file.
+ *
+ * @param buf  Contents of the file.
+ * @param len  Number of bytes.
+ *
+ * @return Nonzero if the file is a precomputed state file.
+ */
+static int is_state_file(const uint8_t *buf, long len)
+{
+    return len == MIO_STATE_FILE_SIZE && memcmp(buf, state_magic, 4) == 0;
+}
+
+/**
+ * @brief Read an 8-byte key from the provided key file.
+ *
+ * @param keyfile   Path to the binary key file.
+ * @param keybytes  Output buffer that receives the 8-byte key.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int mio_read_key(const char *keyfile, uint8_t keybytes[8])
+{
+    uint8_t buf[MIO_STATE_FILE_SIZE + 1];
+    long n = read_key_file(keyfile, buf);
+    if (n < 0)
+    {
+        return -1;
+    }
+
+    if (is_state_file(buf, n))
+    {
+        fprintf(stderr, "error: %s is a precomputed state; this mode needs "
+                        "the key file\n",
+                keyfile);
+        return -1;
+    }
+    if (n < 8)
+    {
+        fprintf(stderr, "error: key file must contain 8 bytes\n");
+        return -1;
+    }
+
+    memcpy(keybytes, buf, 8);
+    return 0;
+}
+
+/**
+ * @brief Create the primed KStream for a key file or a state file.
+ *
+ * @param keyfile  Path of an 8-byte key file or a file written by
+ *                 mio_precompute().
+ *
+ * @return A new KStream, or NULL after printing a message on failure.
+ */
+KStream *mio_load_stream(const char *keyfile)
+{
+    uint8_t buf[MIO_STATE_FILE_SIZE + 1];
+    long n = read_key_file(keyfile, buf);
+    if (n < 0)
+    {
+        return NULL;
+    }
+
+    if (!is_state_file(buf, n))
+    {
+        if (n < 8)
+        {
+            fprintf(stderr, "error: key file must contain 8 bytes\n");
+            return NULL;
+        }
+        return ks_create(buf);
+    }
+
+    KStream *ks = NULL;
+    if (buf[4] == STATE_VERSION && buf[5] == 0 && buf[6] == 0 &&
+        buf[7] == 0 &&
+        get_le64(buf + STATE_SUM_OFFSET) == fnv1a64(buf, STATE_SUM_OFFSET))
+    {
+        ks = ks_load_state(buf + 8);
+    }
+    if (ks == NULL)
+    {
+        fprintf(stderr, "error: %s is not a valid state file\n", keyfile);
+    }
+    return ks;
+}
+
+/**
+ * @brief Look up a backend by its command-line name.
+ *
+ * @param name  Backend name.
+ * @param out   Receives the matching backend.
+ *
+ * @return 0 on success, or -1 if the name is not recognized.
+ */
+int mio_backend_parse(const char *name, MioBackend *out)
+{
+    if (strcmp(name, "auto") == 0)
+    {
+        *out = MIO_AUTO;
+    }
+    else if (strcmp(name, "stdio") == 0)
+    {
+        *out = MIO_STDIO;
+    }
+    else if (strcmp(name, "mmap") == 0)
+    {
+        *out = MIO_MMAP;
+    }
+    else if (strcmp(name, "pipeline") == 0)
+    {
+        *out = MIO_PIPELINE;
+    }
+    else if (strcmp(name, "uring") == 0)
+    {
+        *out = MIO_URING;
+    }
+    else if (strcmp(name, "lookahead") == 0)
+    {
+        *out = MIO_LOOKAHEAD;
+    }
+    else if (strcmp(name, "splice") == 0)
+    {
+        *out = MIO_SPLICE;
+    }
+    else
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief fread() into a buffer, counted as one read.
+ *
+ * @param buf  Destination.
+ * @param len  Capacity of `buf`.
+ * @param f    Stream to read from.
+ *
+ * @return Number of bytes read.
+ */
+static size_t counted_fread(void *buf, size_t len, FILE *f)
+{
+    STAT_TIMER(start);
+    size_t n = fread(buf, 1, len, f);
+    MIO_COUNT_IO(read, n, start);
+    return n;
+}
+
+/**
+ * @brief fwrite() a buffer, counted as one write.
+ *
+ * @param buf  Data to write.
+ * @param len  Number of bytes.
+ * @param f    Stream to write to.
+ *
+ * @return Number of bytes written.
+ */
+static size_t counted_fwrite(const void *buf, size_t len, FILE *f)
+{
+    STAT_TIMER(start);
+    size_t n = fwrite(buf, 1, len, f);
+    MIO_COUNT_IO(write, n, start);
+    return n;
+}
+
+/**
+ * @brief Two-digit lowercase hex spelling of every byte from 128 to 255.
+ *
+ * Entry (c - 128) starts at offset 2 * (c - 128).
+ */
+static const char hex_pairs[256 + 1] =
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/**
+ * @brief Encode translated bytes using the ASCII/hex rules.
+ *
+ * Bytes below 128 are copied unchanged; every other byte is replaced by
+ * its two hex digits from hex_pairs. The output buffer must have room
+ * for 2 * len characters.
+ *
+ * @param data  Buffer containing the bytes to encode.
+ * @param len   Number of bytes in the buffer.
+ * @param text  Receives the encoded characters.
+ *
+ * @return Number of characters written to `text`.
+ */
+static size_t encode_text(const uint8_t *data, size_t len, char *text)
+{
+    char *p = text;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = data[i];
+
+        if (c < 128)
+        {
+            *p++ = (char)c;
+        }
+        else
+        {
+            memcpy(p, &hex_pairs[2 * (c - 128)], 2);
+            p += 2;
+        }
+    }
+
+    return (size_t)(p - text);
+}
+
+/**
+ * @brief Write bytes to a stream using the ASCII/hex rules.
+ *
+ * Encodes through a fixed stack buffer, one fwrite() per piece.
+ *
+ * @param f     Destination stream.
+ * @param data  Bytes to encode.
+ * @param len   Number of bytes.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int mio_write_text(FILE *f, const uint8_t *data, size_t len)
+{
+    char text[2 * 4096];
+
+    for (size_t off = 0; off < len; off += 4096)
+    {
+        size_t n = len - off < 4096 ? len - off : 4096;
+        size_t m = encode_text(data + off, n, text);
+        if (counted_fwrite(text, m, f) != m)
+        {
+            fprintf(stderr, "error: failed to write output\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Translate an input stream chunk by chunk.
+ *
+ * KStream keeps its i/j state between calls, so running the input
+ * through the cipher in fixed-size pieces produces exactly the same
+ * bytes as translating it in one call. A single CHUNK_SIZE buffer is
+ * allocated; each chunk is translated in place and written straight
+ * back out of it.
+ *
+ * @param ks    Initialized KStream instance.
+ * @param in    Input stream.
+ * @param out   Output stream for binary output, or NULL to print the
+ *              translated bytes to stdout using the ASCII/hex rules.
+ *              Text output is encoded a whole chunk at a time and
+ *              written with a single fwrite().
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+static int translate_stream(KStream *ks, FILE *in, FILE *out)
+{
+    uint8_t *buf = pool_get(CHUNK_SIZE);
+
+    char *text = NULL;
+    if (out == NULL)
+    {
+        text = pool_get(2 * CHUNK_SIZE);
+    }
+
+    int status = 0;
+    size_t n;
+    while ((n = counted_fread(buf, CHUNK_SIZE, in)) > 0)
+    {
+        ks_translate_inplace(ks, buf, n);
+
+        if (out == NULL)
+        {
+            size_t len = encode_text(buf, n, text);
+            if (counted_fwrite(text, len, stdout) != len)
+            {
+                fprintf(stderr, "error: failed to write output\n");
+                status = -1;
+                break;
+            }
+        }
+        else if (counted_fwrite(buf, n, out) != n)
+        {
+            fprintf(stderr, "error: failed to write output file\n");
+            status = -1;
+            break;
+        }
+    }
+
+    if (status == 0 && ferror(in))
+    {
+        fprintf(stderr, "error: could not read entire input file\n");
+        status = -1;
+    }
+
+    pool_put(text, 2 * CHUNK_SIZE);
+    pool_put(buf, CHUNK_SIZE);
+    return status;
+}
+
+/**
+ * @brief Translate between memory mappings of two regular files.
+ *
+ * The output is first extended to the input size with ftruncate(). Each
+ * window of the input is then mapped read-only next to the same window
+ * of the output, and ks_translate() writes straight into the output
+ * mapping.
+ *
+ * @param ks     Initialized KStream instance.
+ * @param infd   Descriptor of the input file, open for reading.
+ * @param outfd  Descriptor of the output file, open for reading and
+ *               writing and already truncated.
+ * @param size   Size of the input file in bytes.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+static int translate_mmap(KStream *ks, int infd, int outfd, off_t size)
+{
+    if (ftruncate(outfd, size) != 0)
+    {
+        perror("output-file");
+        return -1;
+    }
+
+    for (off_t off = 0; off < size; off += (off_t)MMAP_WINDOW)
+    {
+        size_t len = MMAP_WINDOW;
+        if ((off_t)len > size - off)
+        {
+            len = (size_t)(size - off);
+        }
+
+        uint8_t *src = mmap(NULL, len, PROT_READ, MAP_SHARED, infd, off);
+        if (src == MAP_FAILED)
+        {
+            perror("input-file");
+            return -1;
+        }
+
+        uint8_t *dst = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            outfd, off);
+        if (dst == MAP_FAILED)
+        {
+            perror("output-file");
+            munmap(src, len);
+            return -1;
+        }
+
+        madvise(src, len, MADV_SEQUENTIAL);
+        madvise(dst, len, MADV_SEQUENTIAL);
+
+        ks_translate(ks, src, dst, len);
+        STAT_ADD(mio_stats.mapped_bytes, len);
+
+        munmap(src, len);
+        if (munmap(dst, len) != 0)
+        {
+            perror("output-file");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Shared state of the three pipeline stages.
+ *
+ * Buffer n of the stream lives in ring slot n % PIPE_DEPTH. Each stage
+ * counts the buffers it has finished; a stage may work on buffer n once
+ * the previous stage has finished it, and the reader may reuse a slot
+ * once the writer has finished the buffer that last occupied it.
+ */
+typedef struct
+{
+    uint8_t *buf[PIPE_DEPTH];  /**< Ring of reusable buffers. */
+    size_t len[PIPE_DEPTH];    /**< Bytes held by each buffer. */
+    size_t read_done;          /**< Buffers filled by the reader. */
+    size_t xlate_done;         /**< Buffers translated. */
+    size_t write_done;         /**< Buffers written by the writer. */
+    int failed;                /**< Set by any stage that hits an error. */
+    int infd;                  /**< Input descriptor. */
+    int outfd;                 /**< Output descriptor. */
+    pthread_mutex_t lock;      /**< Protects the counters and flags. */
+    pthread_cond_t changed;    /**< Signalled whenever a counter moves. */
+} Pipeline;
+
+/**
+ * @brief Read until a buffer is full or the input ends.
+ *
+ * @param fd   Descriptor to read from.
+ * @param buf  Destination buffer.
+ * @param len  Capacity of the buffer.
+ *
+ * @return Number of bytes read, or -1 on error.
+ */
+ssize_t mio_read_full(int fd, uint8_t *buf, size_t len)
+{
+    STAT_TIMER(start);
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        done += (size_t)n;
+    }
+    MIO_COUNT_IO(read, done, start);
+    return (ssize_t)done;
+}
+
+/**
+ * @brief Write a whole buffer, retrying after short writes.
+ *
+ * @param fd   Descriptor to write to.
+ * @param buf  Data to write.
+ * @param len  Number of bytes.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+static int write_full(int fd, const uint8_t *buf, size_t len)
+{
+    STAT_TIMER(start);
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    MIO_COUNT_IO(write, len, start);
+    return 0;
+}
+
+/**
+ * @brief Translate a small regular file with one read and one write.
+ *
+ * The whole input is read into a stack buffer, translated in place and
+ * written out. If the read does not return exactly `size` bytes, for
+ * example because the file is changing, the input is rewound and the
+ * caller falls back to a backend.
+ *
+ * @param ks     Initialized KStream instance.
+ * @param infd   Descriptor of the input file, at offset zero.
+ * @param outfd  Descriptor of the output, already truncated.
+ * @param size   Size of the input file, at most SMALL_MESSAGE.
+ *
+ * @return 0 on success, 1 to fall back, or -1 after printing a message.
+ */
+static int translate_small(KStream *ks, int infd, int outfd, off_t size)
+{
+    uint8_t buf[SMALL_MESSAGE];
+
+    STAT_TIMER(start);
+    ssize_t n = read(infd, buf, sizeof(buf));
+    if (n != (ssize_t)size)
+    {
+        if (lseek(infd, 0, SEEK_SET) != 0)
+        {
+            perror("input-file");
+            return -1;
+        }
+        return 1;
+    }
+    MIO_COUNT_IO(read, (size_t)n, start);
+
+    ks_translate_inplace(ks, buf, (size_t)n);
+    if (write_full(outfd, buf, (size_t)n) != 0)
+    {
+        perror("output-file");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Pipeline reader stage.
+ *
+ * Fills free ring slots from the input. A buffer of length zero marks
+ * the end of the input for the later stages.
+ *
+ * @param arg  Pointer to the shared Pipeline.
+ *
+ * @return Always NULL.
+ */
+static void *pipeline_reader(void *arg)
+{
+    Pipeline *p = arg;
+
+    for (size_t seq = 0;; seq++)
+    {
+        pthread_mutex_lock(&p->lock);
+        while (!p->failed && seq - p->write_done >= PIPE_DEPTH)
+        {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        int failed = p->failed;
+        pthread_mutex_unlock(&p->lock);
+        if (failed)
+        {
+            return NULL;
+        }
+
+        size_t slot = seq % PIPE_DEPTH;
+        ssize_t n = mio_read_full(p->infd, p->buf[slot], PIPE_CHUNK);
+
+        pthread_mutex_lock(&p->lock);
+        if (n < 0)
+        {
+            fprintf(stderr, "error: could not read entire input file\n");
+            p->failed = 1;
+        }
+        else
+        {
+            p->len[slot] = (size_t)n;
+            p->read_done++;
+        }
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+
+        if (n <= 0)
+        {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * @brief Pipeline writer stage.
+ *
+ * Writes translated buffers to the output in order until it reaches the
+ * end-of-input marker.
+ *
+ * @param arg  Pointer to the shared Pipeline.
+ *
+ * @return Always NULL.
+ */
+static void *pipeline_writer(void *arg)
+{
+    Pipeline *p = arg;
+
+    for (size_t seq = 0;; seq++)
+    {
+        pthread_mutex_lock(&p->lock);
+        while (!p->failed && p->xlate_done <= seq)
+        {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        int failed = p->failed;
+        pthread_mutex_unlock(&p->lock);
+        if (failed)
+        {
+            return NULL;
+        }
+
+        size_t slot = seq % PIPE_DEPTH;
+        if (p->len[slot] == 0)
+        {
+            return NULL;
+        }
+
+        int rc = write_full(p->outfd, p->buf[slot], p->len[slot]);
+
+        pthread_mutex_lock(&p->lock);
+        if (rc != 0)
+        {
+            fprintf(stderr, "error: failed to write output file\n");
+            p->failed = 1;
+        }
+        else
+        {
+            p->write_done++;
+        }
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+
+        if (rc != 0)
+        {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * @brief Translate between two descriptors with a three-stage pipeline.
+ *
+ * The calling thread is the translation stage: it takes each buffer from
+ * the reader, translates it in place and hands it to the writer. Wall
+ * time therefore approaches the slowest of the three stages rather than
+ * their sum.
+ *
+ * @param ks     Initialized KStream instance.
+ * @param infd   Input descriptor.
+ * @param outfd  Output descriptor.
+ *
+ * @return 0 on success, -1 after printing a message on failure, or 1 if
+ *         the threads could not be started and nothing was consumed.
+ */
+static int translate_pipeline(KStream *ks, int infd, int outfd)
+{
+    Pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.infd = infd;
+    p.outfd = outfd;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.changed, NULL);
+
+    /* one block for the whole ring, so huge pages can back it */
+    uint8_t *block = pool_get(PIPE_DEPTH * PIPE_CHUNK);
+    for (int n = 0; n < PIPE_DEPTH; n++)
+    {
+        p.buf[n] = block + n * PIPE_CHUNK;
+    }
+
+    pthread_t reader;
+    pthread_t writer;
+    int status = 1;
+
+    if (pthread_create(&reader, NULL, pipeline_reader, &p) == 0)
+    {
+        if (pthread_create(&writer, NULL, pipeline_writer, &p) == 0)
+        {
+            status = 0;
+        }
+        else
+        {
+            /* the reader may already have consumed input, so there is no
+             * falling back to another backend from here */
+            pthread_mutex_lock(&p.lock);
+            p.failed = 1;
+            pthread_cond_broadcast(&p.changed);
+            pthread_mutex_unlock(&p.lock);
+            pthread_join(reader, NULL);
+            fprintf(stderr, "error: cannot start pipeline threads\n");
+            status = -1;
+        }
+    }
+    int running = status == 0;
+
+    for (size_t seq = 0; status == 0; seq++)
+    {
+        pthread_mutex_lock(&p.lock);
+        while (!p.failed && p.read_done <= seq)
+        {
+            pthread_cond_wait(&p.changed, &p.lock);
+        }
+        int failed = p.failed;
+        pthread_mutex_unlock(&p.lock);
+        if (failed)
+        {
+            status = -1;
+            break;
+        }
+
+        size_t slot = seq % PIPE_DEPTH;
+        size_t len = p.len[slot];
+        ks_translate_inplace(ks, p.buf[slot], len);
+
+        pthread_mutex_lock(&p.lock);
+        p.xlate_done++;
+        pthread_cond_broadcast(&p.changed);
+        pthread_mutex_unlock(&p.lock);
+
+        if (len == 0)
+        {
+            break;
+        }
+    }
+
+    if (running)
+    {
+        pthread_join(reader, NULL);
+        pthread_join(writer, NULL);
+        status = p.failed ? -1 : 0;
+    }
+
+    pool_put(block, PIPE_DEPTH * PIPE_CHUNK);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.changed);
+
+    return status;
+}
+
+/**
+ * @brief Life cycle of one io_uring buffer.
+ */
+typedef enum
+{
+    SLOT_FREE,    /**< Available for the next read. */
+    SLOT_READING, /**< A read into the buffer is in flight. */
+    SLOT_READY,   /**< Filled; waiting for its turn to be translated. */
+    SLOT_WRITING  /**< Translated; a write from the buffer is in flight. */
+} UringSlotState;
+
+/**
+ * @brief One io_uring buffer and the file range it currently holds.
+ */
+typedef struct
+{
+    uint8_t *buf;         /**< DIRECT_ALIGN-aligned buffer. */
+    uint64_t off;         /**< File offset of the first byte. */
+    size_t want;          /**< Bytes of the file held by this range. */
+    size_t done;          /**< Bytes read or written so far. */
+    UringSlotState state; /**< Current stage. */
+} UringSlot;
+
+/**
+ * @brief Queue the read or write that moves a slot forward.
+ *
+ * Continues a short transfer from where it stopped. With O_DIRECT the
+ * last read of the file is rounded up to DIRECT_ALIGN; the kernel stops
+ * at end of file. A continued transfer is generally not aligned, so
+ * O_DIRECT is switched off on its descriptor first.
+ *
+ * @param ring   Ring to queue on.
+ * @param slots  All slots, for the registered-buffer index.
+ * @param s      Index of the slot.
+ * @param infd   Input descriptor.
+ * @param outfd  Output descriptor.
+ *
+ * @return 0 on success, or -1 if the request could not be queued.
+ */
+static int uring_queue_slot(Uring *ring, UringSlot *slots, int s, int infd,
+                            int outfd)
+{
+    UringSlot *slot = &slots[s];
+    uint8_t *buf = slot->buf + slot->done;
+    uint64_t off = slot->off + slot->done;
+    size_t len = slot->want - slot->done;
+
+    if (slot->done > 0)
+    {
+        int fd = slot->state == SLOT_READING ? infd : outfd;
+        int flags = fcntl(fd, F_GETFL);
+        if (flags >= 0 && (flags & O_DIRECT) != 0)
+        {
+            (void)fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+        }
+    }
+
+    int rc;
+    if (slot->state == SLOT_READING)
+    {
+        if (direct_io && slot->done == 0)
+        {
+            len = (len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+        }
+        rc = uring_queue_read(ring, infd, buf, (unsigned)len, off, s,
+                              (uint64_t)s);
+    }
+    else
+    {
+        rc = uring_queue_write(ring, outfd, buf, (unsigned)len, off, s,
+                               (uint64_t)s);
+    }
+
+    if (rc != 0)
+    {
+        fprintf(stderr, "error: io_uring submission queue is full\n");
+    }
+    return rc;
+}
+
+/**
+ * @brief Translate between two regular files through io_uring.
+ *
+ * Up to URING_DEPTH chunk reads are kept in flight. Chunks are
+ * translated strictly in file order as their reads complete, since the
+ * keystream is sequential, and each translated chunk is written back
+ * from the same registered buffer while later reads are still pending.
+ *
+ * @param ks     Initialized KStream instance.
+ * @param infd   Input descriptor.
+ * @param outfd  Output descriptor, already truncated.
+ * @param size   Size of the input file.
+ *
+ * @return 0 on success, -1 after printing a message on failure, or 1 if
+ *         io_uring is unavailable and nothing was done.
+ */
+static int translate_uring(KStream *ks, int infd, int outfd, off_t size)
+{
+    Uring *ring = uring_init(URING_DEPTH);
+    if (ring == NULL)
+    {
+        return 1;
+    }
+
+    UringSlot slots[URING_DEPTH];
+    uint8_t *bufs[URING_DEPTH];
+    /* pool buffers are page-aligned, which satisfies DIRECT_ALIGN */
+    uint8_t *block = pool_get(URING_DEPTH * URING_CHUNK);
+    for (int s = 0; s < URING_DEPTH; s++)
+    {
+        bufs[s] = block + s * URING_CHUNK;
+        slots[s].buf = bufs[s];
+        slots[s].state = SLOT_FREE;
+    }
+    (void)uring_register_buffers(ring, bufs, URING_CHUNK, URING_DEPTH);
+
+    int direct_out = 0;
+    if (direct_io)
+    {
+        (void)fcntl(infd, F_SETFL, fcntl(infd, F_GETFL) | O_DIRECT);
+        direct_out = fcntl(outfd, F_SETFL,
+                           fcntl(outfd, F_GETFL) | O_DIRECT) == 0;
+    }
+
+    uint64_t total = (uint64_t)size;
+    uint64_t next_read = 0;
+    uint64_t next_xlate = 0;
+    unsigned inflight = 0;
+    int unsupported = 0;
+    int status = 0;
+
+    while (status == 0 && (next_xlate < total || inflight > 0))
+    {
+        for (int s = 0; s < URING_DEPTH && next_read < total; s++)
+        {
+            if (slots[s].state != SLOT_FREE)
+            {
+                continue;
+            }
+            slots[s].off = next_read;
+            slots[s].want = total - next_read < URING_CHUNK
+                                ? (size_t)(total - next_read)
+                                : URING_CHUNK;
+            slots[s].done = 0;
+            slots[s].state = SLOT_READING;
+            next_read += slots[s].want;
+            if (uring_queue_slot(ring, slots, s, infd, outfd) != 0)
+            {
+                status = -1;
+                break;
+            }
+            inflight++;
+        }
+
+        for (int s = 0; s < URING_DEPTH; s++)
+        {
+            if (slots[s].state != SLOT_READY || slots[s].off != next_xlate)
+            {
+                continue;
+            }
+
+            ks_translate_inplace(ks, slots[s].buf, slots[s].want);
+
+            if (direct_out && slots[s].want % DIRECT_ALIGN != 0)
+            {
+                /* the unaligned tail cannot be written with O_DIRECT */
+                (void)fcntl(outfd, F_SETFL,
+                            fcntl(outfd, F_GETFL) & ~O_DIRECT);
+                direct_out = 0;
+            }
+
+            slots[s].done = 0;
+            slots[s].state = SLOT_WRITING;
+            next_xlate += slots[s].want;
+            if (uring_queue_slot(ring, slots, s, infd, outfd) != 0)
+            {
+                status = -1;
+                break;
+            }
+            inflight++;
+            s = -1;
+        }
+
+        if (status != 0 || inflight == 0)
+        {
+            break;
+        }
+
+        UringCompletion done[URING_DEPTH];
+        STAT_TIMER(wait_start);
+        int n = uring_submit_and_wait(ring, done, URING_DEPTH);
+        STAT_ELAPSED(mio_stats.uring_wait_ns, wait_start);
+        if (n < 0)
+        {
+            perror("io_uring_enter");
+            status = -1;
+            break;
+        }
+
+        for (int c = 0; c < n; c++)
+        {
+            UringSlot *slot = &slots[done[c].user_data];
+            int res = done[c].res;
+            inflight--;
+
+            if ((res == -EINVAL || res == -EOPNOTSUPP) &&
+                slot->state == SLOT_READING && next_xlate == 0)
+            {
+                /* the kernel has io_uring but not these opcodes */
+                unsupported = 1;
+                status = -1;
+                continue;
+            }
+            if (res < 0)
+            {
+                errno = -res;
+                perror(slot->state == SLOT_READING ? "input-file"
+                                                   : "output-file");
+                status = -1;
+                continue;
+            }
+            if (res == 0 && slot->state == SLOT_READING)
+            {
+                fprintf(stderr, "error: could not read entire input file\n");
+                status = -1;
+                continue;
+            }
+
+            if (slot->state == SLOT_READING)
+            {
+                STAT_ADD(mio_stats.read_calls, 1);
+                STAT_ADD(mio_stats.read_bytes, res);
+            }
+            else
+            {
+                STAT_ADD(mio_stats.write_calls, 1);
+                STAT_ADD(mio_stats.write_bytes, res);
+            }
+
+            slot->done += (size_t)res;
+            if (slot->done < slot->want)
+            {
+                if (uring_queue_slot(ring, slots, (int)done[c].user_data,
+                                     infd, outfd) != 0)
+                {
+                    status = -1;
+                    continue;
+                }
+                inflight++;
+            }
+            else
+            {
+                slot->state = slot->state == SLOT_READING ? SLOT_READY
+                                                          : SLOT_FREE;
+            }
+        }
+    }
+
+    /* drain anything still in flight before the buffers go away */
+    while (inflight > 0)
+    {
+        UringCompletion done[URING_DEPTH];
+        int n = uring_submit_and_wait(ring, done, URING_DEPTH);
+        if (n < 0)
+        {
+            break;
+        }
+        inflight -= (unsigned)n;
+    }
+
+    uring_destroy(ring);
+    pool_put(block, URING_DEPTH * URING_CHUNK);
+
+    if (unsupported && next_xlate == 0)
+    {
+        /* nothing was written; leave the descriptors as they came */
+        (void)fcntl(infd, F_SETFL, fcntl(infd, F_GETFL) & ~O_DIRECT);
+        (void)fcntl(outfd, F_SETFL, fcntl(outfd, F_GETFL) & ~O_DIRECT);
+        return 1;
+    }
+    return status == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Ring of keystream generated ahead of the data.
+ */
+typedef struct
+{
+    uint8_t *buf; /**< LOOKAHEAD_SIZE bytes of keystream. */
+    size_t head;  /**< Ring offset of the next unused keystream byte. */
+    size_t avail; /**< Keystream bytes generated but not yet used. */
+} Lookahead;
+
+/**
+ * @brief Generate keystream into the free part of the ring.
+ *
+ * @param la   Lookahead ring.
+ * @param ks   Stream to draw keystream from.
+ * @param max  Most bytes to generate; stops early at the end of the
+ *             ring storage or when the ring is full.
+ */
+static void lookahead_fill(Lookahead *la, KStream *ks, size_t max)
+{
+    size_t tail = (la->head + la->avail) % LOOKAHEAD_SIZE;
+    size_t room = LOOKAHEAD_SIZE - la->avail;
+    if (room > LOOKAHEAD_SIZE - tail)
+    {
+        room = LOOKAHEAD_SIZE - tail;
+    }
+    if (room > max)
+    {
+        room = max;
+    }
+
+    ks_generate(ks, la->buf + tail, room);
+    la->avail += room;
+}
+
+/**
+ * @brief Translate a buffer with keystream from the ring.
+ *
+ * Keystream that has not been generated yet is generated first, so the
+ * result is the same as ks_translate_inplace() on `ks`.
+ *
+ * @param la   Lookahead ring.
+ * @param ks   Stream the ring draws from.
+ * @param buf  Data to translate in place.
+ * @param len  Number of bytes; at most LOOKAHEAD_SIZE.
+ */
+static void lookahead_apply(Lookahead *la, KStream *ks, uint8_t *buf,
+                            size_t len)
+{
+    while (la->avail < len)
+    {
+        lookahead_fill(la, ks, len - la->avail);
+    }
+
+    /* the keystream for buf may wrap around the end of the ring */
+    size_t first = LOOKAHEAD_SIZE - la->head;
+    if (first > len)
+    {
+        first = len;
+    }
+    ks_xor_keystream(buf, la->buf + la->head, first);
+    ks_xor_keystream(buf + first, la->buf, len - first);
+
+    la->head = (la->head + len) % LOOKAHEAD_SIZE;
+    la->avail -= len;
+}
+
+/**
+ * @brief Translate a stream, generating keystream while input is idle.
+ *
+ * Before each read the input is polled. As long as nothing is waiting,
+ * keystream is generated into the lookahead ring, LOOKAHEAD_STEP bytes
+ * at a time. Each read takes whatever has arrived, up to CHUNK_SIZE,
+ * and is XORed with ready keystream and written out at once. For a
+ * producer that sends data slowly, translation then costs only the XOR.
+ *
+ * With mio_set_prefetch() the keystream comes from a Prefetch thread on
+ * a clone of `ks` instead, which keeps generating while this thread
+ * reads and writes. `ks` itself is then not advanced.
+ *
+ * @param ks     Initialized KStream instance.
+ * @param infd   Input descriptor, typically a pipe.
+ * @param outfd  Output descriptor, or -1 to print the translated bytes on
+ *               stdout using the ASCII/hex rules.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+static int translate_lookahead(KStream *ks, int infd, int outfd)
+{
+    Prefetch *pf = NULL;
+    if (prefetch_thread)
+    {
+        KStream *clone = ks_clone(ks);
+        pf = prefetch_create(clone, LOOKAHEAD_SIZE);
+        if (pf == NULL)
+        {
+            ks_destroy(clone);
+        }
+    }
+
+    Lookahead la;
+    la.buf = pf == NULL ? pool_get(LOOKAHEAD_SIZE) : NULL;
+    la.head = 0;
+    la.avail = 0;
+
+    uint8_t *buf = pool_get(CHUNK_SIZE);
+    char *text = outfd < 0 ? pool_get(2 * CHUNK_SIZE) : NULL;
+
+    int status = 0;
+    for (;;)
+    {
+        struct pollfd pfd = {infd, POLLIN, 0};
+        while (pf == NULL && la.avail < LOOKAHEAD_SIZE &&
+               poll(&pfd, 1, 0) == 0)
+        {
+            lookahead_fill(&la, ks, LOOKAHEAD_STEP);
+        }
+
+        STAT_TIMER(start);
+        ssize_t n = read(infd, buf, CHUNK_SIZE);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            fprintf(stderr, "error: could not read entire input file\n");
+            status = -1;
+            break;
+        }
+        MIO_COUNT_IO(read, n, start);
+        if (n == 0)
+        {
+            break;
+        }
+
+        if (pf != NULL)
+        {
+            prefetch_translate(pf, buf, buf, (size_t)n);
+        }
+        else
+        {
+            lookahead_apply(&la, ks, buf, (size_t)n);
+        }
+
+        if (outfd >= 0)
+        {
+            status = write_full(outfd, buf, (size_t)n);
+        }
+        else
+        {
+            size_t len = encode_text(buf, (size_t)n, text);
+            if (counted_fwrite(text, len, stdout) != len ||
+                fflush(stdout) != 0)
+            {
+                status = -1;
+            }
+        }
+        if (status != 0)
+        {
+            fprintf(stderr, "error: failed to write output\n");
+            break;
+        }
+    }
+
+    pool_put(text, 2 * CHUNK_SIZE);
+    pool_put(buf, CHUNK_SIZE);
+    pool_put(la.buf, LOOKAHEAD_SIZE);
+    prefetch_destroy(pf);
+    return status;
+}
+
+/**
+ * @brief Hand bytes to a pipe by reference with vmsplice().
+ *
+ * @param outfd  Write end of a pipe.
+ * @param data   Bytes to queue; the pipe references these pages.
+ * @param len    Number of bytes.
+ *
+ * @return 0 on success, or -1 on failure.
+ */
+static int vmsplice_full(int outfd, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        struct iovec iov = {(void *)data, len};
+        STAT_TIMER(start);
+        ssize_t n = vmsplice(outfd, &iov, 1, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        MIO_COUNT_IO(write, n, start);
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Translate into a pipe without copying the output.
+ *
+ * Input is read into a ring of page-aligned memory and translated in
+ * place, then the pages are queued on the output pipe with vmsplice().
+ * The pipe keeps referencing them until the reader consumes the bytes,
+ * so a ring position may only be reused once whatever was queued from it
+ * has left the pipe. A pipe holds at most its capacity in bytes, so with
+ * a ring of capacity + CHUNK_SIZE bytes, everything queued more than one
+ * ring length ago has been read by the time the ring wraps onto it.
+ *
+ * The reader must consume the pipe with read() or splice() the data into
+ * a file. tee(2) and zero-copy socket sends keep page references past
+ * the point where the bytes leave the pipe. Resizing the pipe while
+ * mcrypt writes to it is also not supported.
+ *
+ * @param ks     Initialized KStream instance.
+ * @param infd   Input descriptor of any kind.
+ * @param outfd  Output descriptor.
+ *
+ * @return 0 on success, 1 if the output is not a pipe (nothing has been
+ *         read or written), or -1 after printing a message on failure.
+ */
+static int translate_splice(KStream *ks, int infd, int outfd)
+{
+    struct stat st;
+    if (fstat(outfd, &st) != 0 || !S_ISFIFO(st.st_mode))
+    {
+        return 1;
+    }
+
+    (void)fcntl(outfd, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    int capacity = fcntl(outfd, F_GETPIPE_SZ);
+    if (capacity <= 0)
+    {
+        return 1;
+    }
+
+    size_t ring = (size_t)capacity < CHUNK_SIZE ? CHUNK_SIZE
+                                                : (size_t)capacity;
+    ring += CHUNK_SIZE;
+
+    /* not pooled: the pipe may still reference the tail after we return */
+    uint8_t *buf = map_buffer(ring);
+
+    int status = 0;
+    size_t pos = 0;
+    for (;;)
+    {
+        size_t room = ring - pos < CHUNK_SIZE ? ring - pos : CHUNK_SIZE;
+        STAT_TIMER(start);
+        ssize_t n = read(infd, buf + pos, room);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            fprintf(stderr, "error: could not read entire input file\n");
+            status = -1;
+            break;
+        }
+        MIO_COUNT_IO(read, n, start);
+        if (n == 0)
+        {
+            break;
+        }
+
+        ks_translate_inplace(ks, buf + pos, (size_t)n);
+        if (vmsplice_full(outfd, buf + pos, (size_t)n) != 0)
+        {
+            fprintf(stderr, "error: failed to write output\n");
+            status = -1;
+            break;
+        }
+        pos = (pos + (size_t)n) % ring;
+    }
+
+    munmap(buf, ring);
+    return status;
+}
+
+/**
+ * @brief Translate between two open descriptors with the stdio backend.
+ *
+ * @param ks     Initialized KStream instance.
+ * @param infd   Descriptor of the input file; closed on return.
+ * @param outfd  Descriptor of the output file; closed on return.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+static int translate_fds_stdio(KStream *ks, int infd, int outfd)
+{
+    FILE *in = fdopen(infd, "rb");
+    FILE *out = fdopen(outfd, "wb");
+    if (in == NULL || out == NULL)
+    {
+        perror("fdopen");
+        if (in != NULL)
+        {
+            fclose(in);
+        }
+        else
+        {
+            close(infd);
+        }
+        if (out != NULL)
+        {
+            fclose(out);
+        }
+        else
+        {
+            close(outfd);
+        }
+        return -1;
+    }
+
+    int status = translate_stream(ks, in, out);
+
+    fclose(in);
+    if (fclose(out) != 0 && status == 0)
+    {
+        fprintf(stderr, "error: failed to write output file\n");
+        status = -1;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Translate a regular file over itself.
+ *
+ * Each chunk is read and then written back to the same offset, so the
+ * file is never truncated. No backend is involved.
+ *
+ * @param ks     Initialized KStream instance.
+ * @param infd   Descriptor of the file, open for reading.
+ * @param outfd  Descriptor of the same file, open for writing.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+static int translate_same_file(KStream *ks, int infd, int outfd)
+{
+    uint8_t *buf = pool_get(CHUNK_SIZE);
+    int status = 0;
+    off_t off = 0;
+
+    for (;;)
+    {
+        STAT_TIMER(start);
+        ssize_t n = pread(infd, buf, CHUNK_SIZE, off);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            perror("input-file");
+            status = -1;
+            break;
+        }
+        MIO_COUNT_IO(read, (size_t)n, start);
+        if (n == 0)
+        {
+            break;
+        }
+
+        ks_translate_inplace(ks, buf, (size_t)n);
+
+        STAT_TIMER(wstart);
+        size_t done = 0;
+        while (done < (size_t)n)
+        {
+            ssize_t w = pwrite(outfd, buf + done, (size_t)n - done,
+                               off + (off_t)done);
+            if (w < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (w <= 0)
+            {
+                break;
+            }
+            done += (size_t)w;
+        }
+        MIO_COUNT_IO(write, done, wstart);
+        if (done < (size_t)n)
+        {
+            perror("output-file");
+            status = -1;
+            break;
+        }
+        off += n;
+    }
+
+    pool_put(buf, CHUNK_SIZE);
+    return status;
+}
+
+/**
+ * @brief Translate a file into another file.
+ *
+ * An output that is the input file itself is translated in place, as
+ * the original single-buffer mcrypt allowed. MIO_AUTO translates
+ * regular inputs of up to SMALL_MESSAGE bytes through a stack buffer
+ * with one read and one write. Otherwise it uses the mmap backend when
+ * both files are regular files and the pipeline backend otherwise. An
+ * explicit MIO_MMAP on pipes, devices and other special files falls
+ * back to the stdio backend, as does
+ * MIO_PIPELINE if its threads cannot be started. MIO_URING needs two
+ * regular files and a kernel with io_uring; otherwise it behaves like
+ * MIO_AUTO.
+ *
+ * @param ks       Initialized KStream instance.
+ * @param infile   Path of the file to translate.
+ * @param outfile  Path of the file that receives the translated bytes.
+ * @param backend  Backend to use.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int mio_translate_file(KStream *ks, const char *infile, const char *outfile,
+                       MioBackend backend)
+{
+    int from_stdin = strcmp(infile, "-") == 0;
+    int infd = from_stdin ? dup(STDIN_FILENO) : open(infile, O_RDONLY);
+    if (infd < 0)
+    {
+        perror("input-file");
+        return -1;
+    }
+
+    struct stat inst;
+    if (fstat(infd, &inst) != 0)
+    {
+        perror("input-file");
+        close(infd);
+        return -1;
+    }
+
+    int outfd = open(outfile, O_RDWR | O_CREAT, 0666);
+    if (outfd < 0)
+    {
+        outfd = open(outfile, O_WRONLY | O_CREAT, 0666);
+    }
+    if (outfd < 0)
+    {
+        perror("output-file");
+        close(infd);
+        return -1;
+    }
+
+    struct stat outst;
+    if (fstat(outfd, &outst) != 0)
+    {
+        perror("output-file");
+        close(infd);
+        close(outfd);
+        return -1;
+    }
+
+    /* holding a FIFO open for reading would hide a reader that exits */
+    if (S_ISFIFO(outst.st_mode) &&
+        (fcntl(outfd, F_GETFL) & O_ACCMODE) == O_RDWR)
+    {
+        int wrfd = open(outfile, O_WRONLY);
+        if (wrfd >= 0)
+        {
+            close(outfd);
+            outfd = wrfd;
+        }
+    }
+
+    if (S_ISREG(inst.st_mode) && inst.st_dev == outst.st_dev &&
+        inst.st_ino == outst.st_ino)
+    {
+        int status = translate_same_file(ks, infd, outfd);
+        close(infd);
+        if (close(outfd) != 0 && status == 0)
+        {
+            fprintf(stderr, "error: failed to write output file\n");
+            status = -1;
+        }
+        return status;
+    }
+
+    if (S_ISREG(outst.st_mode) && ftruncate(outfd, 0) != 0)
+    {
+        perror("output-file");
+        close(infd);
+        close(outfd);
+        return -1;
+    }
+
+    int status = 0;
+    if (backend == MIO_AUTO && !from_stdin && S_ISREG(inst.st_mode) &&
+        inst.st_size <= SMALL_MESSAGE)
+    {
+        status = translate_small(ks, infd, outfd, inst.st_size);
+        if (status != 1)
+        {
+            close(infd);
+            if (close(outfd) != 0 && status == 0)
+            {
+                fprintf(stderr, "error: failed to write output file\n");
+                status = -1;
+            }
+            return status;
+        }
+    }
+
+    int can_mmap = S_ISREG(inst.st_mode) && S_ISREG(outst.st_mode) &&
+                   (fcntl(outfd, F_GETFL) & O_ACCMODE) == O_RDWR;
+
+    if (backend == MIO_AUTO && S_ISFIFO(outst.st_mode))
+    {
+        backend = MIO_SPLICE;
+    }
+    else if (backend == MIO_AUTO && from_stdin)
+    {
+        backend = MIO_LOOKAHEAD;
+    }
+    else if (backend == MIO_AUTO)
+    {
+        backend = can_mmap ? MIO_MMAP : MIO_PIPELINE;
+    }
+    else if (backend == MIO_MMAP && !can_mmap)
+    {
+        backend = MIO_STDIO;
+    }
+
+    status = 0;
+    if (backend == MIO_URING)
+    {
+        int regular = S_ISREG(inst.st_mode) && S_ISREG(outst.st_mode);
+        status = regular ? translate_uring(ks, infd, outfd, inst.st_size) : 1;
+        if (status == 1)
+        {
+            backend = can_mmap ? MIO_MMAP : MIO_PIPELINE;
+        }
+    }
+
+    if (backend == MIO_SPLICE)
+    {
+        status = translate_splice(ks, infd, outfd);
+        if (status == 1)
+        {
+            backend = from_stdin  ? MIO_LOOKAHEAD
+                      : can_mmap ? MIO_MMAP
+                                 : MIO_PIPELINE;
+        }
+    }
+
+    if (backend == MIO_PIPELINE)
+    {
+        status = translate_pipeline(ks, infd, outfd);
+        if (status == 1)
+        {
+            backend = MIO_STDIO;
+        }
+    }
+
+    if (backend == MIO_STDIO)
+    {
+        return translate_fds_stdio(ks, infd, outfd);
+    }
+    if (backend == MIO_MMAP)
+    {
+        status = translate_mmap(ks, infd, outfd, inst.st_size);
+    }
+    if (backend == MIO_LOOKAHEAD)
+    {
+        status = translate_lookahead(ks, infd, outfd);
+    }
+
+    close(infd);
+    if (close(outfd) != 0 && status == 0)
+    {
+        fprintf(stderr, "error: failed to write output file\n");
+        status = -1;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Print a small regular file's translation with one write.
+ *
+ * Like translate_small(), but the translation is encoded with the
+ * ASCII/hex rules into a stack buffer and written to stdout directly,
+ * bypassing the stdout stream, which must have nothing buffered.
+ *
+ * @param ks    Initialized KStream instance.
+ * @param infd  Descriptor of the input file, at offset zero.
+ * @param size  Size of the input file, at most SMALL_MESSAGE.
+ *
+ * @return 0 on success, 1 to fall back, or -1 after printing a message.
+ */
+static int translate_small_text(KStream *ks, int infd, off_t size)
+{
+    uint8_t buf[SMALL_MESSAGE];
+    char text[2 * SMALL_MESSAGE];
+
+    STAT_TIMER(start);
+    ssize_t n = read(infd, buf, sizeof(buf));
+    if (n != (ssize_t)size)
+    {
+        if (lseek(infd, 0, SEEK_SET) != 0)
+        {
+            perror("input-file");
+            return -1;
+        }
+        return 1;
+    }
+    MIO_COUNT_IO(read, (size_t)n, start);
+
+    ks_translate_inplace(ks, buf, (size_t)n);
+    size_t len = encode_text(buf, (size_t)n, text);
+    if (fflush(stdout) != 0 ||
+        write_full(STDOUT_FILENO, (const uint8_t *)text, len) != 0)
+    {
+        fprintf(stderr, "error: failed to write output\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Translate a file and print the result on stdout.
+ *
+ * @param ks      Initialized KStream instance.
+ * @param infile  Path of the file to translate.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int mio_translate_stdout(KStream *ks, const char *infile)
+{
+    if (strcmp(infile, "-") == 0)
+    {
+        int status = translate_lookahead(ks, STDIN_FILENO, -1);
+        if (fflush(stdout) != 0 && status == 0)
+        {
+            fprintf(stderr, "error: failed to write output\n");
+            status = -1;
+        }
+        return status;
+    }
+
+    int infd = open(infile, O_RDONLY);
+    struct stat inst;
+    if (infd < 0 || fstat(infd, &inst) != 0)
+    {
+        perror("input-file");
+        if (infd >= 0)
+        {
+            close(infd);
+        }
+        return -1;
+    }
+
+    if (S_ISREG(inst.st_mode) && inst.st_size <= SMALL_MESSAGE)
+    {
+        int status = translate_small_text(ks, infd, inst.st_size);
+        if (status != 1)
+        {
+            close(infd);
+            return status;
+        }
+    }
+
+    FILE *in = fdopen(infd, "rb");
+    if (!in)
+    {
+        perror("input-file");
+        close(infd);
+        return -1;
+    }
+
+    int status = translate_stream(ks, in, NULL);
+    fclose(in);
+
+    if (fflush(stdout) != 0 && status == 0)
+    {
+        fprintf(stderr, "error: failed to write output\n");
+        status = -1;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Read the process-wide I/O counters.
+ *
+ * @param out  Receives the counters.
+ *
+ * @return 0 if counters are compiled in, or -1 if they are not.
+ */
+int mio_get_stats(MioStats *out)
+{
+    assert(out != NULL);
+
+#ifdef KS_STATS
+    /* relaxed loads of each field; the snapshot is not atomic as a whole */
+    out->read_calls = STAT_LOAD(mio_stats.read_calls);
+    out->read_bytes = STAT_LOAD(mio_stats.read_bytes);
+    out->read_ns = STAT_LOAD(mio_stats.read_ns);
+    out->write_calls = STAT_LOAD(mio_stats.write_calls);
+    out->write_bytes = STAT_LOAD(mio_stats.write_bytes);
+    out->write_ns = STAT_LOAD(mio_stats.write_ns);
+    out->uring_wait_ns = STAT_LOAD(mio_stats.uring_wait_ns);
+    out->mapped_bytes = STAT_LOAD(mio_stats.mapped_bytes);
+    out->buffer_allocs = STAT_LOAD(mio_stats.buffer_allocs);
+    out->buffer_reuses = STAT_LOAD(mio_stats.buffer_reuses);
+    out->buffer_bytes = STAT_LOAD(mio_stats.buffer_bytes);
+    out->buffer_peak = STAT_LOAD(mio_stats.buffer_peak);
+    return 0;
+#else
+    memset(out, 0, sizeof(*out));
+    return -1;
+#endif
+}
+
+/**
+ * @brief Append a suffix to a path.
+ *
+ * @param path    Path to extend.
+ * @param suffix  Suffix to add.
+ *
+ * @return Heap-allocated "path" "suffix".
+ */
+static char *with_suffix(const char *path, const char *suffix)
+{
+    size_t len = strlen(path);
+    size_t slen = strlen(suffix);
+    char *name = malloc(len + slen + 1);
+    assert(name != NULL);
+    memcpy(name, path, len);
+    memcpy(name + len, suffix, slen + 1);
+    return name;
+}
+
+/**
+ * @brief Replace a small file with new contents atomically.
+ *
+ * The contents go to a new file created by mkstemp() next to `path`,
+ * which is mode 0600 and never an existing file or link. It is flushed
+ * to disk and renamed over `path`, and the directory is flushed too, so
+ * readers and a crash see either the old file or the whole new one.
+ *
+ * @param path  File to create or replace.
+ * @param buf   New contents.
+ * @param len   Number of bytes.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+static int replace_file(const char *path, const uint8_t *buf, size_t len)
+{
+    char *tmp = with_suffix(path, ".XXXXXX");
+    int status = 0;
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+    {
+        perror(path);
+        free(tmp);
+        return -1;
+    }
+
+    if (write_full(fd, buf, len) != 0 || fsync(fd) != 0)
+    {
+        status = -1;
+    }
+    if (close(fd) != 0 || status != 0 || rename(tmp, path) != 0)
+    {
+        perror(path);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+
+    /* make the rename itself durable */
+    const char *slash = strrchr(path, '/');
+    char *dir = with_suffix(slash == NULL ? "." : path, "");
+    if (slash != NULL)
+    {
+        dir[slash == path ? 1 : (size_t)(slash - path)] = '\0';
+    }
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0 || fsync(dirfd) != 0)
+    {
+        perror(dir);
+        status = -1;
+    }
+    if (dirfd >= 0)
+    {
+        close(dirfd);
+    }
+    free(dir);
+    return status;
+}
+
+/**
+ * @brief Write the primed state for a key file into a state file.
+ *
+ * @param keyfile    Path of the 8-byte key file.
+ * @param statefile  Path of the state file to create or replace.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int mio_precompute(const char *keyfile, const char *statefile)
+{
+    uint8_t keybytes[8];
+    if (mio_read_key(keyfile, keybytes) != 0)
+    {
+        return -1;
+    }
+
+    uint8_t buf[MIO_STATE_FILE_SIZE];
+    memcpy(buf, state_magic, 4);
+    buf[4] = STATE_VERSION;
+    buf[5] = buf[6] = buf[7] = 0;
+    KStream *ks = ks_create(keybytes);
+    ks_save_state(ks, buf + 8);
+    ks_destroy(ks);
+    put_le64(buf + STATE_SUM_OFFSET, fnv1a64(buf, STATE_SUM_OFFSET));
+
+    return replace_file(statefile, buf, sizeof(buf));
+}
+
+/**
+ * @brief Load the append state of an output file, if it has one.
+ *
+ * @param path      Path of the append state file.
+ * @param keycheck  Key check of the key file given for this run.
+ * @param offset    Receives the number of bytes already translated, or
+ *                  0 if there is no state file yet.
+ * @param ks        Receives the saved stream if there is a state file.
+ *
+ * @return 0 on success, or -1 after printing a message if the state file
+ *         is corrupt or belongs to another key.
+ */
+static int load_append_state(const char *path, uint64_t keycheck,
+                             uint64_t *offset, KStream **ks)
+{
+    *offset = 0;
+    *ks = NULL;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        if (errno == ENOENT)
+        {
+            return 0;
+        }
+        perror(path);
+        return -1;
+    }
+    uint8_t buf[APPEND_STATE_SIZE + 1];
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    if (n == APPEND_STATE_SIZE && memcmp(buf, append_magic, 4) == 0 &&
+        buf[4] == APPEND_VERSION && buf[5] == 0 && buf[6] == 0 &&
+        buf[7] == 0 &&
+        get_le64(buf + APPEND_SUM_OFFSET) ==
+            fnv1a64(buf, APPEND_SUM_OFFSET))
+    {
+        if (get_le64(buf + 16) != keycheck)
+        {
+            fprintf(stderr, "error: %s was written with another key\n", path);
+            return -1;
+        }
+        *ks = ks_load_state(buf + APPEND_SNAP_OFFSET);
+    }
+    if (*ks == NULL)
+    {
+        fprintf(stderr, "error: %s is not a valid append state file\n",
+                path);
+        return -1;
+    }
+    *offset = get_le64(buf + 8);
+    return 0;
+}
+
+/**
+ * @brief Write the append state of an output file.
+ *
+ * @param path      Path of the append state file.
+ * @param offset    Number of bytes translated so far.
+ * @param keycheck  Key check of the key file.
+ * @param ks        Stream positioned at `offset`.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+static int save_append_state(const char *path, uint64_t offset,
+                             uint64_t keycheck, const KStream *ks)
+{
+    uint8_t buf[APPEND_STATE_SIZE];
+    memcpy(buf, append_magic, 4);
+    buf[4] = APPEND_VERSION;
+    buf[5] = buf[6] = buf[7] = 0;
+    put_le64(buf + 8, offset);
+    put_le64(buf + 16, keycheck);
+    ks_save_state(ks, buf + APPEND_SNAP_OFFSET);
+    put_le64(buf + APPEND_SUM_OFFSET, fnv1a64(buf, APPEND_SUM_OFFSET));
+    return replace_file(path, buf, sizeof(buf));
+}
+
+/**
+ * @brief Translate only what was added to a file since the last run.
+ *
+ * @param keyfile  Path of the key file or state file.
+ * @param infile   Path of the growing plaintext file.
+ * @param outfile  Path of the output, extended in place.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int mio_append(const char *keyfile, const char *infile, const char *outfile)
+{
+    KStream *ks = mio_load_stream(keyfile);
+    if (ks == NULL)
+    {
+        return -1;
+    }
+    uint8_t snap[KS_SNAPSHOT_SIZE];
+    ks_save_state(ks, snap);
+    uint64_t keycheck = fnv1a64(snap, sizeof(snap));
+
+    char *statefile = with_suffix(outfile, MIO_APPEND_SUFFIX);
+    uint64_t offset;
+    KStream *saved;
+    if (load_append_state(statefile, keycheck, &offset, &saved) != 0)
+    {
+        ks_destroy(ks);
+        free(statefile);
+        return -1;
+    }
+    if (saved != NULL)
+    {
+        ks_destroy(ks);
+        ks = saved;
+    }
+
+    int status = -1;
+    int outfd = -1;
+    uint8_t *buf = NULL;
+    int infd = open(infile, O_RDONLY);
+    struct stat inst;
+    struct stat outst;
+    if (infd < 0)
+    {
+        perror("input-file");
+        goto done;
+    }
+    if (fstat(infd, &inst) != 0 || !S_ISREG(inst.st_mode))
+    {
+        fprintf(stderr, "error: --append needs a regular input file\n");
+        goto done;
+    }
+    if ((uint64_t)inst.st_size < offset)
+    {
+        fprintf(stderr, "error: %s is shorter than the %llu bytes already "
+                        "encrypted\n",
+                infile, (unsigned long long)offset);
+        goto done;
+    }
+
+    outfd = open(outfile, O_WRONLY | O_CREAT, 0666);
+    if (outfd < 0 || fstat(outfd, &outst) != 0)
+    {
+        perror("output-file");
+        goto done;
+    }
+    if (inst.st_dev == outst.st_dev && inst.st_ino == outst.st_ino)
+    {
+        fprintf(stderr, "error: input and output are the same file\n");
+        goto done;
+    }
+    if ((uint64_t)outst.st_size < offset)
+    {
+        fprintf(stderr, "error: %s is shorter than its append state\n",
+                outfile);
+        goto done;
+    }
+
+    /* drop whatever an interrupted run wrote after its last state */
+    if (ftruncate(outfd, (off_t)offset) != 0 ||
+        lseek(infd, (off_t)offset, SEEK_SET) < 0 ||
+        lseek(outfd, (off_t)offset, SEEK_SET) < 0)
+    {
+        perror("output-file");
+        goto done;
+    }
+
+    buf = pool_get(CHUNK_SIZE);
+    for (;;)
+    {
+        ssize_t n = mio_read_full(infd, buf, CHUNK_SIZE);
+        if (n < 0)
+        {
+            perror("input-file");
+            goto done;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        ks_translate_inplace(ks, buf, (size_t)n);
+        if (write_full(outfd, buf, (size_t)n) != 0)
+        {
+            perror("output-file");
+            goto done;
+        }
+        offset += (uint64_t)n;
+    }
+
+    /* the state may only ever cover bytes that are on disk */
+    if (fdatasync(outfd) != 0)
+    {
+        perror("output-file");
+        goto done;
+    }
+    status = save_append_state(statefile, offset, keycheck, ks);
+
+done:
+    pool_put(buf, CHUNK_SIZE);
+    if (outfd >= 0 && close(outfd) != 0 && status == 0)
+    {
+        perror("output-file");
+        status = -1;
+    }
+    if (infd >= 0)
+    {
+        close(infd);
+    }
+    ks_destroy(ks);
+    free(statefile);
+    return status;
+}
@@ -0,0 +1,285 @@
+/**
+ * @file mio.h
+ * @author Shane Girolamo
+ *
+ * @brief I/O backends that move bytes between files and a KStream.
+ *
+ * mcrypt translates an input file either into an output file or onto
+ * stdout. This module hides how the bytes get from the input to the
+ * cipher and back out again, so the driver only chooses a backend:
+ *
+ *  - MIO_STDIO streams the input through the cipher in fixed-size chunks
+ *    with fread/fwrite. It works on any kind of file, including pipes.
+ *  - MIO_MMAP maps the input read-only and the output read-write, and
+ *    translates directly from one mapping into the other. It only
+ *    applies to regular files; anything else falls back to MIO_STDIO.
+ *  - MIO_PIPELINE runs a reader thread and a writer thread around the
+ *    translation, connected by a ring of reusable buffers, so that I/O
+ *    and the cipher overlap. It works on any kind of file.
+ *  - MIO_URING submits positioned reads and writes through io_uring with
+ *    registered buffers and several requests in flight, optionally with
+ *    O_DIRECT. It needs regular files and a kernel that allows io_uring,
+ *    and falls back to MIO_AUTO's choice otherwise.
+ *  - MIO_LOOKAHEAD polls the input and, while no data is waiting,
+ *    generates keystream ahead into a ring, so data that arrives is only
+ *    XORed and written straight back out. It suits slow producers on
+ *    pipes and is what MIO_AUTO picks for stdin.
+ *  - MIO_SPLICE translates in a ring of page-aligned memory and queues
+ *    the pages on the output pipe with vmsplice(), so the output is
+ *    never copied. It needs a pipe as output, such as /dev/stdout in a
+ *    shell pipeline, where MIO_AUTO picks it; otherwise it falls back to
+ *    MIO_AUTO's other choices.
+ *
+ * An input path of "-" reads stdin.
+ *
+ * Every backend produces byte-identical output. Functions in this module
+ * report errors on stderr and return -1 instead of exiting, so that
+ * callers handling many files can carry on after a failure.
+ */
+
+#ifndef MIO_H
+#define MIO_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "KStream.h"
+
+/**
+ * @brief Selects how bytes are moved between the files and the cipher.
+ */
+typedef enum
+{
+    MIO_AUTO,      /**< Pick the fastest backend the files support. */
+    MIO_STDIO,     /**< Chunked fread/fwrite through a reused buffer. */
+    MIO_MMAP,      /**< Translate between memory mappings of the files. */
+    MIO_PIPELINE,  /**< Overlap reads, translation and writes in threads. */
+    MIO_URING,     /**< Queue reads and writes through io_uring. */
+    MIO_LOOKAHEAD, /**< Generate keystream ahead while input is idle. */
+    MIO_SPLICE     /**< Queue output pages on a pipe with vmsplice(). */
+} MioBackend;
+
+/**
+ * @brief Size of a precomputed state file in bytes.
+ *
+ * Layout: "KSST", u8 version, three zero bytes, the KS_SNAPSHOT_SIZE
+ * state of a freshly primed stream, and a little-endian u64 FNV-1a
+ * checksum of everything before it.
+ */
+#define MIO_STATE_FILE_SIZE (8 + KS_SNAPSHOT_SIZE + 8)
+
+/**
+ * @brief Read an 8-byte key from a key file.
+ *
+ * State files are rejected, since they do not contain the key.
+ *
+ * @param keyfile   Path to the binary key file.
+ * @param keybytes  Output buffer that receives the 8-byte key.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int mio_read_key(const char *keyfile, uint8_t keybytes[8]);
+
+/**
+ * @brief Create the primed KStream for a key file or a state file.
+ *
+ * A key file goes through ks_create(). A state file written by
+ * mio_precompute() is read with a single read and goes straight to
+ * ks_load_state(), skipping the key schedule and the discard.
+ *
+ * @param keyfile  Path of either kind of file.
+ *
+ * @return A new KStream, or NULL after printing a message on failure,
+ *         including a state file with a bad checksum.
+ */
+KStream *mio_load_stream(const char *keyfile);
+
+/**
+ * @brief Precompute the primed state for a key into a state file.
+ *
+ * The state file is as secret as the key. It is created with mode 0600
+ * and replaced atomically through a freshly created temporary file.
+ *
+ * @param keyfile    Path of the 8-byte key file.
+ * @param statefile  Path of the state file to write.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int mio_precompute(const char *keyfile, const char *statefile);
+
+/**
+ * @brief Suffix of the append state file kept next to an output file.
+ */
+#define MIO_APPEND_SUFFIX ".ksa"
+
+/**
+ * @brief Translate only what was added to a file since the last run.
+ *
+ * For append-only inputs such as logs. After each run the stream state
+ * and the number of bytes translated are saved in outfile followed by
+ * MIO_APPEND_SUFFIX. The next run restores that state and translates
+ * and appends only the new tail of infile, so the work is proportional
+ * to the new bytes. Without a saved state the whole input is translated
+ * and the output replaced, exactly as mio_translate_file() would.
+ *
+ * The output is flushed to disk before the state file is atomically
+ * replaced, so the state never covers bytes that were not written.
+ * Anything an interrupted run wrote after its last state is dropped and
+ * translated again. Inputs must only grow: changes to bytes that were
+ * already translated are not detected. The state file is as secret as
+ * the key and is created with mode 0600; a state saved under another
+ * key is rejected.
+ *
+ * @param keyfile  Path of the key file or of a state file written by
+ *                 mio_precompute().
+ * @param infile   Path of the growing plaintext file; must be a regular
+ *                 file.
+ * @param outfile  Path of the output, extended in place.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int mio_append(const char *keyfile, const char *infile, const char *outfile);
+
+/**
+ * @brief Look up a backend by its command-line name.
+ *
+ * @param name  One of "auto", "stdio", "mmap", "pipeline", "uring",
+ *              "lookahead" or "splice".
+ * @param out   Receives the matching backend.
+ *
+ * @return 0 on success, or -1 if the name is not recognized.
+ */
+int mio_backend_parse(const char *name, MioBackend *out);
+
+/**
+ * @brief Request O_DIRECT for the io_uring backend.
+ *
+ * Direct I/O bypasses the page cache, which keeps very large translations
+ * from evicting everything else. Filesystems that do not support it are
+ * silently used with buffered I/O. Call before starting any translation.
+ *
+ * @param enable  Nonzero to open files with O_DIRECT where supported.
+ */
+void mio_set_direct(int enable);
+
+/**
+ * @brief Let the lookahead backend generate on a background thread.
+ *
+ * Keystream is then produced by a Prefetch thread (see prefetch.h) that
+ * keeps working while the translating thread waits for input or output,
+ * instead of only between polls of the input. Worth it when a spare
+ * core is available. Call before starting any translation.
+ *
+ * @param enable  Nonzero to use a producer thread.
+ */
+void mio_set_prefetch(int enable);
+
+/**
+ * @brief Back I/O buffers with huge pages where possible.
+ *
+ * I/O buffers come from a process-wide pool of page-aligned anonymous
+ * mappings that are reused across files. With huge pages enabled, new
+ * buffers try explicit huge pages first and fall back to transparent
+ * huge pages. Call before starting any translation.
+ *
+ * @param enable  Nonzero to request huge pages for new buffers.
+ */
+void mio_set_hugepages(int enable);
+
+/**
+ * @brief Translate a file into another file.
+ *
+ * The output file is created or truncated; if it is the input file
+ * itself, the file is translated in place instead. Translation starts at
+ * the current position of the keystream, so `ks` is normally freshly
+ * created.
+ *
+ * @param ks       Initialized KStream instance.
+ * @param infile   Path of the file to translate, or "-" for stdin.
+ * @param outfile  Path of the file that receives the translated bytes.
+ * @param backend  Backend to use; MIO_AUTO picks one per file.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int mio_translate_file(KStream *ks, const char *infile, const char *outfile,
+                       MioBackend backend);
+
+/**
+ * @brief Translate a file and print the result on stdout.
+ *
+ * Bytes below 128 are printed unchanged; every other byte is printed as
+ * two lowercase hexadecimal digits.
+ *
+ * @param ks      Initialized KStream instance.
+ * @param infile  Path of the file to translate, or "-" for stdin.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int mio_translate_stdout(KStream *ks, const char *infile);
+
+/**
+ * @brief Write bytes to a stream using the ASCII/hex rules.
+ *
+ * Uses the same encoding as mio_translate_stdout(), for callers that
+ * translate data themselves and only need the text output.
+ *
+ * @param f     Destination stream.
+ * @param data  Bytes to encode.
+ * @param len   Number of bytes.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int mio_write_text(FILE *f, const uint8_t *data, size_t len);
+
+/**
+ * @brief Read until a buffer is full or the input ends.
+ *
+ * Retries after short reads and EINTR, and counts as one read in the
+ * I/O counters.
+ *
+ * @param fd   Descriptor to read from.
+ * @param buf  Destination buffer.
+ * @param len  Capacity of the buffer.
+ *
+ * @return Number of bytes read, less than `len` only at end of input, or
+ *         -1 on error.
+ */
+ssize_t mio_read_full(int fd, uint8_t *buf, size_t len);
+
+/**
+ * @brief Process-wide I/O counters, see mio_get_stats().
+ *
+ * Times are in nanoseconds of wall-clock time summed over all threads.
+ */
+typedef struct
+{
+    uint64_t read_calls;    /**< Read calls issued. */
+    uint64_t read_bytes;    /**< Bytes read. */
+    uint64_t read_ns;       /**< Time blocked in reads. */
+    uint64_t write_calls;   /**< Write calls issued. */
+    uint64_t write_bytes;   /**< Bytes written. */
+    uint64_t write_ns;      /**< Time blocked in writes. */
+    uint64_t uring_wait_ns; /**< Time waiting for io_uring completions. */
+    uint64_t mapped_bytes;  /**< Bytes translated through mmap windows. */
+    uint64_t buffer_allocs; /**< I/O buffers newly mapped. */
+    uint64_t buffer_reuses; /**< I/O buffers handed out again by the pool. */
+    uint64_t buffer_bytes;  /**< Bytes of I/O buffers currently live. */
+    uint64_t buffer_peak;   /**< Largest value buffer_bytes reached. */
+} MioStats;
+
+/**
+ * @brief Read the process-wide I/O counters.
+ *
+ * The counters exist only when the module is built with KS_STATS
+ * defined (make STATS=1); otherwise nothing is counted and `out` is
+ * zeroed.
+ *
+ * @param out  Receives the counters.
+ *
+ * @return 0 if counters are compiled in, or -1 if they are not.
+ */
+int mio_get_stats(MioStats *out);
+
+/**
+ * @brief End of the MIO_H include guard.
+ */
+#endif
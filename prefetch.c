@@ -0,0 +1,268 @@
+/**
+ * @file prefetch.c
+ * @author Shane Girolamo
+ *
+ * @brief Implementation of the background keystream generator.
+ *
+ * The ring indices are free-running byte counts: `head` is how much
+ * keystream the producer has published and `tail` how much the consumer
+ * has used, so head - tail bytes are ready. Each side writes only its
+ * own index and reads the other's with acquire loads, so the keystream
+ * bytes are visible before the index that covers them. The two indices
+ * live on separate cache lines.
+ *
+ * A side that finds the ring full (producer) or empty (consumer) sleeps
+ * on a condition variable after raising its `waiting` flag and checking
+ * the ring once more. The other side checks the flag after every index
+ * update and takes the mutex only if it is set, so the lock stays off
+ * the data path. Both the flag store and the index store are sequentially
+ * consistent, so one of the two always sees the other and no wakeup is
+ * lost.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "prefetch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+/**
+ * @brief Keystream the producer publishes per step.
+ *
+ * Small enough that a waiting consumer gets the first bytes quickly,
+ * large enough that the index updates cost nothing.
+ */
+#define PREFETCH_STEP ((size_t)4096)
+
+/**
+ * @brief Size of a cache line, for keeping the indices apart.
+ */
+#define CACHE_LINE 64
+
+/**
+ * @brief State shared by the producer thread and the consumer.
+ */
+struct Prefetch
+{
+    uint64_t head;        /**< Bytes published by the producer. */
+    int producer_waiting; /**< Producer asleep on not_full. */
+    /** @brief Keeps the consumer's fields off the producer's line. */
+    char head_pad[CACHE_LINE - sizeof(uint64_t) - sizeof(int)];
+
+    uint64_t tail;        /**< Bytes consumed. */
+    int consumer_waiting; /**< Consumer asleep on not_empty. */
+    /** @brief Keeps the fields below off the consumer's line. */
+    char tail_pad[CACHE_LINE - sizeof(uint64_t) - sizeof(int)];
+
+    KStream *ks;              /**< Stream, used only by the producer. */
+    uint8_t *ring;            /**< Keystream ring. */
+    size_t size;              /**< Ring size, a power of two. */
+    int stop;                 /**< Set to end the producer. */
+    pthread_mutex_t lock;     /**< Guards sleeping and waking only. */
+    pthread_cond_t not_full;  /**< Producer waits here. */
+    pthread_cond_t not_empty; /**< Consumer waits here. */
+    pthread_t thread;         /**< The producer. */
+};
+
+/**
+ * @brief Wake the other side if it has gone to sleep.
+ *
+ * @param p        The Prefetch.
+ * @param waiting  The other side's waiting flag.
+ * @param cond     The other side's condition variable.
+ */
+static void wake(Prefetch *p, int *waiting, pthread_cond_t *cond)
+{
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/**
+ * @brief Producer thread: keep the ring full until stopped.
+ *
+ * @param arg  The Prefetch.
+ *
+ * @return NULL.
+ */
+static void *producer(void *arg)
+{
+    Prefetch *p = arg;
+    uint64_t head = p->head;
+
+    for (;;)
+    {
+        uint64_t tail = __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE);
+        size_t space = p->size - (size_t)(head - tail);
+
+        if (space == 0)
+        {
+            pthread_mutex_lock(&p->lock);
+            __atomic_store_n(&p->producer_waiting, 1, __ATOMIC_SEQ_CST);
+            while (!p->stop &&
+                   __atomic_load_n(&p->tail, __ATOMIC_SEQ_CST) == tail)
+            {
+                pthread_cond_wait(&p->not_full, &p->lock);
+            }
+            __atomic_store_n(&p->producer_waiting, 0, __ATOMIC_RELAXED);
+            int stop = p->stop;
+            pthread_mutex_unlock(&p->lock);
+            if (stop)
+            {
+                break;
+            }
+            continue;
+        }
+        if (__atomic_load_n(&p->stop, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+
+        size_t pos = (size_t)head & (p->size - 1);
+        size_t n = space < PREFETCH_STEP ? space : PREFETCH_STEP;
+        if (n > p->size - pos)
+        {
+            n = p->size - pos;
+        }
+
+        ks_generate(p->ks, p->ring + pos, n);
+        head += n;
+        __atomic_store_n(&p->head, head, __ATOMIC_SEQ_CST);
+        wake(p, &p->consumer_waiting, &p->not_empty);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start generating keystream ahead for a stream.
+ *
+ * @param ks    Stream to generate from; destroyed by prefetch_destroy().
+ * @param ring  Ring size in bytes, a power of two, or 0 for the default.
+ *
+ * @return The new Prefetch, or NULL after printing a message.
+ */
+Prefetch *prefetch_create(KStream *ks, size_t ring)
+{
+    assert(ks != NULL);
+    if (ring == 0)
+    {
+        ring = PREFETCH_DEFAULT_RING;
+    }
+    assert((ring & (ring - 1)) == 0);
+
+    Prefetch *p = calloc(1, sizeof(*p));
+    assert(p != NULL);
+    void *buf;
+    if (posix_memalign(&buf, CACHE_LINE, ring) != 0)
+    {
+        buf = NULL;
+    }
+    assert(buf != NULL);
+
+    p->ks = ks;
+    p->ring = buf;
+    p->size = ring;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->not_full, NULL);
+    pthread_cond_init(&p->not_empty, NULL);
+
+    if (pthread_create(&p->thread, NULL, producer, p) != 0)
+    {
+        fprintf(stderr, "error: could not start the keystream thread\n");
+        pthread_cond_destroy(&p->not_empty);
+        pthread_cond_destroy(&p->not_full);
+        pthread_mutex_destroy(&p->lock);
+        free(p->ring);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+/**
+ * @brief XOR bytes with keystream from the ring.
+ *
+ * @param p    The Prefetch.
+ * @param in   Input bytes.
+ * @param out  Receives the translation; may equal `in`.
+ * @param num  Number of bytes.
+ */
+void prefetch_translate(Prefetch *p, const uint8_t *in, uint8_t *out,
+                        size_t num)
+{
+    assert(p != NULL);
+    uint64_t tail = p->tail;
+
+    while (num > 0)
+    {
+        uint64_t head = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            pthread_mutex_lock(&p->lock);
+            __atomic_store_n(&p->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&p->head, __ATOMIC_SEQ_CST) == tail)
+            {
+                pthread_cond_wait(&p->not_empty, &p->lock);
+            }
+            __atomic_store_n(&p->consumer_waiting, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&p->lock);
+            continue;
+        }
+
+        size_t pos = (size_t)tail & (p->size - 1);
+        size_t n = (size_t)(head - tail);
+        if (n > num)
+        {
+            n = num;
+        }
+        if (n > p->size - pos)
+        {
+            n = p->size - pos;
+        }
+
+        if (out != in)
+        {
+            memcpy(out, in, n);
+        }
+        ks_xor_keystream(out, p->ring + pos, n);
+
+        in += n;
+        out += n;
+        num -= n;
+        tail += n;
+        __atomic_store_n(&p->tail, tail, __ATOMIC_SEQ_CST);
+        wake(p, &p->producer_waiting, &p->not_full);
+    }
+}
+
+/**
+ * @brief Stop the producer thread and destroy the stream.
+ *
+ * @param p  The Prefetch, or NULL.
+ */
+void prefetch_destroy(Prefetch *p)
+{
+    if (p == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    __atomic_store_n(&p->stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&p->not_full);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+
+    pthread_cond_destroy(&p->not_empty);
+    pthread_cond_destroy(&p->not_full);
+    pthread_mutex_destroy(&p->lock);
+    ks_destroy(p->ks);
+    free(p->ring);
+    free(p);
+}
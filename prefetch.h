@@ -0,0 +1,74 @@
+/**
+ * @file prefetch.h
+ * @author Shane Girolamo
+ *
+ * @brief Keystream generated ahead by a background thread.
+ *
+ * RC4 keystream does not depend on the data, so it can be produced
+ * before the data arrives. A Prefetch owns a KStream and a producer
+ * thread that keeps a ring of keystream full. The ring is a lock-free
+ * single-producer, single-consumer queue: translating only takes ready
+ * keystream and XORs it in, so between bursts of traffic the serial RC4
+ * work happens on another core and a translation costs one pass over
+ * memory. The threads only block on each other when the ring is full or
+ * empty.
+ *
+ * A Prefetch is used from one consumer thread at a time.
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "KStream.h"
+
+/**
+ * @brief Ring size used when none is given.
+ */
+#define PREFETCH_DEFAULT_RING ((size_t)256 * 1024)
+
+/**
+ * @brief Opaque background keystream generator.
+ */
+typedef struct Prefetch Prefetch;
+
+/**
+ * @brief Start generating keystream ahead for a stream.
+ *
+ * The Prefetch takes ownership of `ks`: from now on its keystream runs
+ * ahead of the data, so it must not be used directly any more.
+ *
+ * @param ks    Stream to generate from; destroyed by prefetch_destroy().
+ * @param ring  Ring size in bytes, a power of two, or 0 for
+ *              PREFETCH_DEFAULT_RING.
+ *
+ * @return The new Prefetch, or NULL after printing a message if the
+ *         thread could not be started; `ks` is then still the caller's.
+ */
+Prefetch *prefetch_create(KStream *ks, size_t ring);
+
+/**
+ * @brief Translate bytes with keystream from the ring.
+ *
+ * Produces the same output as ks_translate() on the stream would.
+ *
+ * @param p    The Prefetch.
+ * @param in   Input bytes.
+ * @param out  Receives the translation; may equal `in`.
+ * @param num  Number of bytes.
+ */
+void prefetch_translate(Prefetch *p, const uint8_t *in, uint8_t *out,
+                        size_t num);
+
+/**
+ * @brief Stop the producer thread and destroy the stream.
+ *
+ * @param p  The Prefetch, or NULL.
+ */
+void prefetch_destroy(Prefetch *p);
+
+/**
+ * @brief End of the PREFETCH_H include guard.
+ */
+#endif
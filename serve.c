@@ -0,0 +1,1066 @@
+/**
+ * @file serve.c
+ * @author Shane Girolamo
+ *
+ * @brief Implementation of the mcrypt translation service.
+ *
+ * The main thread accepts connections and queues them. Worker threads
+ * take one connection at a time and answer its requests for as long as
+ * the next one is already waiting, then hand the connection back; the
+ * main thread polls idle connections alongside the listening socket and
+ * queues them again when they become readable, so an idle client holds
+ * no worker. Primed templates live in a direct-mapped cache keyed by the
+ * key bytes; a worker copies the template into its own KStream with
+ * ks_copy(), so the key schedule runs once per key rather than once per
+ * request. Latencies of the most recent requests are kept in a ring for
+ * the percentile report.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "serve.h"
+#include "KStream.h"
+#include "le.h"
+#include "mio.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/**
+ * @brief Number of slots in the template cache.
+ */
+#define SERVE_KEYS 256
+
+/**
+ * @brief Number of recent latencies kept for the percentile report.
+ */
+#define SERVE_SAMPLES 65536
+
+/**
+ * @brief Backlog of the listening socket.
+ */
+#define SERVE_QUEUE 256
+
+/**
+ * @brief Largest number of client connections open at once.
+ */
+#define SERVE_CONNECTIONS 1024
+
+/**
+ * @brief Receive timeout in seconds once a request has started arriving.
+ */
+#define SERVE_RECV_TIMEOUT 10
+
+/**
+ * @brief Size of a request header: op, key and length.
+ */
+#define SERVE_REQUEST_HEADER 17
+
+/**
+ * @brief Size of a response header: status and length.
+ */
+#define SERVE_RESPONSE_HEADER 9
+
+/**
+ * @brief Size of the buffer holding a statistics report.
+ */
+#define SERVE_REPORT 256
+
+/**
+ * @brief One slot of the template cache.
+ */
+typedef struct
+{
+    uint8_t key[8]; /**< Key the template was built from. */
+    KStream *ks;    /**< Primed template, or NULL if the slot is empty. */
+} ServeKey;
+
+/**
+ * @brief State shared by the accept loop and the workers.
+ */
+typedef struct
+{
+    ServeKey keys[SERVE_KEYS];    /**< Template cache. */
+    size_t nkeys;                 /**< Number of occupied cache slots. */
+    pthread_mutex_t key_lock;     /**< Protects keys and nkeys. */
+    double *samples;              /**< Ring of latencies in microseconds. */
+    uint64_t requests;            /**< Translate requests answered. */
+    pthread_mutex_t stat_lock;    /**< Protects samples and requests. */
+    int queue[SERVE_CONNECTIONS]; /**< Readable connections, oldest first. */
+    size_t head;                  /**< Index of the oldest queued entry. */
+    size_t queued;                /**< Number of queued connections. */
+    int idle[SERVE_CONNECTIONS];  /**< Connections waiting for a request. */
+    size_t nidle;                 /**< Number of idle connections. */
+    size_t open;                  /**< Client connections open in total. */
+    int wake[2];                  /**< Pipe that wakes the accept loop. */
+    int closing;                  /**< Set when the service shuts down. */
+    int *active;                  /**< Connection served by each worker. */
+    pthread_mutex_t lock;         /**< Protects the queue, idle and active. */
+    pthread_cond_t ready;         /**< Signalled on queue or closing changes. */
+} Server;
+
+/**
+ * @brief Per-thread argument for a worker.
+ */
+typedef struct
+{
+    Server *srv; /**< Shared state. */
+    int id;      /**< Index of this worker in srv->active. */
+} ServeWorker;
+
+/**
+ * @brief Set by the signal handler to stop the accept loop.
+ */
+static volatile sig_atomic_t serve_stop;
+
+/**
+ * @brief SIGINT/SIGTERM handler.
+ *
+ * @param sig  Signal number; unused.
+ */
+static void on_signal(int sig)
+{
+    (void)sig;
+    serve_stop = 1;
+}
+
+/**
+ * @brief Current monotonic time in microseconds.
+ *
+ * @return Microseconds since an arbitrary starting point.
+ */
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+/**
+ * @brief Receive exactly `len` bytes from a socket.
+ *
+ * @param fd   Connected socket.
+ * @param buf  Destination.
+ * @param len  Number of bytes.
+ *
+ * @return 0 on success, 1 if the peer hung up before the first byte, or
+ *         -1 on error or a short message.
+ */
+static int recv_full(int fd, uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = recv(fd, buf + done, len - done, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == 0 && done == 0)
+        {
+            return 1;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send a whole buffer on a socket.
+ *
+ * @param fd   Connected socket.
+ * @param buf  Data to send.
+ * @param len  Number of bytes.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+static int send_full(int fd, const uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = send(fd, buf + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send one framed message: header, then payload.
+ *
+ * @param fd       Connected socket.
+ * @param hdr      Header bytes.
+ * @param hdrlen   Number of header bytes.
+ * @param payload  Payload bytes.
+ * @param len      Payload length; stored in the last 8 header bytes.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+static int send_message(int fd, uint8_t *hdr, size_t hdrlen,
+                        const uint8_t *payload, size_t len)
+{
+    put_le64(hdr + hdrlen - 8, len);
+    if (send_full(fd, hdr, hdrlen) != 0)
+    {
+        return -1;
+    }
+    return send_full(fd, payload, len);
+}
+
+/**
+ * @brief Send a response.
+ *
+ * @param fd       Connected socket.
+ * @param status   0 for success, non-zero for an error.
+ * @param payload  Response payload.
+ * @param len      Payload length.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+static int send_reply(int fd, uint8_t status, const uint8_t *payload,
+                      size_t len)
+{
+    uint8_t hdr[SERVE_RESPONSE_HEADER];
+    hdr[0] = status;
+    return send_message(fd, hdr, sizeof(hdr), payload, len);
+}
+
+/**
+ * @brief Send an error response carrying a message.
+ *
+ * @param fd   Connected socket.
+ * @param msg  Error message.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+static int send_error(int fd, const char *msg)
+{
+    return send_reply(fd, 1, (const uint8_t *)msg, strlen(msg));
+}
+
+/**
+ * @brief Load the template for a key into a worker's stream.
+ *
+ * @param srv  Shared state.
+ * @param key  Key bytes from the request.
+ * @param ks   Worker stream; allocated on first use.
+ */
+static void prime_stream(Server *srv, const uint8_t key[8], KStream **ks)
+{
+    uint32_t h = 2166136261u;
+    for (int n = 0; n < 8; n++)
+    {
+        h = (h ^ key[n]) * 16777619u;
+    }
+    ServeKey *slot = &srv->keys[h % SERVE_KEYS];
+
+    pthread_mutex_lock(&srv->key_lock);
+    if (slot->ks != NULL && memcmp(slot->key, key, 8) == 0)
+    {
+        if (*ks == NULL)
+        {
+            *ks = ks_clone(slot->ks);
+        }
+        else
+        {
+            ks_copy(*ks, slot->ks);
+        }
+        pthread_mutex_unlock(&srv->key_lock);
+        return;
+    }
+    pthread_mutex_unlock(&srv->key_lock);
+
+    /* run the key schedule outside the lock */
+    KStream *fresh = ks_create(key);
+    if (*ks == NULL)
+    {
+        *ks = ks_clone(fresh);
+    }
+    else
+    {
+        ks_copy(*ks, fresh);
+    }
+
+    pthread_mutex_lock(&srv->key_lock);
+    if (slot->ks == NULL)
+    {
+        srv->nkeys++;
+    }
+    ks_destroy(slot->ks);
+    memcpy(slot->key, key, 8);
+    slot->ks = fresh;
+    pthread_mutex_unlock(&srv->key_lock);
+}
+
+/**
+ * @brief Compare two doubles for qsort().
+ *
+ * @param a  First value.
+ * @param b  Second value.
+ *
+ * @return Negative, zero or positive as a is below, equal to or above b.
+ */
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Format the latency statistics.
+ *
+ * @param srv   Shared state.
+ * @param out   Receives the report.
+ * @param size  Capacity of `out`.
+ *
+ * @return Length of the report.
+ */
+static size_t format_stats(Server *srv, char *out, size_t size)
+{
+    pthread_mutex_lock(&srv->stat_lock);
+    uint64_t requests = srv->requests;
+    size_t n = requests < SERVE_SAMPLES ? (size_t)requests : SERVE_SAMPLES;
+    double *sorted = malloc((n > 0 ? n : 1) * sizeof(double));
+    assert(sorted != NULL);
+    memcpy(sorted, srv->samples, n * sizeof(double));
+    pthread_mutex_unlock(&srv->stat_lock);
+
+    pthread_mutex_lock(&srv->key_lock);
+    size_t nkeys = srv->nkeys;
+    pthread_mutex_unlock(&srv->key_lock);
+
+    qsort(sorted, n, sizeof(double), compare_double);
+
+    double p[4] = {0, 0, 0, 0};
+    static const double rank[4] = {0.50, 0.90, 0.99, 0.999};
+    for (int k = 0; k < 4 && n > 0; k++)
+    {
+        p[k] = sorted[(size_t)(rank[k] * (double)(n - 1))];
+    }
+
+    int len = snprintf(out, size,
+                       "requests %llu, keys %zu, latency us over last %zu: "
+                       "p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+                       (unsigned long long)requests, nkeys, n, p[0], p[1],
+                       p[2], p[3], n > 0 ? sorted[n - 1] : 0.0);
+    free(sorted);
+
+    return len < 0 ? 0 : ((size_t)len < size ? (size_t)len : size - 1);
+}
+
+/**
+ * @brief Check whether a connection has data waiting, without blocking.
+ *
+ * @param fd  Connected socket.
+ *
+ * @return Non-zero if a read would not block, including on hang-up.
+ */
+static int readable(int fd)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/**
+ * @brief Answer the requests waiting on one connection.
+ *
+ * Requests are answered for as long as the next one has already started
+ * to arrive; the connection is then handed back instead of holding the
+ * worker while the client is idle.
+ *
+ * @param srv  Shared state.
+ * @param fd   Connected socket with a request waiting.
+ * @param buf  Worker payload buffer; grown as needed.
+ * @param cap  Capacity of *buf.
+ * @param ks   Worker stream; allocated on first use.
+ *
+ * @return 0 if the connection is idle and stays open, or -1 if it should
+ *         be closed.
+ */
+static int serve_connection(Server *srv, int fd, uint8_t **buf, size_t *cap,
+                            KStream **ks)
+{
+    do
+    {
+        uint8_t hdr[SERVE_REQUEST_HEADER];
+        if (recv_full(fd, hdr, sizeof(hdr)) != 0)
+        {
+            return -1;
+        }
+
+        double start = now_us();
+        uint64_t len = get_le64(hdr + 9);
+        if (len > SERVE_MAX_MESSAGE)
+        {
+            send_error(fd, "message too large");
+            return -1;
+        }
+        if (len > *cap)
+        {
+            *cap = (size_t)len;
+            *buf = realloc(*buf, *cap);
+            assert(*buf != NULL);
+        }
+        if (len > 0 && recv_full(fd, *buf, (size_t)len) != 0)
+        {
+            return -1;
+        }
+
+        if (hdr[0] == 'S')
+        {
+            char report[SERVE_REPORT];
+            size_t n = format_stats(srv, report, sizeof(report));
+            if (send_reply(fd, 0, (const uint8_t *)report, n) != 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+        if (hdr[0] != 'T')
+        {
+            send_error(fd, "unknown request");
+            return -1;
+        }
+
+        prime_stream(srv, hdr + 1, ks);
+        ks_translate_inplace(*ks, *buf, (size_t)len);
+        if (send_reply(fd, 0, *buf, (size_t)len) != 0)
+        {
+            return -1;
+        }
+
+        double elapsed = now_us() - start;
+        pthread_mutex_lock(&srv->stat_lock);
+        srv->samples[srv->requests % SERVE_SAMPLES] = elapsed;
+        srv->requests++;
+        pthread_mutex_unlock(&srv->stat_lock);
+    } while (readable(fd));
+
+    return 0;
+}
+
+/**
+ * @brief Add a connection to the back of the queue and wake a worker.
+ *
+ * Called with srv->lock held.
+ *
+ * @param srv  Shared state.
+ * @param fd   Connection with a request waiting.
+ */
+static void enqueue(Server *srv, int fd)
+{
+    /* every open connection fits, so the queue cannot overflow */
+    srv->queue[(srv->head + srv->queued) % SERVE_CONNECTIONS] = fd;
+    srv->queued++;
+    pthread_cond_signal(&srv->ready);
+}
+
+/**
+ * @brief Worker thread body: serve queued connections until shutdown.
+ *
+ * @param arg  Pointer to this worker's ServeWorker.
+ *
+ * @return Always NULL.
+ */
+static void *serve_worker(void *arg)
+{
+    ServeWorker *w = arg;
+    Server *srv = w->srv;
+    KStream *ks = NULL;
+    uint8_t *buf = NULL;
+    size_t cap = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&srv->lock);
+        while (srv->queued == 0 && !srv->closing)
+        {
+            pthread_cond_wait(&srv->ready, &srv->lock);
+        }
+        if (srv->queued == 0)
+        {
+            pthread_mutex_unlock(&srv->lock);
+            break;
+        }
+        int fd = srv->queue[srv->head];
+        srv->head = (srv->head + 1) % SERVE_CONNECTIONS;
+        srv->queued--;
+        srv->active[w->id] = fd;
+        pthread_mutex_unlock(&srv->lock);
+
+        int status = serve_connection(srv, fd, &buf, &cap, &ks);
+
+        pthread_mutex_lock(&srv->lock);
+        srv->active[w->id] = -1;
+        if (status == 0 && !srv->closing)
+        {
+            srv->idle[srv->nidle++] = fd;
+        }
+        else
+        {
+            close(fd);
+            srv->open--;
+            status = -1;
+        }
+        pthread_mutex_unlock(&srv->lock);
+
+        if (status == 0)
+        {
+            /* the pipe is non-blocking; a full pipe wakes the loop anyway */
+            ssize_t rc = write(srv->wake[1], "", 1);
+            (void)rc;
+        }
+    }
+
+    free(buf);
+    ks_destroy(ks);
+    return NULL;
+}
+
+/**
+ * @brief Fill in a Unix socket address.
+ *
+ * @param path  Socket path.
+ * @param addr  Receives the address.
+ *
+ * @return 0 on success, or -1 after printing a message if `path` is too
+ *         long.
+ */
+static int socket_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        fprintf(stderr, "error: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * @brief Create the listening socket, replacing a stale one.
+ *
+ * A leftover socket file is removed only if nothing answers on it.
+ *
+ * @param path  Socket path.
+ *
+ * @return The listening descriptor, or -1 after printing a message.
+ */
+static int listen_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) != 0)
+    {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (rc != 0 && errno == EADDRINUSE)
+    {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int live = probe >= 0 &&
+                   connect(probe, (struct sockaddr *)&addr,
+                           sizeof(addr)) == 0;
+        if (probe >= 0)
+        {
+            close(probe);
+        }
+        if (live)
+        {
+            fprintf(stderr, "error: %s is already being served\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+        rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+
+    if (rc != 0 || chmod(path, 0600) != 0 || listen(fd, SERVE_QUEUE) != 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Serve translate requests until SIGINT or SIGTERM.
+ *
+ * @param path  Path of the Unix socket to create.
+ * @param jobs  Number of worker threads, or 0 for one per online CPU.
+ *
+ * @return 0 on a clean shutdown, or -1 after printing a message.
+ */
+int serve_run(const char *path, int jobs)
+{
+    int lfd = listen_socket(path);
+    if (lfd < 0)
+    {
+        return -1;
+    }
+
+    if (jobs <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+
+    Server *srv = calloc(1, sizeof(Server));
+    assert(srv != NULL);
+    srv->samples = malloc(SERVE_SAMPLES * sizeof(double));
+    assert(srv->samples != NULL);
+    srv->active = malloc((size_t)jobs * sizeof(int));
+    assert(srv->active != NULL);
+    pthread_mutex_init(&srv->key_lock, NULL);
+    pthread_mutex_init(&srv->stat_lock, NULL);
+    pthread_mutex_init(&srv->lock, NULL);
+    pthread_cond_init(&srv->ready, NULL);
+    if (pipe(srv->wake) != 0)
+    {
+        perror("pipe");
+        srv->wake[0] = srv->wake[1] = -1;
+    }
+    for (int n = 0; n < 2 && srv->wake[n] >= 0; n++)
+    {
+        fcntl(srv->wake[n], F_SETFL, O_NONBLOCK);
+        fcntl(srv->wake[n], F_SETFD, FD_CLOEXEC);
+    }
+
+    /* the listening socket, the wake pipe, then the idle connections */
+    struct pollfd *pfds = malloc((2 + SERVE_CONNECTIONS) *
+                                 sizeof(struct pollfd));
+    assert(pfds != NULL);
+
+    ServeWorker *workers = malloc((size_t)jobs * sizeof(ServeWorker));
+    pthread_t *threads = malloc((size_t)jobs * sizeof(pthread_t));
+    assert(workers != NULL && threads != NULL);
+
+    int started = 0;
+    for (; started < jobs; started++)
+    {
+        workers[started].srv = srv;
+        workers[started].id = started;
+        srv->active[started] = -1;
+        if (pthread_create(&threads[started], NULL, serve_worker,
+                           &workers[started]) != 0)
+        {
+            break;
+        }
+    }
+
+    int status = srv->wake[0] >= 0 ? 0 : -1;
+    if (status == 0 && started == 0)
+    {
+        fprintf(stderr, "error: could not start service threads\n");
+        status = -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (status == 0)
+    {
+        fprintf(stderr, "serve: listening on %s with %d threads\n", path,
+                started);
+    }
+
+    while (status == 0 && !serve_stop)
+    {
+        pfds[0] = (struct pollfd){lfd, POLLIN, 0};
+        pfds[1] = (struct pollfd){srv->wake[0], POLLIN, 0};
+        pthread_mutex_lock(&srv->lock);
+        size_t nidle = srv->nidle;
+        for (size_t n = 0; n < nidle; n++)
+        {
+            pfds[2 + n] = (struct pollfd){srv->idle[n], POLLIN, 0};
+        }
+        pthread_mutex_unlock(&srv->lock);
+
+        /* poll with a timeout so a signal between checks is not missed */
+        int ready = poll(pfds, 2 + nidle, 500);
+        if (ready <= 0)
+        {
+            if (ready < 0 && errno != EINTR)
+            {
+                perror("poll");
+                status = -1;
+            }
+            continue;
+        }
+
+        if (pfds[1].revents != 0)
+        {
+            char drain[64];
+            while (read(srv->wake[0], drain, sizeof(drain)) > 0)
+            {
+            }
+        }
+
+        /*
+         * Workers only append to idle, so the first nidle entries are the
+         * ones polled; walking down keeps the unvisited ones in place.
+         */
+        pthread_mutex_lock(&srv->lock);
+        for (size_t n = nidle; n-- > 0;)
+        {
+            if (pfds[2 + n].revents != 0)
+            {
+                enqueue(srv, srv->idle[n]);
+                srv->idle[n] = srv->idle[--srv->nidle];
+            }
+        }
+        pthread_mutex_unlock(&srv->lock);
+
+        if (pfds[0].revents == 0)
+        {
+            continue;
+        }
+        int cfd = accept(lfd, NULL, NULL);
+        if (cfd < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                perror("accept");
+                status = -1;
+            }
+            continue;
+        }
+
+        /* a client that stalls mid-request must not hold its worker */
+        struct timeval tv = {SERVE_RECV_TIMEOUT, 0};
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        pthread_mutex_lock(&srv->lock);
+        if (srv->open == SERVE_CONNECTIONS)
+        {
+            pthread_mutex_unlock(&srv->lock);
+            send_error(cfd, "server busy");
+            close(cfd);
+            continue;
+        }
+        srv->open++;
+        enqueue(srv, cfd);
+        pthread_mutex_unlock(&srv->lock);
+    }
+
+    /* drop waiting connections and wake workers blocked on clients */
+    pthread_mutex_lock(&srv->lock);
+    srv->closing = 1;
+    for (; srv->queued > 0; srv->queued--)
+    {
+        close(srv->queue[srv->head]);
+        srv->head = (srv->head + 1) % SERVE_CONNECTIONS;
+    }
+    for (; srv->nidle > 0; srv->nidle--)
+    {
+        close(srv->idle[srv->nidle - 1]);
+    }
+    for (int n = 0; n < started; n++)
+    {
+        if (srv->active[n] >= 0)
+        {
+            shutdown(srv->active[n], SHUT_RD);
+        }
+    }
+    pthread_cond_broadcast(&srv->ready);
+    pthread_mutex_unlock(&srv->lock);
+
+    for (int n = 0; n < started; n++)
+    {
+        pthread_join(threads[n], NULL);
+    }
+
+    char report[SERVE_REPORT];
+    format_stats(srv, report, sizeof(report));
+    fprintf(stderr, "serve: %s", report);
+
+    close(lfd);
+    unlink(path);
+    for (int n = 0; n < 2; n++)
+    {
+        if (srv->wake[n] >= 0)
+        {
+            close(srv->wake[n]);
+        }
+    }
+    free(pfds);
+
+    for (size_t n = 0; n < SERVE_KEYS; n++)
+    {
+        ks_destroy(srv->keys[n].ks);
+    }
+    pthread_cond_destroy(&srv->ready);
+    pthread_mutex_destroy(&srv->lock);
+    pthread_mutex_destroy(&srv->stat_lock);
+    pthread_mutex_destroy(&srv->key_lock);
+    free(threads);
+    free(workers);
+    free(srv->active);
+    free(srv->samples);
+    free(srv);
+
+    return status;
+}
+
+/**
+ * @brief Connect to a running service.
+ *
+ * @param path  Path of the service socket.
+ *
+ * @return The connected descriptor, or -1 after printing a message.
+ */
+static int connect_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) != 0)
+    {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Send one request and receive its response.
+ *
+ * @param fd       Connected socket.
+ * @param op       Request op byte.
+ * @param key      Key bytes.
+ * @param payload  Request payload.
+ * @param len      Payload length.
+ * @param out      Receives the heap-allocated response payload.
+ * @param outlen   Receives the response length.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+static int round_trip(int fd, uint8_t op, const uint8_t key[8],
+                      const uint8_t *payload, size_t len, uint8_t **out,
+                      size_t *outlen)
+{
+    uint8_t req[SERVE_REQUEST_HEADER];
+    req[0] = op;
+    memcpy(req + 1, key, 8);
+
+    uint8_t resp[SERVE_RESPONSE_HEADER];
+    if (send_message(fd, req, sizeof(req), payload, len) != 0 ||
+        recv_full(fd, resp, sizeof(resp)) != 0)
+    {
+        fprintf(stderr, "error: lost connection to the service\n");
+        return -1;
+    }
+
+    uint64_t n = get_le64(resp + 1);
+    if (n > SERVE_MAX_MESSAGE)
+    {
+        fprintf(stderr, "error: bad response from the service\n");
+        return -1;
+    }
+    uint8_t *data = malloc(n > 0 ? (size_t)n : 1);
+    assert(data != NULL);
+    if (n > 0 && recv_full(fd, data, (size_t)n) != 0)
+    {
+        fprintf(stderr, "error: lost connection to the service\n");
+        free(data);
+        return -1;
+    }
+
+    if (resp[0] != 0)
+    {
+        fprintf(stderr, "error: service: %.*s\n", (int)n, (char *)data);
+        free(data);
+        return -1;
+    }
+
+    *out = data;
+    *outlen = (size_t)n;
+    return 0;
+}
+
+/**
+ * @brief Read a whole file into memory.
+ *
+ * @param path  Path of the file.
+ * @param len   Receives the file length.
+ *
+ * @return Heap-allocated contents, or NULL after printing a message.
+ */
+static uint8_t *read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        perror("input-file");
+        return NULL;
+    }
+
+    size_t cap = 64 * 1024;
+    size_t n = 0;
+    uint8_t *data = malloc(cap);
+    assert(data != NULL);
+    for (;;)
+    {
+        n += fread(data + n, 1, cap - n, f);
+        if (n < cap || n > SERVE_MAX_MESSAGE)
+        {
+            break;
+        }
+        cap *= 2;
+        data = realloc(data, cap);
+        assert(data != NULL);
+    }
+
+    int bad = ferror(f);
+    fclose(f);
+    if (bad || n > SERVE_MAX_MESSAGE)
+    {
+        fprintf(stderr, bad ? "error: could not read entire input file\n"
+                            : "error: input too large for the service\n");
+        free(data);
+        return NULL;
+    }
+
+    *len = n;
+    return data;
+}
+
+/**
+ * @brief Translate a file through a running service.
+ *
+ * @param path      Path of the service socket.
+ * @param keybytes  Key read from the key file.
+ * @param infile    Path of the input file.
+ * @param outfile   Path of the output file, or "-" for stdout.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int serve_client(const char *path, const uint8_t keybytes[8],
+                 const char *infile, const char *outfile)
+{
+    size_t len;
+    uint8_t *data = read_file(infile, &len);
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    int fd = connect_socket(path);
+    if (fd < 0)
+    {
+        free(data);
+        return -1;
+    }
+
+    uint8_t *result;
+    size_t rlen;
+    int status = round_trip(fd, 'T', keybytes, data, len, &result, &rlen);
+    close(fd);
+    free(data);
+    if (status != 0)
+    {
+        return -1;
+    }
+
+    if (outfile[0] == '-' && outfile[1] == '\0')
+    {
+        status = mio_write_text(stdout, result, rlen);
+    }
+    else
+    {
+        FILE *out = fopen(outfile, "wb");
+        if (!out)
+        {
+            perror("output-file");
+            status = -1;
+        }
+        else if (fwrite(result, 1, rlen, out) != rlen || fclose(out) != 0)
+        {
+            fprintf(stderr, "error: failed to write output file\n");
+            status = -1;
+        }
+    }
+
+    free(result);
+    return status;
+}
+
+/**
+ * @brief Print the latency statistics of a running service on stdout.
+ *
+ * @param path  Path of the service socket.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int serve_client_stats(const char *path)
+{
+    int fd = connect_socket(path);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    static const uint8_t nokey[8] = {0};
+    uint8_t *report;
+    size_t len;
+    int status = round_trip(fd, 'S', nokey, NULL, 0, &report, &len);
+    close(fd);
+    if (status != 0)
+    {
+        return -1;
+    }
+
+    fwrite(report, 1, len, stdout);
+    free(report);
+    return 0;
+}
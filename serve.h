@@ -0,0 +1,74 @@
+/**
+ * @file serve.h
+ * @author Shane Girolamo
+ *
+ * @brief Long-running translation service on a Unix socket.
+ *
+ * `mcrypt --serve=SOCKET` keeps primed KStream templates in memory, one
+ * per key seen, so a request skips process start-up, the key file and
+ * the key schedule. Connections are handed to a pool of worker threads.
+ * A connection may carry any number of requests, and holds a worker only
+ * while a request is being answered, so idle clients do not hold up
+ * others.
+ *
+ * Protocol, all integers little-endian:
+ *
+ *      request:   u8 op  8 key bytes  u64 length  length bytes
+ *      response:  u8 status  u64 length  length bytes
+ *
+ * Op 'T' translates the payload under the key. Op 'S' ignores key and
+ * payload and returns the latency statistics as text. A non-zero status
+ * carries an error message as payload. Clients read the key file
+ * themselves, so the service never opens paths named by a client.
+ */
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdint.h>
+
+/**
+ * @brief Largest payload accepted in one request.
+ */
+#define SERVE_MAX_MESSAGE (64 * 1024 * 1024)
+
+/**
+ * @brief Serve translate requests until SIGINT or SIGTERM.
+ *
+ * On shutdown the latency statistics are printed on stderr and the
+ * socket is removed.
+ *
+ * @param path  Path of the Unix socket to create.
+ * @param jobs  Number of worker threads, or 0 for one per online CPU.
+ *
+ * @return 0 on a clean shutdown, or -1 after printing a message.
+ */
+int serve_run(const char *path, int jobs);
+
+/**
+ * @brief Translate a file through a running service.
+ *
+ * @param path      Path of the service socket.
+ * @param keybytes  Key read from the key file.
+ * @param infile    Path of the input file.
+ * @param outfile   Path of the output file, or "-" for stdout using the
+ *                  ASCII/hex rules.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int serve_client(const char *path, const uint8_t keybytes[8],
+                 const char *infile, const char *outfile);
+
+/**
+ * @brief Print the latency statistics of a running service on stdout.
+ *
+ * @param path  Path of the service socket.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+int serve_client_stats(const char *path);
+
+/**
+ * @brief End of the SERVE_H include guard.
+ */
+#endif
@@ -0,0 +1,121 @@
+/**
+ * @file stats.h
+ * @author Shane Girolamo
+ *
+ * @brief Compile-time optional counters for the hot paths.
+ *
+ * Building with -DKS_STATS (make STATS=1) turns the macros below into
+ * relaxed atomic updates and monotonic clock reads. Without it every
+ * macro expands to nothing, so instrumented code costs nothing in a
+ * normal build. Counters are updated once per call or per buffer, never
+ * per byte.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#ifdef KS_STATS
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief Current monotonic time in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary starting point.
+ */
+static inline uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Raise a counter to at least `v`.
+ *
+ * @param var  Counter to update.
+ * @param v    Candidate maximum.
+ */
+static inline void stats_max(uint64_t *var, uint64_t v)
+{
+    uint64_t cur = __atomic_load_n(var, __ATOMIC_RELAXED);
+    while (cur < v &&
+           !__atomic_compare_exchange_n(var, &cur, v, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+    {
+    }
+}
+
+/**
+ * @brief Add `n` to a counter.
+ */
+#define STAT_ADD(var, n) \
+    ((void)__atomic_fetch_add(&(var), (uint64_t)(n), __ATOMIC_RELAXED))
+
+/**
+ * @brief Subtract `n` from a counter.
+ */
+#define STAT_SUB(var, n) \
+    ((void)__atomic_fetch_sub(&(var), (uint64_t)(n), __ATOMIC_RELAXED))
+
+/**
+ * @brief Add `n` to a gauge and record its new high-water mark in `peak`.
+ */
+#define STAT_GAUGE_ADD(var, peak, n) \
+    stats_max(&(peak), \
+              __atomic_add_fetch(&(var), (uint64_t)(n), __ATOMIC_RELAXED))
+
+/**
+ * @brief Declare and start a timer named `t`.
+ */
+#define STAT_TIMER(t) uint64_t t = stats_now_ns()
+
+/**
+ * @brief Add the time since timer `t` started to a counter.
+ */
+#define STAT_ELAPSED(var, t) STAT_ADD(var, stats_now_ns() - (t))
+
+/**
+ * @brief Read a counter that other threads may be updating.
+ */
+#define STAT_LOAD(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+#else
+
+/**
+ * @brief Add `n` to a counter; disabled.
+ */
+#define STAT_ADD(var, n) ((void)0)
+
+/**
+ * @brief Subtract `n` from a counter; disabled.
+ */
+#define STAT_SUB(var, n) ((void)0)
+
+/**
+ * @brief Add `n` to a gauge and track its peak; disabled.
+ */
+#define STAT_GAUGE_ADD(var, peak, n) ((void)0)
+
+/**
+ * @brief Declare and start a timer; disabled.
+ */
+#define STAT_TIMER(t) ((void)0)
+
+/**
+ * @brief Add the time since a timer started to a counter; disabled.
+ */
+#define STAT_ELAPSED(var, t) ((void)0)
+
+/**
+ * @brief Read a counter; disabled.
+ */
+#define STAT_LOAD(var) ((uint64_t)0)
+
+#endif
+
+/**
+ * @brief End of the STATS_H include guard.
+ */
+#endif
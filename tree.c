@@ -0,0 +1,1039 @@
+/**
+ * @file tree.c
+ * @author Shane Girolamo
+ *
+ * @brief Implementation of the recursive directory mode.
+ *
+ * The calling thread walks the source tree and turns files into tasks:
+ * a bundle of small files, one whole file, or one container segment.
+ * Tasks are handed round-robin to the workers' queues. Each worker takes
+ * the newest task from its own queue and, when that is empty, steals the
+ * oldest task of another worker, so an uneven mix of sizes evens out
+ * without a central queue. Every queue has its own lock.
+ *
+ * The number of queued tasks is bounded: the walker sleeps while the
+ * queues are full, so memory for paths stays small however many files
+ * the tree holds. Sleeping follows the scheme of prefetch.c: a side that
+ * must wait raises a flag and checks once more under the lock, the other
+ * side checks the flag after every update of the shared count.
+ *
+ * Container segments open their files themselves, so a large file holds
+ * no descriptors between its segments. The last segment to finish
+ * completes the file.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "tree.h"
+#include "affinity.h"
+#include "container.h"
+#include "mio.h"
+#include "KStream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Most small files in one bundle.
+ */
+#define TREE_BUNDLE_FILES 64
+
+/**
+ * @brief Most bytes of file data in one bundle.
+ */
+#define TREE_BUNDLE_BYTES ((size_t)1024 * 1024)
+
+/**
+ * @brief Queued tasks allowed per worker before the walker waits.
+ */
+#define TREE_QUEUE_PER_WORKER 16
+
+/**
+ * @brief Interval between progress lines, in seconds.
+ */
+#define TREE_PROGRESS_SECS 1
+
+/**
+ * @brief One file to translate.
+ */
+typedef struct
+{
+    char *in;      /**< Source path. */
+    char *out;     /**< Destination path. */
+    uint64_t size; /**< Size seen by the walker. */
+} TreeFile;
+
+/**
+ * @brief A large file whose container segments run as separate tasks.
+ */
+typedef struct
+{
+    TreeFile file;      /**< Paths and size. */
+    ContainerPlan plan; /**< Layout of the container. */
+    uint64_t left;      /**< Segments not finished yet. */
+    int failed;         /**< Set once a segment has failed. */
+} TreeLarge;
+
+/**
+ * @brief Kinds of task.
+ */
+typedef enum
+{
+    TASK_BUNDLE,  /**< Several small files, translated together. */
+    TASK_FILE,    /**< One file, translated as a plain stream. */
+    TASK_SEGMENT  /**< One segment of a container. */
+} TreeTaskKind;
+
+/**
+ * @brief One unit of work.
+ */
+typedef struct
+{
+    TreeTaskKind kind; /**< What to do. */
+    TreeFile *files;   /**< Files of a bundle or file task; owned. */
+    size_t count;      /**< Number of files. */
+    TreeLarge *large;  /**< File of a segment task. */
+    uint64_t segment;  /**< Segment index of a segment task. */
+} TreeTask;
+
+/**
+ * @brief Task queue of one worker.
+ *
+ * `top` and `bottom` are free-running; the tasks are at positions
+ * [top, bottom) of the ring. The owner pushes and pops at the bottom,
+ * thieves take from the top.
+ */
+typedef struct
+{
+    TreeTask *items;      /**< Ring of tasks. */
+    size_t cap;           /**< Ring size, a power of two. */
+    size_t top;           /**< Oldest task. */
+    size_t bottom;        /**< One past the newest task. */
+    pthread_mutex_t lock; /**< Protects the queue. */
+} TreeDeque;
+
+/**
+ * @brief State shared by the walker, the workers and the progress thread.
+ */
+typedef struct
+{
+    const uint8_t *keybytes; /**< Key read from the key file. */
+    KStream *primed;         /**< Primed stream for plain translations. */
+    uint64_t segsize;        /**< Container segment size. */
+    int extract;             /**< Extract rather than create containers. */
+    dev_t dst_dev;           /**< Device of the destination root. */
+    ino_t dst_ino;           /**< Inode of the destination root. */
+
+    TreeDeque *deques;       /**< One queue per worker. */
+    int workers;             /**< Number of queues. */
+    int started;             /**< Workers that have claimed a queue. */
+    size_t next_deque;       /**< Queue for the next task; walker only. */
+    long limit;              /**< Queued tasks at which the walker waits. */
+    long queued;             /**< Tasks pushed and not yet taken. */
+    int sleepers;            /**< Workers waiting for tasks. */
+    int walker_waiting;      /**< Walker waiting for queue space. */
+    int walk_done;           /**< Set when every task has been pushed. */
+    int finished;            /**< Set when every worker has returned. */
+    pthread_mutex_t lock;    /**< Guards sleeping, waking, the flags. */
+    pthread_cond_t work;     /**< Workers wait here for tasks. */
+    pthread_cond_t space;    /**< The walker waits here for space. */
+    pthread_cond_t done;     /**< The progress thread waits here. */
+
+    TreeFile *bundle;        /**< Small files not yet pushed. */
+    size_t bundle_count;     /**< Files in bundle. */
+    size_t bundle_bytes;     /**< Bytes in bundle. */
+
+    uint64_t files_total;    /**< Files found so far. */
+    uint64_t bytes_total;    /**< Bytes found so far. */
+    uint64_t files_done;     /**< Files finished. */
+    uint64_t bytes_done;     /**< Bytes translated. */
+    uint64_t failed;         /**< Files that failed. */
+    uint64_t skipped;        /**< Entries that are not regular files. */
+    uint64_t containers;     /**< Files handled as containers. */
+    uint64_t steals;         /**< Tasks taken from another worker. */
+    struct timespec start;   /**< Start of the run. */
+} TreeRun;
+
+/**
+ * @brief Per-thread resources of a worker.
+ */
+typedef struct
+{
+    KStream *ks;                          /**< Stream for one file. */
+    KStream *streams[TREE_BUNDLE_FILES];  /**< Streams for a bundle. */
+    uint8_t *buf;                         /**< TREE_BUNDLE_BYTES of data. */
+} TreeWorker;
+
+/**
+ * @brief Join a directory and a name into a new path.
+ *
+ * @param dir   Directory path.
+ * @param name  Entry name.
+ *
+ * @return Heap-allocated "dir/name".
+ */
+static char *join_path(const char *dir, const char *name)
+{
+    size_t dlen = strlen(dir);
+    size_t nlen = strlen(name);
+    char *path = malloc(dlen + nlen + 2);
+    assert(path != NULL);
+    memcpy(path, dir, dlen);
+    path[dlen] = '/';
+    memcpy(path + dlen + 1, name, nlen + 1);
+    return path;
+}
+
+/**
+ * @brief Seconds since the start of the run.
+ *
+ * @param run  The run.
+ *
+ * @return Elapsed time in seconds.
+ */
+static double elapsed(const TreeRun *run)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - run->start.tv_sec) +
+           (double)(now.tv_nsec - run->start.tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Add a task at the bottom of a queue, growing it if full.
+ *
+ * @param dq    The queue.
+ * @param task  Task to add.
+ */
+static void deque_push(TreeDeque *dq, const TreeTask *task)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom - dq->top == dq->cap)
+    {
+        size_t cap = dq->cap * 2;
+        TreeTask *items = malloc(cap * sizeof(TreeTask));
+        assert(items != NULL);
+        for (size_t n = dq->top; n != dq->bottom; n++)
+        {
+            items[n & (cap - 1)] = dq->items[n & (dq->cap - 1)];
+        }
+        free(dq->items);
+        dq->items = items;
+        dq->cap = cap;
+    }
+    dq->items[dq->bottom & (dq->cap - 1)] = *task;
+    dq->bottom++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/**
+ * @brief Take a task from one end of a queue.
+ *
+ * @param dq      The queue.
+ * @param task    Receives the task.
+ * @param newest  Nonzero to take the newest task, as the owner does;
+ *                zero to take the oldest, as a thief does.
+ *
+ * @return 1 if a task was taken, or 0 if the queue was empty.
+ */
+static int deque_take(TreeDeque *dq, TreeTask *task, int newest)
+{
+    int got = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom != dq->top)
+    {
+        size_t pos = newest ? --dq->bottom : dq->top++;
+        *task = dq->items[pos & (dq->cap - 1)];
+        got = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return got;
+}
+
+/**
+ * @brief Queue a task, waiting while the queues are full.
+ *
+ * @param run   The run.
+ * @param task  Task to queue.
+ */
+static void push_task(TreeRun *run, const TreeTask *task)
+{
+    if (__atomic_load_n(&run->queued, __ATOMIC_SEQ_CST) >= run->limit)
+    {
+        pthread_mutex_lock(&run->lock);
+        __atomic_store_n(&run->walker_waiting, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&run->queued, __ATOMIC_SEQ_CST) >=
+               run->limit)
+        {
+            pthread_cond_wait(&run->space, &run->lock);
+        }
+        __atomic_store_n(&run->walker_waiting, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&run->lock);
+    }
+
+    /* counted before it is visible, so queued never undercounts */
+    __atomic_add_fetch(&run->queued, 1, __ATOMIC_SEQ_CST);
+    deque_push(&run->deques[run->next_deque], task);
+    run->next_deque = (run->next_deque + 1) % (size_t)run->workers;
+
+    if (__atomic_load_n(&run->sleepers, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&run->lock);
+        pthread_cond_signal(&run->work);
+        pthread_mutex_unlock(&run->lock);
+    }
+}
+
+/**
+ * @brief Take the next task for a worker, stealing if its queue is empty.
+ *
+ * @param run   The run.
+ * @param self  Index of the worker's own queue.
+ * @param task  Receives the task.
+ *
+ * @return 1 if a task was taken, or 0 once there is no work left.
+ */
+static int take_task(TreeRun *run, int self, TreeTask *task)
+{
+    for (;;)
+    {
+        int got = deque_take(&run->deques[self], task, 1);
+        for (int k = 1; !got && k < run->workers; k++)
+        {
+            got = deque_take(&run->deques[(self + k) % run->workers],
+                             task, 0);
+            if (got)
+            {
+                __atomic_add_fetch(&run->steals, 1, __ATOMIC_RELAXED);
+            }
+        }
+
+        if (got)
+        {
+            __atomic_sub_fetch(&run->queued, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&run->walker_waiting, __ATOMIC_SEQ_CST))
+            {
+                pthread_mutex_lock(&run->lock);
+                pthread_cond_signal(&run->space);
+                pthread_mutex_unlock(&run->lock);
+            }
+            return 1;
+        }
+
+        pthread_mutex_lock(&run->lock);
+        __atomic_add_fetch(&run->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&run->queued, __ATOMIC_SEQ_CST) == 0 &&
+               !run->walk_done)
+        {
+            pthread_cond_wait(&run->work, &run->lock);
+        }
+        __atomic_sub_fetch(&run->sleepers, 1, __ATOMIC_SEQ_CST);
+        int over = run->walk_done &&
+                   __atomic_load_n(&run->queued, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&run->lock);
+        if (over)
+        {
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief Account for one finished file.
+ *
+ * @param run     The run.
+ * @param file    The file.
+ * @param status  0 if it was translated, -1 if it failed.
+ */
+static void file_done(TreeRun *run, const TreeFile *file, int status)
+{
+    if (status != 0)
+    {
+        fprintf(stderr, "error: %s failed\n", file->in);
+        __atomic_add_fetch(&run->failed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&run->files_done, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Release the paths of a file.
+ *
+ * @param file  The file.
+ */
+static void free_file(TreeFile *file)
+{
+    free(file->in);
+    free(file->out);
+}
+
+/**
+ * @brief Create a file holding exactly `len` bytes.
+ *
+ * @param path  Path of the file.
+ * @param buf   Contents.
+ * @param len   Number of bytes.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+static int write_whole(const char *path, const uint8_t *buf, size_t len)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        done += (size_t)n;
+    }
+
+    if (close(fd) != 0)
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Translate one file as a plain stream.
+ *
+ * @param run   The run.
+ * @param w     The worker.
+ * @param file  The file.
+ *
+ * @return 0 on success, or -1 after printing a message on failure.
+ */
+static int translate_one(TreeRun *run, TreeWorker *w, const TreeFile *file)
+{
+    if (w->ks == NULL)
+    {
+        w->ks = ks_clone(run->primed);
+    }
+    else
+    {
+        ks_copy(w->ks, run->primed);
+    }
+    return mio_translate_file(w->ks, file->in, file->out, MIO_AUTO);
+}
+
+/**
+ * @brief Translate a bundle of small files with one ks_translate_multi().
+ *
+ * A file whose size no longer matches what the walker saw is translated
+ * on its own instead.
+ *
+ * @param run    The run.
+ * @param w      The worker.
+ * @param files  The files.
+ * @param count  Number of files, at most TREE_BUNDLE_FILES.
+ */
+static void translate_bundle(TreeRun *run, TreeWorker *w, TreeFile *files,
+                             size_t count)
+{
+    if (w->buf == NULL)
+    {
+        w->buf = malloc(TREE_BUNDLE_BYTES);
+        assert(w->buf != NULL);
+        for (size_t k = 0; k < TREE_BUNDLE_FILES; k++)
+        {
+            w->streams[k] = ks_clone(run->primed);
+        }
+    }
+
+    uint8_t *data[TREE_BUNDLE_FILES];
+    size_t len[TREE_BUNDLE_FILES];
+    int status[TREE_BUNDLE_FILES];
+    size_t off = 0;
+
+    for (size_t k = 0; k < count; k++)
+    {
+        data[k] = w->buf + off;
+        len[k] = 0;
+        status[k] = 0;
+
+        int fd = open(files[k].in, O_RDONLY);
+        struct stat st;
+        if (fd < 0)
+        {
+            perror(files[k].in);
+            status[k] = -1;
+            continue;
+        }
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+            (uint64_t)st.st_size != files[k].size)
+        {
+            close(fd);
+            status[k] = translate_one(run, w, &files[k]);
+            status[k] = status[k] == 0 ? 1 : -1;
+            continue;
+        }
+
+        len[k] = (size_t)files[k].size;
+        if (mio_read_full(fd, data[k], len[k]) != (ssize_t)len[k])
+        {
+            perror(files[k].in);
+            status[k] = -1;
+        }
+        close(fd);
+        off += len[k];
+    }
+
+    /* only the files read whole take part; the rest are done already */
+    uint8_t *live_data[TREE_BUNDLE_FILES];
+    size_t live_len[TREE_BUNDLE_FILES];
+    size_t live = 0;
+    for (size_t k = 0; k < count; k++)
+    {
+        if (status[k] == 0)
+        {
+            ks_copy(w->streams[live], run->primed);
+            live_data[live] = data[k];
+            live_len[live] = len[k];
+            live++;
+        }
+    }
+    ks_translate_multi(w->streams, (const uint8_t *const *)live_data,
+                       live_data, live_len, live);
+
+    uint64_t bytes = 0;
+    for (size_t k = 0; k < count; k++)
+    {
+        if (status[k] == 0)
+        {
+            status[k] = write_whole(files[k].out, data[k], len[k]);
+        }
+        bytes += files[k].size;
+        file_done(run, &files[k], status[k] < 0 ? -1 : 0);
+    }
+    __atomic_add_fetch(&run->bytes_done, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Run one task and release it.
+ *
+ * @param run   The run.
+ * @param w     The worker.
+ * @param task  The task.
+ */
+static void run_task(TreeRun *run, TreeWorker *w, TreeTask *task)
+{
+    if (task->kind == TASK_SEGMENT)
+    {
+        TreeLarge *large = task->large;
+        int status = container_run_segment(run->keybytes, &large->plan,
+                                           large->file.in, large->file.out,
+                                           task->segment);
+        if (status != 0)
+        {
+            __atomic_store_n(&large->failed, 1, __ATOMIC_RELAXED);
+        }
+
+        uint64_t start = task->segment * large->plan.segsize;
+        uint64_t n = large->plan.length - start;
+        if (n > large->plan.segsize)
+        {
+            n = large->plan.segsize;
+        }
+        __atomic_add_fetch(&run->bytes_done, n, __ATOMIC_RELAXED);
+
+        if (__atomic_sub_fetch(&large->left, 1, __ATOMIC_ACQ_REL) == 0)
+        {
+            file_done(run, &large->file,
+                      __atomic_load_n(&large->failed, __ATOMIC_RELAXED)
+                          ? -1
+                          : 0);
+            free_file(&large->file);
+            free(large);
+        }
+        return;
+    }
+
+    if (task->kind == TASK_BUNDLE)
+    {
+        translate_bundle(run, w, task->files, task->count);
+    }
+    else
+    {
+        int status = translate_one(run, w, &task->files[0]);
+        __atomic_add_fetch(&run->bytes_done, task->files[0].size,
+                           __ATOMIC_RELAXED);
+        file_done(run, &task->files[0], status);
+    }
+
+    for (size_t k = 0; k < task->count; k++)
+    {
+        free_file(&task->files[k]);
+    }
+    free(task->files);
+}
+
+/**
+ * @brief Worker thread body: run tasks until the tree is done.
+ *
+ * @param arg  Pointer to the shared TreeRun.
+ *
+ * @return Always NULL.
+ */
+static void *tree_worker(void *arg)
+{
+    TreeRun *run = arg;
+    int self = __atomic_fetch_add(&run->started, 1, __ATOMIC_RELAXED) %
+               run->workers;
+    affinity_pin_worker(self);
+
+    TreeWorker w;
+    memset(&w, 0, sizeof(w));
+
+    TreeTask task;
+    while (take_task(run, self, &task))
+    {
+        run_task(run, &w, &task);
+    }
+
+    ks_destroy(w.ks);
+    if (w.buf != NULL)
+    {
+        for (size_t k = 0; k < TREE_BUNDLE_FILES; k++)
+        {
+            ks_destroy(w.streams[k]);
+        }
+        free(w.buf);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Redraw the progress line; called with the run's lock held.
+ *
+ * @param run  The run.
+ */
+static void print_progress(TreeRun *run)
+{
+    uint64_t bytes = __atomic_load_n(&run->bytes_done, __ATOMIC_RELAXED);
+    double secs = elapsed(run);
+    fprintf(stderr, "tree: %llu of %llu%s files, %.1f of %.1f MB, "
+                    "%.1f MB/s\r",
+            (unsigned long long)__atomic_load_n(&run->files_done,
+                                                __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&run->files_total,
+                                                __ATOMIC_RELAXED),
+            run->walk_done ? "" : "+",
+            (double)bytes / 1e6,
+            (double)__atomic_load_n(&run->bytes_total, __ATOMIC_RELAXED) /
+                1e6,
+            secs > 0 ? (double)bytes / 1e6 / secs : 0.0);
+}
+
+/**
+ * @brief Progress thread body: report about once a second until done.
+ *
+ * @param arg  Pointer to the shared TreeRun.
+ *
+ * @return Always NULL.
+ */
+static void *tree_progress(void *arg)
+{
+    TreeRun *run = arg;
+    int printed = 0;
+
+    pthread_mutex_lock(&run->lock);
+    while (!run->finished)
+    {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += TREE_PROGRESS_SECS;
+        while (!run->finished &&
+               pthread_cond_timedwait(&run->done, &run->lock, &until) == 0)
+        {
+        }
+        if (!run->finished)
+        {
+            print_progress(run);
+            printed = 1;
+        }
+    }
+    pthread_mutex_unlock(&run->lock);
+
+    if (printed)
+    {
+        fputc('\n', stderr);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Push the pending bundle of small files, if any.
+ *
+ * @param run  The run.
+ */
+static void flush_bundle(TreeRun *run)
+{
+    if (run->bundle_count == 0)
+    {
+        return;
+    }
+
+    TreeTask task;
+    task.kind = TASK_BUNDLE;
+    task.files = run->bundle;
+    task.count = run->bundle_count;
+    task.large = NULL;
+    task.segment = 0;
+    push_task(run, &task);
+
+    run->bundle = malloc(TREE_BUNDLE_FILES * sizeof(TreeFile));
+    assert(run->bundle != NULL);
+    run->bundle_count = 0;
+    run->bundle_bytes = 0;
+}
+
+/**
+ * @brief Queue a large file as one task per container segment.
+ *
+ * @param run   The run.
+ * @param file  The file; its paths now belong to the run.
+ * @param plan  Layout of its container.
+ */
+static void push_segments(TreeRun *run, const TreeFile *file,
+                          const ContainerPlan *plan)
+{
+    __atomic_add_fetch(&run->containers, 1, __ATOMIC_RELAXED);
+    if (plan->count == 0)
+    {
+        TreeFile done = *file;
+        file_done(run, &done, 0);
+        free_file(&done);
+        return;
+    }
+
+    TreeLarge *large = malloc(sizeof(TreeLarge));
+    assert(large != NULL);
+    large->file = *file;
+    large->plan = *plan;
+    large->left = plan->count;
+    large->failed = 0;
+
+    TreeTask task;
+    task.kind = TASK_SEGMENT;
+    task.files = NULL;
+    task.count = 0;
+    task.large = large;
+    for (uint64_t seg = 0; seg < plan->count; seg++)
+    {
+        task.segment = seg;
+        push_task(run, &task);
+    }
+}
+
+/**
+ * @brief Schedule one regular file.
+ *
+ * @param run  The run.
+ * @param in   Source path; now belongs to the run.
+ * @param out  Destination path; now belongs to the run.
+ * @param st   Status of the source.
+ */
+static void add_file(TreeRun *run, char *in, char *out,
+                     const struct stat *st)
+{
+    TreeFile file;
+    file.in = in;
+    file.out = out;
+    file.size = (uint64_t)st->st_size;
+    __atomic_add_fetch(&run->files_total, 1, __ATOMIC_RELAXED);
+
+    ContainerPlan plan;
+    if (!run->extract && file.size > run->segsize)
+    {
+        if (container_plan_create(in, out, run->segsize, &plan) != 0)
+        {
+            file_done(run, &file, -1);
+            free_file(&file);
+            return;
+        }
+        __atomic_add_fetch(&run->bytes_total, plan.length,
+                           __ATOMIC_RELAXED);
+        push_segments(run, &file, &plan);
+        return;
+    }
+    /* the segment size may be below TREE_SMALL, so probe every size */
+    if (run->extract && file.size >= CONTAINER_HEADER)
+    {
+        int rc = container_plan_extract(in, out, &plan);
+        if (rc < 0)
+        {
+            file_done(run, &file, -1);
+            free_file(&file);
+            return;
+        }
+        if (rc == 0)
+        {
+            __atomic_add_fetch(&run->bytes_total, plan.length,
+                               __ATOMIC_RELAXED);
+            push_segments(run, &file, &plan);
+            return;
+        }
+    }
+
+    __atomic_add_fetch(&run->bytes_total, file.size, __ATOMIC_RELAXED);
+    if (file.size <= TREE_SMALL)
+    {
+        if (run->bundle_bytes + file.size > TREE_BUNDLE_BYTES)
+        {
+            flush_bundle(run);
+        }
+        run->bundle[run->bundle_count++] = file;
+        run->bundle_bytes += (size_t)file.size;
+        if (run->bundle_count == TREE_BUNDLE_FILES)
+        {
+            flush_bundle(run);
+        }
+        return;
+    }
+
+    TreeTask task;
+    task.kind = TASK_FILE;
+    task.files = malloc(sizeof(TreeFile));
+    assert(task.files != NULL);
+    task.files[0] = file;
+    task.count = 1;
+    task.large = NULL;
+    task.segment = 0;
+    push_task(run, &task);
+}
+
+/**
+ * @brief Walk one source directory, creating its destination.
+ *
+ * @param run  The run.
+ * @param src  Source directory.
+ * @param dst  Destination directory, which already exists.
+ */
+static void walk(TreeRun *run, const char *src, const char *dst)
+{
+    DIR *dir = opendir(src);
+    if (dir == NULL)
+    {
+        perror(src);
+        __atomic_add_fetch(&run->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        char *in = join_path(src, ent->d_name);
+        char *out = join_path(dst, ent->d_name);
+        struct stat st;
+        if (lstat(in, &st) != 0)
+        {
+            perror(in);
+            __atomic_add_fetch(&run->failed, 1, __ATOMIC_RELAXED);
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            add_file(run, in, out, &st);
+            continue;
+        }
+        else if (S_ISDIR(st.st_mode))
+        {
+            /* never descend into the output when it is inside the input */
+            if (st.st_dev != run->dst_dev || st.st_ino != run->dst_ino)
+            {
+                if (mkdir(out, 0777) != 0 && errno != EEXIST)
+                {
+                    perror(out);
+                    __atomic_add_fetch(&run->failed, 1, __ATOMIC_RELAXED);
+                }
+                else
+                {
+                    walk(run, in, out);
+                }
+            }
+        }
+        else
+        {
+            __atomic_add_fetch(&run->skipped, 1, __ATOMIC_RELAXED);
+        }
+        free(in);
+        free(out);
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief Translate a directory tree.
+ *
+ * @param keybytes  Key read from the key file.
+ * @param srcdir    Directory to read.
+ * @param dstdir    Directory to write; created if missing.
+ * @param segsize   Segment size for large files; must be > 0.
+ * @param extract   Nonzero to extract containers instead of creating them.
+ * @param jobs      Number of worker threads, or 0 for one per online CPU.
+ *
+ * @return 0 if every file was translated, or -1 otherwise.
+ */
+int tree_run(const uint8_t keybytes[8], const char *srcdir,
+             const char *dstdir, uint64_t segsize, int extract, int jobs)
+{
+    assert(segsize > 0);
+
+    struct stat srcst;
+    struct stat dstst;
+    if (stat(srcdir, &srcst) != 0 || !S_ISDIR(srcst.st_mode))
+    {
+        fprintf(stderr, "error: %s is not a directory\n", srcdir);
+        return -1;
+    }
+    if ((mkdir(dstdir, 0777) != 0 && errno != EEXIST) ||
+        stat(dstdir, &dstst) != 0 || !S_ISDIR(dstst.st_mode))
+    {
+        fprintf(stderr, "error: cannot create directory %s\n", dstdir);
+        return -1;
+    }
+    if (srcst.st_dev == dstst.st_dev && srcst.st_ino == dstst.st_ino)
+    {
+        fprintf(stderr, "error: source and destination are the same\n");
+        return -1;
+    }
+
+    if (jobs <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+
+    TreeRun *run = calloc(1, sizeof(*run));
+    assert(run != NULL);
+    run->keybytes = keybytes;
+    run->primed = ks_create(keybytes);
+    run->segsize = segsize;
+    run->extract = extract;
+    run->dst_dev = dstst.st_dev;
+    run->dst_ino = dstst.st_ino;
+    run->workers = jobs;
+    run->limit = (long)jobs * TREE_QUEUE_PER_WORKER;
+    pthread_mutex_init(&run->lock, NULL);
+    pthread_cond_init(&run->work, NULL);
+    pthread_cond_init(&run->space, NULL);
+    pthread_cond_init(&run->done, NULL);
+    run->bundle = malloc(TREE_BUNDLE_FILES * sizeof(TreeFile));
+    assert(run->bundle != NULL);
+    clock_gettime(CLOCK_MONOTONIC, &run->start);
+
+    run->deques = calloc((size_t)jobs, sizeof(TreeDeque));
+    pthread_t *threads = malloc((size_t)jobs * sizeof(pthread_t));
+    assert(run->deques != NULL && threads != NULL);
+    for (int n = 0; n < jobs; n++)
+    {
+        run->deques[n].cap = TREE_QUEUE_PER_WORKER;
+        run->deques[n].items = malloc(TREE_QUEUE_PER_WORKER *
+                                      sizeof(TreeTask));
+        assert(run->deques[n].items != NULL);
+        pthread_mutex_init(&run->deques[n].lock, NULL);
+    }
+
+    int started = 0;
+    for (; started < jobs; started++)
+    {
+        if (pthread_create(&threads[started], NULL, tree_worker, run) != 0)
+        {
+            break;
+        }
+    }
+    if (started == 0)
+    {
+        /* no workers: queue everything, then work through it here */
+        run->limit = LONG_MAX;
+    }
+    /* the redrawn progress line is only of use on a terminal */
+    pthread_t progress;
+    int reporting = isatty(STDERR_FILENO) &&
+                    pthread_create(&progress, NULL, tree_progress, run) == 0;
+
+    walk(run, srcdir, dstdir);
+    flush_bundle(run);
+
+    pthread_mutex_lock(&run->lock);
+    run->walk_done = 1;
+    pthread_cond_broadcast(&run->work);
+    pthread_mutex_unlock(&run->lock);
+
+    if (started == 0)
+    {
+        tree_worker(run);
+    }
+    for (int n = 0; n < started; n++)
+    {
+        pthread_join(threads[n], NULL);
+    }
+
+    pthread_mutex_lock(&run->lock);
+    run->finished = 1;
+    pthread_cond_signal(&run->done);
+    pthread_mutex_unlock(&run->lock);
+    if (reporting)
+    {
+        pthread_join(progress, NULL);
+    }
+
+    double secs = elapsed(run);
+    fprintf(stderr, "tree: %llu files (%llu containers), %llu failed, "
+                    "%llu skipped, %llu bytes in %.3f s "
+                    "(%.1f MB/s, %d threads, %llu steals)\n",
+            (unsigned long long)run->files_done,
+            (unsigned long long)run->containers,
+            (unsigned long long)run->failed,
+            (unsigned long long)run->skipped,
+            (unsigned long long)run->bytes_done, secs,
+            secs > 0 ? (double)run->bytes_done / 1e6 / secs : 0.0,
+            started > 0 ? started : 1, (unsigned long long)run->steals);
+
+    int status = run->failed == 0 ? 0 : -1;
+
+    for (int n = 0; n < jobs; n++)
+    {
+        free(run->deques[n].items);
+        pthread_mutex_destroy(&run->deques[n].lock);
+    }
+    free(run->deques);
+    free(threads);
+    free(run->bundle);
+    ks_destroy(run->primed);
+    pthread_cond_destroy(&run->done);
+    pthread_cond_destroy(&run->space);
+    pthread_cond_destroy(&run->work);
+    pthread_mutex_destroy(&run->lock);
+    free(run);
+
+    return status;
+}
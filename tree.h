@@ -0,0 +1,61 @@
+/**
+ * @file tree.h
+ * @author Shane Girolamo
+ *
+ * @brief Recursive directory mode for mcrypt.
+ *
+ * `mcrypt -r key-file src-dir dst-dir` translates every regular file
+ * under src-dir into the same relative path under dst-dir, creating
+ * directories as it goes. Files are scheduled by size:
+ *
+ *  - small files, up to TREE_SMALL bytes, are bundled, read into memory
+ *    together and translated by one ks_translate_multi() call, so
+ *    millions of tiny files do not cost a task each;
+ *  - files up to one segment are translated as plain streams, exactly
+ *    as `mcrypt key-file in-file out-file` would;
+ *  - files longer than one segment become containers, and each of their
+ *    segments is a task of its own, so a few huge files at the end of a
+ *    run still keep every core busy.
+ *
+ * With extract set, files that are valid containers are extracted and
+ * all others translated, which undoes an encrypting run. Tasks are
+ * spread over per-worker queues and idle workers steal from the others.
+ * Symbolic links and special files are skipped.
+ */
+
+#ifndef TREE_H
+#define TREE_H
+
+#include <stdint.h>
+
+/**
+ * @brief Largest file, in bytes, that is bundled with others.
+ */
+#define TREE_SMALL (64 * 1024)
+
+/**
+ * @brief Translate a directory tree.
+ *
+ * When stderr is a terminal, a progress line there is redrawn about
+ * once a second while the tree is translated; a throughput summary is
+ * printed on stderr when it is done. Files that fail
+ * are reported and do not stop the others.
+ *
+ * @param keybytes  Key read from the key file.
+ * @param srcdir    Directory to read.
+ * @param dstdir    Directory to write; created if missing.
+ * @param segsize   Segment size for large files; files longer than this
+ *                  are written as containers. Must be > 0.
+ * @param extract   Nonzero to extract containers instead of creating
+ *                  them.
+ * @param jobs      Number of worker threads, or 0 for one per online CPU.
+ *
+ * @return 0 if every file was translated, or -1 otherwise.
+ */
+int tree_run(const uint8_t keybytes[8], const char *srcdir,
+             const char *dstdir, uint64_t segsize, int extract, int jobs);
+
+/**
+ * @brief End of the TREE_H include guard.
+ */
+#endif
@@ -0,0 +1,409 @@
+/**
+ * @file uring.c
+ * @author Shane Girolamo
+ *
+ * @brief Implementation of the minimal io_uring wrapper.
+ *
+ * The submission and completion rings are shared with the kernel through
+ * mmap. The application owns the submission tail and the completion
+ * head; the kernel owns the other two. Index updates are published with
+ * release stores and observed with acquire loads, as the io_uring ABI
+ * requires.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/**
+ * @brief Ring state; see io_uring_setup(2) for the field meanings.
+ */
+struct Uring
+{
+    int fd;                    /**< Ring file descriptor. */
+    int fixed;                 /**< Nonzero once buffers are registered. */
+    unsigned *sq_head;         /**< Kernel-owned submission head. */
+    unsigned *sq_tail;         /**< Application-owned submission tail. */
+    unsigned sq_mask;          /**< Submission ring index mask. */
+    unsigned sq_entries;       /**< Submission ring size. */
+    unsigned *sq_array;        /**< Submission index array. */
+    struct io_uring_sqe *sqes; /**< Submission queue entries. */
+    unsigned *cq_head;         /**< Application-owned completion head. */
+    unsigned *cq_tail;         /**< Kernel-owned completion tail. */
+    unsigned cq_mask;          /**< Completion ring index mask. */
+    struct io_uring_cqe *cqes; /**< Completion queue entries. */
+    unsigned pending;          /**< Queued but not yet submitted. */
+    void *sq_ring;             /**< Mapping of the submission ring. */
+    size_t sq_ring_len;        /**< Length of that mapping. */
+    void *cq_ring;             /**< Mapping of the completion ring. */
+    size_t cq_ring_len;        /**< Length of that mapping, or 0 if shared. */
+    size_t sqes_len;           /**< Length of the sqes mapping. */
+};
+
+/**
+ * @brief Set up a ring with room for `depth` requests in flight.
+ *
+ * @param depth  Queue depth.
+ *
+ * @return A new ring, or NULL if io_uring is unavailable.
+ */
+Uring *uring_init(unsigned depth)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    long fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    Uring *ring = calloc(1, sizeof(Uring));
+    if (ring == NULL)
+    {
+        close((int)fd);
+        return NULL;
+    }
+    ring->fd = (int)fd;
+
+    ring->sq_ring_len = params.sq_off.array +
+                        params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_len > ring->sq_ring_len)
+    {
+        ring->sq_ring_len = cq_len;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    if (single)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring_len = cq_len;
+        ring->cq_ring = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            munmap(ring->sq_ring, ring->sq_ring_len);
+            close(ring->fd);
+            free(ring);
+            return NULL;
+        }
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (!single)
+        {
+            munmap(ring->cq_ring, ring->cq_ring_len);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_len);
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    uint8_t *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+/**
+ * @brief Tear down a ring.
+ *
+ * @param ring  Ring returned by uring_init(), or NULL.
+ */
+void uring_destroy(Uring *ring)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_len);
+    close(ring->fd);
+    free(ring);
+}
+
+/**
+ * @brief Register fixed buffers with the kernel.
+ *
+ * @param ring   Ring to register with.
+ * @param bufs   Array of `count` buffers.
+ * @param len    Size of each buffer.
+ * @param count  Number of buffers.
+ *
+ * @return 0 if the buffers were registered, or -1 otherwise.
+ */
+int uring_register_buffers(Uring *ring, uint8_t *const *bufs, size_t len,
+                           unsigned count)
+{
+    struct iovec *iov = calloc(count, sizeof(struct iovec));
+    if (iov == NULL)
+    {
+        return -1;
+    }
+
+    for (unsigned n = 0; n < count; n++)
+    {
+        iov[n].iov_base = bufs[n];
+        iov[n].iov_len = len;
+    }
+
+    long rc = syscall(__NR_io_uring_register, ring->fd,
+                      IORING_REGISTER_BUFFERS, iov, count);
+    free(iov);
+
+    ring->fixed = rc == 0;
+    return rc == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Fill the next free submission entry.
+ *
+ * @param ring       Ring to queue on.
+ * @param op         Non-fixed opcode; switched to the fixed variant when
+ *                   buffers are registered and an index is given.
+ * @param fd         Target descriptor.
+ * @param buf        Buffer address.
+ * @param len        Transfer length.
+ * @param off        File offset.
+ * @param buf_index  Registered buffer index, or -1.
+ * @param user_data  Value reported back with the completion.
+ *
+ * @return 0 on success, or -1 if the submission queue is full.
+ */
+static int queue_rw(Uring *ring, int op, int fd, const void *buf,
+                    unsigned len, uint64_t off, int buf_index,
+                    uint64_t user_data)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    if (tail - head >= ring->sq_entries)
+    {
+        return -1;
+    }
+
+    unsigned idx = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    if (ring->fixed && buf_index >= 0)
+    {
+        op = op == IORING_OP_READ ? IORING_OP_READ_FIXED
+                                  : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = (uint16_t)buf_index;
+    }
+
+    sqe->opcode = (uint8_t)op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+
+    return 0;
+}
+
+/**
+ * @brief Queue a positioned read.
+ *
+ * @return 0 on success, or -1 if the submission queue is full.
+ */
+int uring_queue_read(Uring *ring, int fd, void *buf, unsigned len,
+                     uint64_t off, int buf_index, uint64_t user_data)
+{
+    return queue_rw(ring, IORING_OP_READ, fd, buf, len, off, buf_index,
+                    user_data);
+}
+
+/**
+ * @brief Queue a positioned write.
+ *
+ * @return 0 on success, or -1 if the submission queue is full.
+ */
+int uring_queue_write(Uring *ring, int fd, const void *buf, unsigned len,
+                      uint64_t off, int buf_index, uint64_t user_data)
+{
+    return queue_rw(ring, IORING_OP_WRITE, fd, buf, len, off, buf_index,
+                    user_data);
+}
+
+/**
+ * @brief Submit queued requests and wait for at least one completion.
+ *
+ * @param ring   Ring to use.
+ * @param out    Receives up to `max` completions.
+ * @param max    Capacity of `out`.
+ *
+ * @return Number of completions stored in `out`, or -1 on error.
+ */
+int uring_submit_and_wait(Uring *ring, UringCompletion *out, unsigned max)
+{
+    for (;;)
+    {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+
+        for (; head != tail && n < max; head++, n++)
+        {
+            const struct io_uring_cqe *cqe;
+            cqe = &ring->cqes[head & ring->cq_mask];
+            out[n].user_data = cqe->user_data;
+            out[n].res = cqe->res;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        /* with completions already in hand, only submit; otherwise
+         * submit and block until the kernel posts one */
+        unsigned wait = n > 0 ? 0 : 1;
+        unsigned flags = n > 0 ? 0 : IORING_ENTER_GETEVENTS;
+        if (n > 0 && ring->pending == 0)
+        {
+            return (int)n;
+        }
+
+        long rc = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait,
+                          flags, NULL, 0);
+        if (rc < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+        if (rc > 0)
+        {
+            ring->pending -= (unsigned)rc;
+        }
+        if (n > 0)
+        {
+            return (int)n;
+        }
+    }
+}
+
+#else
+
+/*
+ * Without io_uring every entry point fails, starting with uring_init(),
+ * so callers always take their fallback path.
+ */
+
+/**
+ * @brief Placeholder ring type on systems without io_uring.
+ */
+struct Uring
+{
+    int unused; /**< Never instantiated. */
+};
+
+Uring *uring_init(unsigned depth)
+{
+    (void)depth;
+    return NULL;
+}
+
+void uring_destroy(Uring *ring)
+{
+    (void)ring;
+}
+
+int uring_register_buffers(Uring *ring, uint8_t *const *bufs, size_t len,
+                           unsigned count)
+{
+    (void)ring;
+    (void)bufs;
+    (void)len;
+    (void)count;
+    return -1;
+}
+
+int uring_queue_read(Uring *ring, int fd, void *buf, unsigned len,
+                     uint64_t off, int buf_index, uint64_t user_data)
+{
+    (void)ring;
+    (void)fd;
+    (void)buf;
+    (void)len;
+    (void)off;
+    (void)buf_index;
+    (void)user_data;
+    return -1;
+}
+
+int uring_queue_write(Uring *ring, int fd, const void *buf, unsigned len,
+                      uint64_t off, int buf_index, uint64_t user_data)
+{
+    (void)ring;
+    (void)fd;
+    (void)buf;
+    (void)len;
+    (void)off;
+    (void)buf_index;
+    (void)user_data;
+    return -1;
+}
+
+int uring_submit_and_wait(Uring *ring, UringCompletion *out, unsigned max)
+{
+    (void)ring;
+    (void)out;
+    (void)max;
+    return -1;
+}
+
+#endif
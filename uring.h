@@ -0,0 +1,115 @@
+/**
+ * @file uring.h
+ * @author Shane Girolamo
+ *
+ * @brief Minimal io_uring wrapper used by the mcrypt I/O backends.
+ *
+ * Talks to the kernel directly through the io_uring_setup,
+ * io_uring_enter and io_uring_register system calls, so no extra
+ * library is needed. Only what mio needs is provided: positioned reads
+ * and writes into registered buffers, batched submission, and
+ * completion reaping. On systems without io_uring, uring_init() fails
+ * and callers fall back to another backend.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Opaque handle for one submission/completion ring pair.
+ */
+typedef struct Uring Uring;
+
+/**
+ * @brief One reaped completion.
+ */
+typedef struct
+{
+    uint64_t user_data; /**< Value given when the request was queued. */
+    int32_t res;        /**< Bytes transferred, or a negative errno. */
+} UringCompletion;
+
+/**
+ * @brief Set up a ring with room for `depth` requests in flight.
+ *
+ * @param depth  Queue depth; rounded up to a power of two by the kernel.
+ *
+ * @return A new ring, or NULL if io_uring is unavailable.
+ */
+Uring *uring_init(unsigned depth);
+
+/**
+ * @brief Tear down a ring.
+ *
+ * @param ring  Ring returned by uring_init(), or NULL.
+ */
+void uring_destroy(Uring *ring);
+
+/**
+ * @brief Register fixed buffers with the kernel.
+ *
+ * After a successful call, requests that name a buffer index use the
+ * READ_FIXED/WRITE_FIXED opcodes and skip the per-request page pinning.
+ * If registration fails, for example because of RLIMIT_MEMLOCK, requests
+ * keep working through the ordinary READ/WRITE opcodes.
+ *
+ * @param ring   Ring to register with.
+ * @param bufs   Array of `count` buffers.
+ * @param len    Size of each buffer.
+ * @param count  Number of buffers.
+ *
+ * @return 0 if the buffers were registered, or -1 otherwise.
+ */
+int uring_register_buffers(Uring *ring, uint8_t *const *bufs, size_t len,
+                           unsigned count);
+
+/**
+ * @brief Queue a positioned read.
+ *
+ * @param ring       Ring to queue on.
+ * @param fd         Descriptor to read from.
+ * @param buf        Destination.
+ * @param len        Number of bytes requested.
+ * @param off        File offset.
+ * @param buf_index  Index of `buf` among the registered buffers, or -1.
+ * @param user_data  Value reported back with the completion.
+ *
+ * @return 0 on success, or -1 if the submission queue is full.
+ */
+int uring_queue_read(Uring *ring, int fd, void *buf, unsigned len,
+                     uint64_t off, int buf_index, uint64_t user_data);
+
+/**
+ * @brief Queue a positioned write.
+ *
+ * @param ring       Ring to queue on.
+ * @param fd         Descriptor to write to.
+ * @param buf        Source.
+ * @param len        Number of bytes to write.
+ * @param off        File offset.
+ * @param buf_index  Index of `buf` among the registered buffers, or -1.
+ * @param user_data  Value reported back with the completion.
+ *
+ * @return 0 on success, or -1 if the submission queue is full.
+ */
+int uring_queue_write(Uring *ring, int fd, const void *buf, unsigned len,
+                      uint64_t off, int buf_index, uint64_t user_data);
+
+/**
+ * @brief Submit queued requests and wait for at least one completion.
+ *
+ * @param ring   Ring to use.
+ * @param out    Receives up to `max` completions.
+ * @param max    Capacity of `out`.
+ *
+ * @return Number of completions stored in `out`, or -1 on error.
+ */
+int uring_submit_and_wait(Uring *ring, UringCompletion *out, unsigned max);
+
+/**
+ * @brief End of the URING_H include guard.
+ */
+#endif